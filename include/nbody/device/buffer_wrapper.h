@@ -114,8 +114,12 @@ public:
 		reallocateBuffer(_size, _capacity, data);
 	}
 	
+	// Creates a buffer that isn't attached to a device yet. It can only be
+	// assigned to.
 	BufferWrapper(IOFlag flag) :
-			_flag(flag) {
+			_flag(flag),
+			_size(0),
+			_capacity(0) {
 	}
 	
 	// Get basic information.
@@ -245,7 +249,7 @@ public:
 	}
 	
 	// Copy between buffers.
-	void copyFrom(BufferWrapper<T> source) {
+	void copyFrom(BufferWrapper<T> const& source) {
 		std::size_t numCopy = std::min(_size, source._size);
 		if (numCopy != 0) {
 			_queue.enqueueCopyBuffer(
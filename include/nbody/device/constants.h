@@ -0,0 +1,66 @@
+#ifndef __NBODY_DEVICE_CONSTANTS_H_
+#define __NBODY_DEVICE_CONSTANTS_H_
+
+// Physical and numerical constants shared between the host and the device.
+// Each of them can be overridden when the kernels are built.
+
+// The softening length used when computing fields, so that the force between
+// two particles stays finite as they approach each other.
+#ifndef PARTICLE_RADIUS
+#define PARTICLE_RADIUS (0.01f)
+#endif
+
+// The constant in front of the inverse-square force law (negative for an
+// attractive force between charges of the same sign).
+//
+// With NBODY_MASS_CHANNEL, the charges and the masses each have their own
+// field. The charges then default to repelling each other, like electric
+// charges, and the masses attract each other with MASS_FORCE_CONSTANT.
+#ifndef FORCE_CONSTANT
+#ifdef NBODY_MASS_CHANNEL
+#define FORCE_CONSTANT (1.0f)
+#else
+#define FORCE_CONSTANT (-1.0f)
+#endif
+#endif
+#ifndef MASS_FORCE_CONSTANT
+#define MASS_FORCE_CONSTANT (-1.0f)
+#endif
+
+// The largest ratio of the sum of the radii of two nodes (around their centers
+// of charge) to the distance between them for which their interaction can be
+// approximated.
+#ifndef NODE_APPROX_RATIO
+#define NODE_APPROX_RATIO (0.5f)
+#endif
+
+// If NODE_ERROR_TOLERANCE is defined, then it replaces NODE_APPROX_RATIO. Two
+// nodes are approximated when the estimated relative error of the field of
+// each of them on the other is below the tolerance. The estimate accounts for
+// the size of the nodes around their centers of charge and the quadrupole
+// moments, so nodes with concentrated charge are opened less often.
+
+// When the long range forces are computed with a particle-mesh, PM_SPLIT_RADIUS
+// is defined as the distance at which the force is split between the mesh and
+// the octree. The octree then only computes the short range part of the force,
+// and ignores pairs of nodes further apart than PM_CUTOFF_FACTOR split radii.
+#ifndef PM_CUTOFF_FACTOR
+#define PM_CUTOFF_FACTOR (4.5f)
+#endif
+
+// In a periodic box, the field from the periodic images of a charge is
+// interpolated from a table with this many intervals along each axis.
+#ifndef EWALD_TABLE_SIZE
+#define EWALD_TABLE_SIZE (32)
+#endif
+
+// When REPRODUCIBLE_FORCES is defined, forces are summed as 64-bit fixed-point
+// numbers, so that the sum doesn't depend on the order of the terms. This is
+// the number of fixed-point units in a unit of force (it should be a power of
+// two, so that scaling a force is exact). Forces larger than 2^63 units
+// saturate.
+#ifndef FORCE_FIXED_POINT_SCALE
+#define FORCE_FIXED_POINT_SCALE (4294967296.0f)
+#endif
+
+#endif
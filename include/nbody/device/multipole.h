@@ -0,0 +1,97 @@
+#ifndef __NBODY_DEVICE_MULTIPOLE_H_
+#define __NBODY_DEVICE_MULTIPOLE_H_
+
+#ifndef __OPENCL_VERSION__
+#error "Header can only be used in OpenCL code."
+#endif
+
+#include "types.h"
+
+// Operations on the moments of nodes that are shared between the kernels.
+
+// Computes the product of the quadrupole tensor of a node with a vector.
+vector_t quadrupole_product(node_moment_t moment, vector_t r) {
+	vector_t trace = moment.quadrupole_trace_terms;
+	vector_t cross = moment.quadrupole_cross_terms;
+	return (vector_t) (
+		trace.x * r.x + cross.z * r.y + cross.y * r.z,
+		cross.z * r.x + trace.y * r.y + cross.x * r.z,
+		cross.y * r.x + cross.x * r.y + trace.z * r.z,
+		0);
+}
+
+// Adds a point charge 'q' at an offset 'r' from the center to a set of moments.
+node_moment_t add_point_moment(node_moment_t moment, vector_t r, scalar_t q) {
+	node_moment_t result = moment;
+	result.charge += q;
+	result.dipole_moment += q * r;
+	result.quadrupole_cross_terms += (scalar_t) 3 * q * (vector_t) (
+		r.y * r.z,
+		r.x * r.z,
+		r.x * r.y,
+		0);
+	result.quadrupole_trace_terms += q * (vector_t) (
+		(scalar_t) 2 * r.x * r.x - r.y * r.y - r.z * r.z,
+		(scalar_t) 2 * r.y * r.y - r.x * r.x - r.z * r.z,
+		(scalar_t) 2 * r.z * r.z - r.x * r.x - r.y * r.y,
+		0);
+	return result;
+}
+
+// Moves the center of a set of moments by an offset (the old center minus the
+// new center).
+node_moment_t shift_moment(node_moment_t moment, vector_t offset) {
+	vector_t p = moment.dipole_moment;
+	vector_t d = offset;
+	scalar_t q = moment.charge;
+	scalar_t p_dot_d = dot(p, d);
+	scalar_t d_sq = dot(d, d);
+	
+	node_moment_t result = moment;
+	result.dipole_moment = p + q * d;
+	result.quadrupole_cross_terms += (scalar_t) 3 * (
+		(vector_t) (
+			p.y * d.z + p.z * d.y,
+			p.x * d.z + p.z * d.x,
+			p.x * d.y + p.y * d.x,
+			0) +
+		q * (vector_t) (d.y * d.z, d.x * d.z, d.x * d.y, 0));
+	result.quadrupole_trace_terms +=
+		(scalar_t) 6 * p * d - (scalar_t) 2 * p_dot_d +
+		q * ((scalar_t) 3 * d * d - d_sq);
+	result.quadrupole_trace_terms.w = 0;
+	return result;
+}
+
+#ifdef NBODY_MASS_CHANNEL
+// Swaps the moments of the charge of a node with the moments of its mass, so
+// that everything that works on the charge can be used on the mass as well.
+node_moment_t swap_channels(node_moment_t moment) {
+	node_moment_t result = moment;
+	result.charge = moment.mass;
+	result.dipole_moment = moment.mass_dipole_moment;
+	result.quadrupole_cross_terms = moment.mass_quadrupole_cross_terms;
+	result.quadrupole_trace_terms = moment.mass_quadrupole_trace_terms;
+	result.mass = moment.charge;
+	result.mass_dipole_moment = moment.dipole_moment;
+	result.mass_quadrupole_cross_terms = moment.quadrupole_cross_terms;
+	result.mass_quadrupole_trace_terms = moment.quadrupole_trace_terms;
+	return result;
+}
+
+// Replaces the moments of the mass of a node with the moments of the charge of
+// another set of moments.
+node_moment_t set_mass_channel(
+		node_moment_t moment,
+		node_moment_t mass_moment) {
+	node_moment_t result = moment;
+	result.mass = mass_moment.charge;
+	result.mass_dipole_moment = mass_moment.dipole_moment;
+	result.mass_quadrupole_cross_terms = mass_moment.quadrupole_cross_terms;
+	result.mass_quadrupole_trace_terms = mass_moment.quadrupole_trace_terms;
+	return result;
+}
+#endif
+
+#endif
+
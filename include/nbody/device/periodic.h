@@ -0,0 +1,91 @@
+#ifndef __NBODY_DEVICE_PERIODIC_H_
+#define __NBODY_DEVICE_PERIODIC_H_
+
+#ifndef __OPENCL_VERSION__
+#error "Header can only be used in OpenCL code."
+#endif
+
+#include "types.h"
+#include "constants.h"
+
+// When the simulation runs in a periodic box, PERIODIC_BOX_X, PERIODIC_BOX_Y,
+// and PERIODIC_BOX_Z are defined as the dimensions of the box.
+#ifdef PERIODIC_BOX_X
+#define PERIODIC_BOX \
+	((vector_t) (PERIODIC_BOX_X, PERIODIC_BOX_Y, PERIODIC_BOX_Z, 1))
+#endif
+
+// Finds the displacement to the nearest periodic image.
+vector_t minimum_image(vector_t r) {
+#ifdef PERIODIC_BOX
+	return r - PERIODIC_BOX * round(r / PERIODIC_BOX);
+#else
+	return r;
+#endif
+}
+
+// Interpolates the field of the periodic images of a unit charge (other than
+// the nearest one) from a table built on the host. The displacement should
+// already be the one to the nearest image.
+vector_t ewald_correction(global vector_t const* ewald_table, vector_t r) {
+#ifdef PERIODIC_BOX
+	// The table only covers one octant, since the correction is odd along each
+	// axis.
+	vector_t s = fabs(r) / (PERIODIC_BOX / 2) * EWALD_TABLE_SIZE;
+	s = clamp(s, (scalar_t) 0, (scalar_t) EWALD_TABLE_SIZE);
+	vector_t lower = min(floor(s), (vector_t) (EWALD_TABLE_SIZE - 1));
+	vector_t t = s - lower;
+	int4 cell = convert_int4(lower);
+	
+	// Trilinear interpolation between the eight surrounding entries.
+	int size = EWALD_TABLE_SIZE + 1;
+	vector_t result = (vector_t) (0);
+	for (int di = 0; di <= 1; ++di) {
+		for (int dj = 0; dj <= 1; ++dj) {
+			for (int dk = 0; dk <= 1; ++dk) {
+				scalar_t weight =
+					(di ? t.x : 1 - t.x) *
+					(dj ? t.y : 1 - t.y) *
+					(dk ? t.z : 1 - t.z);
+				int index =
+					((cell.x + di) * size + (cell.y + dj)) * size +
+					(cell.z + dk);
+				result += weight * ewald_table[index];
+			}
+		}
+	}
+	return copysign(result, r);
+#else
+	return (vector_t) (0);
+#endif
+}
+
+// Interpolates the field of the periodic images of a dipole 'p', from the
+// change in the field of a unit charge across one interval of the table along
+// the dipole.
+vector_t ewald_dipole_correction(
+		global vector_t const* ewald_table,
+		vector_t r,
+		vector_t p) {
+#ifdef PERIODIC_BOX
+	p.w = 0;
+	scalar_t p_mag = length(p);
+	if (p_mag == 0) {
+		return (vector_t) (0);
+	}
+	scalar_t h =
+		min(min(PERIODIC_BOX_X, PERIODIC_BOX_Y), PERIODIC_BOX_Z) /
+		(2 * EWALD_TABLE_SIZE);
+	vector_t step = h * p / p_mag;
+	// The charges of the dipole are displaced from the center, so the target
+	// is displaced the other way relative to them.
+	return -p_mag / (2 * h) * (
+		ewald_correction(ewald_table, r + step) -
+		ewald_correction(ewald_table, r - step));
+#else
+	return (vector_t) (0);
+#endif
+}
+
+#endif
+
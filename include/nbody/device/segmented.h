@@ -0,0 +1,29 @@
+#ifndef __NBODY_DEVICE_SEGMENTED_H_
+#define __NBODY_DEVICE_SEGMENTED_H_
+
+#ifndef __OPENCL_VERSION__
+#error "Header can only be used in OpenCL code."
+#endif
+
+#include "types.h"
+
+// Declares the kernel arguments of an array that is split between several
+// buffers by a SegmentedBufferWrapper: the number of elements in each segment,
+// followed by BUFFER_MAX_SEGMENTS pointers.
+#define SEGMENTED_BUFFER(type, name) \
+	index_t name##_segment_size, \
+	global type* name##_0, \
+	global type* name##_1, \
+	global type* name##_2, \
+	global type* name##_3
+
+// Accesses an element of a segmented array. The index is evaluated several
+// times, so it shouldn't have side effects.
+#define SEGMENTED_AT(name, index) \
+	(((index) / name##_segment_size == 0 ? name##_0 : \
+		(index) / name##_segment_size == 1 ? name##_1 : \
+		(index) / name##_segment_size == 2 ? name##_2 : \
+		name##_3)[(index) % name##_segment_size])
+
+#endif
+
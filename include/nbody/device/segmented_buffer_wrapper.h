@@ -0,0 +1,128 @@
+#ifndef __NBODY_DEVICE_SEGMENTED_BUFFER_WRAPPER_H_
+#define __NBODY_DEVICE_SEGMENTED_BUFFER_WRAPPER_H_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "nbody/device/buffer_wrapper.h"
+#include "nbody/device/cl_includes.h"
+#include "nbody/device/types.h"
+
+namespace nbody {
+namespace device {
+
+// An array that is split between several buffers of the same size, so that it
+// can be larger than the largest buffer that the device can allocate. Kernels
+// receive the size of the segments followed by every segment (see
+// segmented.h), and the segments past the end are bound to the first one.
+template<typename T>
+class SegmentedBufferWrapper {
+	
+private:
+	
+	std::vector<BufferWrapper<T> > _segments;
+	std::size_t _size;
+	std::size_t _segmentSize;
+	
+public:
+	
+	// Creates an array without any segments. It can only be assigned to.
+	SegmentedBufferWrapper() :
+			_size(0),
+			_segmentSize(0) {
+	}
+	
+	SegmentedBufferWrapper(
+			cl::Context const& context,
+			cl::CommandQueue const& queue,
+			IOFlag flag,
+			std::size_t size,
+			std::size_t maxSegmentSize) :
+			_size(size),
+			_segmentSize(std::max<std::size_t>(
+				std::min(size, maxSegmentSize),
+				1)) {
+		std::size_t numSegments =
+			size / _segmentSize +
+			(size % _segmentSize != 0) +
+			(size == 0);
+		if (numSegments > BUFFER_MAX_SEGMENTS) {
+			throw BufferWrapperException(
+				"Segmented buffer needs " + std::to_string(numSegments) +
+				" segments, but at most " +
+				std::to_string(BUFFER_MAX_SEGMENTS) + " are supported.");
+		}
+		for (std::size_t index = 0; index < numSegments; ++index) {
+			std::size_t segmentSize = std::min(
+				_segmentSize,
+				size - std::min(size, index * _segmentSize));
+			_segments.emplace_back(context, queue, flag, segmentSize);
+		}
+	}
+	
+	// Get basic information.
+	std::size_t size() const {
+		return _size;
+	}
+	std::size_t segmentSize() const {
+		return _segmentSize;
+	}
+	std::size_t numSegments() const {
+		return _segments.size();
+	}
+	// The last segment is only as large as it needed to be, so the capacity
+	// is the sum of the segments rather than a whole number of segments.
+	std::size_t capacity() const {
+		std::size_t result = 0;
+		for (BufferWrapper<T> const& segment : _segments) {
+			result += segment.capacity();
+		}
+		return result;
+	}
+	BufferWrapper<T>& segment(std::size_t index) {
+		return _segments[index];
+	}
+	
+	// Passes the segment size and the segments to a kernel, starting at the
+	// argument with the given index. Returns the index of the next argument.
+	cl_uint setArgs(cl::Kernel& kernel, cl_uint index) {
+		kernel.setArg<index_t>(index++, _segmentSize);
+		for (std::size_t segment = 0; segment < BUFFER_MAX_SEGMENTS; ++segment) {
+			kernel.setArg<cl::Buffer>(
+				index++,
+				_segments[segment < _segments.size() ? segment : 0].buffer());
+		}
+		return index;
+	}
+	
+	// Changes the size of the array without reallocating any of the segments,
+	// which must already have enough space between them.
+	void resize(std::size_t newSize) {
+		if (newSize > capacity()) {
+			throw BufferWrapperException(
+				"Segmented buffer of capacity " + std::to_string(capacity()) +
+				" can't be resized to " + std::to_string(newSize) + ".");
+		}
+		_size = newSize;
+		for (std::size_t index = 0; index < _segments.size(); ++index) {
+			_segments[index].resize(
+				std::min(
+					_segmentSize,
+					newSize - std::min(newSize, index * _segmentSize)),
+				true);
+		}
+	}
+	
+	void zero() {
+		for (BufferWrapper<T>& segment : _segments) {
+			segment.zero();
+		}
+	}
+};
+
+}
+}
+
+#endif
+
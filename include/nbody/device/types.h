@@ -16,16 +16,71 @@
 
 // These typedefs are used to index a buffer that stores the sizes of the
 // different types on the device.
-#define VERIFY_LEAF_T_INDEX        (0)
-#define VERIFY_NODE_T_INDEX        (1)
-#define VERIFY_LEAF_VALUE_T_INDEX  (2)
-#define VERIFY_NODE_VALUE_T_INDEX  (3)
-#define VERIFY_LEAF_MOMENT_T_INDEX (4)
-#define VERIFY_NODE_MOMENT_T_INDEX (5)
-#define VERIFY_LEAF_FIELD_T_INDEX  (6)
-#define VERIFY_NODE_FIELD_T_INDEX  (7)
-#define VERIFY_INTERACTION_T_INDEX (8)
-#define VERIFY_NUM_TYPES           (9)
+#define VERIFY_LEAF_T_INDEX         (0)
+#define VERIFY_NODE_T_INDEX         (1)
+#define VERIFY_LEAF_VALUE_T_INDEX   (2)
+#define VERIFY_NODE_VALUE_T_INDEX   (3)
+#define VERIFY_LEAF_MOMENT_T_INDEX  (4)
+#define VERIFY_NODE_MOMENT_T_INDEX  (5)
+#define VERIFY_LEAF_FIELD_T_INDEX   (6)
+#define VERIFY_NODE_FIELD_T_INDEX   (7)
+#define VERIFY_INTERACTION_T_INDEX  (8)
+#define VERIFY_FIXED_FORCE_T_INDEX  (9)
+#define VERIFY_COMPACT_LEAF_T_INDEX (10)
+#define VERIFY_NUM_TYPES            (11)
+
+// These are used to index the counts of the interactions that are appended to
+// each queue when interactions are reduced.
+#define QUEUE_REDUCIBLE_INDEX (0)
+#define QUEUE_LEAF_INDEX      (1)
+#define QUEUE_NODE_INDEX      (2)
+#define QUEUE_NUM_QUEUES      (3)
+
+// These are used to index the counters of the persistent traversal of the
+// octree.
+#define TRAVERSAL_HEAD_INDEX       (0)
+#define TRAVERSAL_TAIL_INDEX       (1)
+#define TRAVERSAL_PENDING_INDEX    (2)
+#define TRAVERSAL_OVERFLOW_INDEX   (3)
+#define TRAVERSAL_LEAF_COUNT_INDEX (4)
+#define TRAVERSAL_NODE_COUNT_INDEX (5)
+#define TRAVERSAL_NUM_COUNTERS     (6)
+
+// Number of components of the moments of a node that the cached field
+// operators act on (the charge, the dipole, and the quadrupole).
+#define OPERATOR_NUM_MOMENTS (10)
+
+// The bit of a node index in an interaction_t that holds a flag, which limits
+// the number of nodes to half of what an index_t can hold.
+#ifdef NBODY_INDEX_64
+// An OpenCL long always has 64 bits, but a host long may only have 32.
+#ifdef __KERNEL__
+#define INTERACTION_FLAG_BIT (0x8000000000000000ul)
+#else
+#define INTERACTION_FLAG_BIT (0x8000000000000000ull)
+#endif
+#else
+#define INTERACTION_FLAG_BIT (0x80000000u)
+#endif
+#define INTERACTION_PACK(node_index, flag) \
+	((node_index) | ((flag) ? INTERACTION_FLAG_BIT : 0))
+#define INTERACTION_NODE_A(interaction) \
+	((interaction).node_a_bits & ~INTERACTION_FLAG_BIT)
+#define INTERACTION_NODE_B(interaction) \
+	((interaction).node_b_bits & ~INTERACTION_FLAG_BIT)
+#define INTERACTION_CAN_APPROX(interaction) \
+	(((interaction).node_a_bits & INTERACTION_FLAG_BIT) != 0)
+#define INTERACTION_CAN_REDUCE(interaction) \
+	(((interaction).node_b_bits & INTERACTION_FLAG_BIT) != 0)
+
+// The largest value of a quantized coordinate, which maps to the far side of
+// the cell that the coordinate is relative to.
+#define QUANTIZED_MAX (65535)
+
+// The largest number of buffers that an array can be split between, so that it
+// can be larger than the largest allocation on the device. Must match the
+// number of pointers in SEGMENTED_BUFFER.
+#define BUFFER_MAX_SEGMENTS (4)
 
 #ifndef __KERNEL__
 namespace nbody {
@@ -33,19 +88,59 @@ namespace device {
 #endif
 
 
+// Indices are 32 bits wide unless NBODY_INDEX_64 is defined (both when
+// building the host code and the kernels). 64-bit indices are needed once
+// there are more than about four billion leafs or fields, but make the octree
+// larger and need 64-bit atomics on the device.
 #ifdef __KERNEL__
+#ifdef NBODY_INDEX_64
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+typedef ulong  index_t;
+typedef long   index_diff_t;
+#else
 typedef uint   index_t;
 typedef int    index_diff_t;
+#endif
 typedef float  scalar_t;
 typedef float4 vector_t;
 typedef uchar  byte_t;
+typedef ushort quantized_t;
+
+// Atomic operations on indices, which use the 64-bit versions when the indices
+// are 64 bits wide.
+#ifdef NBODY_INDEX_64
+#define INDEX_ATOMIC_ADD(p, value)              atom_add(p, value)
+#define INDEX_ATOMIC_INC(p)                     atom_inc(p)
+#define INDEX_ATOMIC_DEC(p)                     atom_dec(p)
+#define INDEX_ATOMIC_XCHG(p, value)             atom_xchg(p, value)
+#define INDEX_ATOMIC_CMPXCHG(p, compare, value) \
+	atom_cmpxchg(p, compare, value)
+#define INDEX_ATOMIC_OR(p, value)               atom_or(p, value)
+#define INDEX_ATOMIC_MAX(p, value)              atom_max(p, value)
+#else
+#define INDEX_ATOMIC_ADD(p, value)              atomic_add(p, value)
+#define INDEX_ATOMIC_INC(p)                     atomic_inc(p)
+#define INDEX_ATOMIC_DEC(p)                     atomic_dec(p)
+#define INDEX_ATOMIC_XCHG(p, value)             atomic_xchg(p, value)
+#define INDEX_ATOMIC_CMPXCHG(p, compare, value) \
+	atomic_cmpxchg(p, compare, value)
+#define INDEX_ATOMIC_OR(p, value)               atomic_or(p, value)
+#define INDEX_ATOMIC_MAX(p, value)              atomic_max(p, value)
+#endif
 #endif
 
 #ifndef __KERNEL__
+#ifdef NBODY_INDEX_64
+typedef cl_ulong index_t;
+typedef cl_long  index_diff_t;
+#else
 typedef cl_uint  index_t;
 typedef cl_int   index_diff_t;
-typedef cl_float scalar_t;
-typedef cl_uchar byte_t;
+#endif
+typedef cl_float  scalar_t;
+typedef cl_uchar  byte_t;
+typedef cl_ushort quantized_t;
 
 // This class mimics an array type (with the subscript operator) using the
 // built-in OpenCL vector type. This type is important so that vectors will be
@@ -83,7 +178,7 @@ typedef struct {
 } leaf_moment_t;
 
 
-// Stores the set of moments of a node.
+// Stores the set of moments of a node, taken about its center.
 typedef struct {
 	
 	scalar_t charge;
@@ -91,6 +186,22 @@ typedef struct {
 	vector_t quadrupole_cross_terms;
 	vector_t quadrupole_trace_terms;
 	
+#ifdef NBODY_MASS_CHANNEL
+	// The same moments of the mass of the node, about the same center, for
+	// the gravitational field.
+	scalar_t mass;
+	vector_t mass_dipole_moment;
+	vector_t mass_quadrupole_cross_terms;
+	vector_t mass_quadrupole_trace_terms;
+#endif
+	
+	// The center of the absolute charge of the node, and the distance from it
+	// to the furthest leaf. The moments are expanded about this center, and
+	// the radius is used to decide when the expansion can be used.
+	vector_t center;
+	scalar_t absolute_charge;
+	scalar_t radius;
+	
 } node_moment_t;
 
 
@@ -121,6 +232,21 @@ typedef struct {
 } leaf_t;
 
 
+// A copy of a leaf with only what is needed to compute its field, which is much
+// smaller than a leaf_t. The position is quantized relative to the cell of the
+// child-less node that contains the leaf, with each coordinate going from zero
+// at the near side of the cell to QUANTIZED_MAX at the far side.
+typedef struct {
+	
+	quantized_t position[3];
+	scalar_t charge;
+#ifdef NBODY_MASS_CHANNEL
+	scalar_t mass;
+#endif
+	
+} compact_leaf_t;
+
+
 // Open-CL compatible version of Octree::NodeInternal.
 typedef struct {
 	
@@ -141,22 +267,24 @@ typedef struct {
 } node_t;
 
 
-// Stores information about an interaction between two different nodes.
+// Stores an interaction between two different nodes. Huge numbers of these are
+// copied between the host and the devices, so they are packed into just the
+// indices of the two nodes (a single 64-bit word with 32-bit indices), and the
+// two flags are kept in the top bit of each index. They should only be read
+// and written through the INTERACTION_* macros.
+//
+// The position of the interaction among all of the interactions acting on
+// each of its nodes (its rank) is only needed once its fields are computed, so
+// it is kept in a separate array on the device, with two entries for each
+// interaction.
 typedef struct {
 	
-	// The first node.
-	index_t node_a_index;
-	// The second node.
-	index_t node_b_index;
-	// Each interaction involving the first node will have this unique index.
-	// The exact interactions have different indices from the approximate ones.
-	index_t node_a_interaction_index;
-	// Similarly with the second node.
-	index_t node_b_interaction_index;
-	// Are the nodes enough apart that their interaction can be approximated?
-	byte_t can_approx;
-	// Can the interaction be reduced into a set of simpler interactions?
-	byte_t can_reduce;
+	// The first node, with the top bit set if the nodes are far enough apart
+	// that their interaction can be approximated.
+	index_t node_a_bits;
+	// The second node, with the top bit set if the interaction can be reduced
+	// into a set of simpler interactions.
+	index_t node_b_bits;
 	
 } interaction_t;
 
@@ -167,6 +295,10 @@ typedef struct {
 typedef struct {
 	
 	vector_t field;
+#ifdef NBODY_MASS_CHANNEL
+	// The gravitational field, which acts on the mass instead of the charge.
+	vector_t mass_field;
+#endif
 	
 } leaf_field_t;
 
@@ -177,6 +309,9 @@ typedef struct {
 	// The point about which the expansion is being made.
 	vector_t point;
 	vector_t field;
+#ifdef NBODY_MASS_CHANNEL
+	vector_t mass_field;
+#endif
 	
 } node_field_t;
 
@@ -188,6 +323,18 @@ typedef struct {
 	
 } force_t;
 
+// Stores a force as fixed-point numbers (see FORCE_FIXED_POINT_SCALE), so that
+// forces can be added together in any order with the same result.
+typedef struct {
+	
+#ifdef __KERNEL__
+	long4 force;
+#else
+	cl_long force[4];
+#endif
+	
+} fixed_force_t;
+
 
 #ifndef __KERNEL__
 }
@@ -0,0 +1,178 @@
+#ifndef __NBODY_DISTRIBUTED_COMMUNICATOR_H_
+#define __NBODY_DISTRIBUTED_COMMUNICATOR_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace nbody {
+namespace distributed {
+
+// The collective operations that a distributed simulation needs to exchange
+// data between its ranks. Data is sent as raw bytes, so only trivially
+// copyable types can be exchanged.
+class Communicator {
+	
+public:
+	
+	using Bytes = std::vector<char>;
+	
+	virtual ~Communicator() {
+	}
+	
+	virtual std::size_t rank() const = 0;
+	virtual std::size_t size() const = 0;
+	
+	// Every rank sends a (possibly empty) block of data to every rank
+	// (including itself), and receives a block from every rank in return.
+	virtual std::vector<Bytes> allToAll(std::vector<Bytes> const& send) = 0;
+	
+	// Every rank sends the same block of data to every rank.
+	virtual std::vector<Bytes> allGather(Bytes const& send) {
+		return allToAll(std::vector<Bytes>(size(), send));
+	}
+	
+	// Typed versions of the above.
+	template<typename T>
+	std::vector<std::vector<T> > allToAll(
+			std::vector<std::vector<T> > const& send) {
+		std::vector<Bytes> sendBytes;
+		sendBytes.reserve(send.size());
+		for (std::vector<T> const& block : send) {
+			sendBytes.push_back(toBytes(block));
+		}
+		std::vector<Bytes> receiveBytes = allToAll(sendBytes);
+		std::vector<std::vector<T> > receive;
+		receive.reserve(receiveBytes.size());
+		for (Bytes const& block : receiveBytes) {
+			receive.push_back(fromBytes<T>(block));
+		}
+		return receive;
+	}
+	template<typename T>
+	std::vector<std::vector<T> > allGather(std::vector<T> const& send) {
+		std::vector<Bytes> receiveBytes = allGather(toBytes(send));
+		std::vector<std::vector<T> > receive;
+		receive.reserve(receiveBytes.size());
+		for (Bytes const& block : receiveBytes) {
+			receive.push_back(fromBytes<T>(block));
+		}
+		return receive;
+	}
+	
+private:
+	
+	template<typename T>
+	static Bytes toBytes(std::vector<T> const& data) {
+		static_assert(
+			std::is_trivially_copyable<T>::value,
+			"Only trivially copyable types can be communicated");
+		Bytes result(data.size() * sizeof(T));
+		if (!data.empty()) {
+			std::memcpy(result.data(), data.data(), result.size());
+		}
+		return result;
+	}
+	template<typename T>
+	static std::vector<T> fromBytes(Bytes const& data) {
+		static_assert(
+			std::is_trivially_copyable<T>::value,
+			"Only trivially copyable types can be communicated");
+		// The type might not be default constructible, so each value is
+		// copied through some aligned storage instead.
+		std::vector<T> result;
+		result.reserve(data.size() / sizeof(T));
+		for (std::size_t offset = 0; offset < data.size(); offset += sizeof(T)) {
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+			std::memcpy(&storage, data.data() + offset, sizeof(T));
+			result.push_back(*reinterpret_cast<T*>(&storage));
+		}
+		return result;
+	}
+	
+};
+
+// A communicator between ranks that are threads of the same process, which
+// exchange data through shared memory. This makes it possible to run (and
+// test) a distributed simulation on a single machine without MPI.
+class LocalCommunicator final : public Communicator {
+	
+private:
+	
+	// State shared between all of the ranks of a group.
+	struct Group {
+		std::size_t size;
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::size_t numWaiting;
+		std::size_t generation;
+		// Mailboxes indexed by [source][destination].
+		std::vector<std::vector<Bytes> > mail;
+	};
+	
+	std::shared_ptr<Group> _group;
+	std::size_t _rank;
+	
+	LocalCommunicator(std::shared_ptr<Group> group, std::size_t rank) :
+			_group(group),
+			_rank(rank) {
+	}
+	
+	void barrier();
+	
+public:
+	
+	// Creates the communicators for every rank of a group. Each of them must
+	// be used from a different thread.
+	static std::vector<LocalCommunicator> createGroup(std::size_t size);
+	
+	std::size_t rank() const override {
+		return _rank;
+	}
+	std::size_t size() const override {
+		return _group->size;
+	}
+	
+	using Communicator::allToAll;
+	using Communicator::allGather;
+	std::vector<Bytes> allToAll(std::vector<Bytes> const& send) override;
+	
+};
+
+#ifdef NBODY_USE_MPI
+// A communicator between the processes of MPI_COMM_WORLD. MPI must be
+// initialized before it is created.
+class MpiCommunicator final : public Communicator {
+	
+private:
+	
+	std::size_t _rank;
+	std::size_t _size;
+	
+public:
+	
+	MpiCommunicator();
+	
+	std::size_t rank() const override {
+		return _rank;
+	}
+	std::size_t size() const override {
+		return _size;
+	}
+	
+	using Communicator::allToAll;
+	using Communicator::allGather;
+	std::vector<Bytes> allToAll(std::vector<Bytes> const& send) override;
+	
+};
+#endif
+
+}
+}
+
+#endif
+
@@ -0,0 +1,118 @@
+#ifndef __NBODY_DISTRIBUTED_SIMULATION_H_
+#define __NBODY_DISTRIBUTED_SIMULATION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "nbody/device/types.h"
+#include "nbody/distributed/communicator.h"
+#include "nbody/host/essential_tree.h"
+#include "nbody/host/morton.h"
+
+#include "nbody/open_cl_simulation.h"
+#include "nbody/simulation.h"
+
+// Number of particles sampled along the space-filling curve by each rank when
+// choosing the partitions.
+#define NUM_CURVE_SAMPLES (1024)
+// Maximum number of particles in a cell of the locally essential tree that is
+// sent as individual particles rather than being refined further.
+#define ESSENTIAL_LEAF_CAPACITY (8)
+
+namespace nbody {
+
+// A simulation whose particles are split between several ranks (processes or
+// threads), each of which runs its own OpenClSimulation on its share. The
+// particles are partitioned into contiguous pieces of a Morton curve, so each
+// rank owns a compact region of space. Every step, each rank sends every other
+// rank a locally essential tree: the moments of its cells that are far enough
+// from the other rank's region to be approximated, and the individual
+// particles of the cells that aren't. The partitions are rebalanced using the
+// measured cost of each rank.
+class DistributedSimulation final :
+		public Simulation<device::scalar_t, device::vector_t> {
+	
+private:
+	
+	using EssentialNode = host::EssentialNode;
+	using EssentialLeaf = host::EssentialLeaf;
+	using DomainBounds = host::DomainBounds;
+	using CurveBox = host::CurveBox;
+	// A piece of the Morton curve, used to choose the partitions.
+	struct CurveSample {
+		host::morton_t key;
+		double cost;
+	};
+	distributed::Communicator& _communicator;
+	OpenClSimulation _local;
+	std::ostream& _log;
+	
+	// The box of the Morton curve, which covers the particles of every rank.
+	// It follows the particles (like the root of the local octrees), and the
+	// partitions are chosen again whenever it moves.
+	CurveBox _curveBox;
+	// Rank 'r' owns the particles with keys in [_splitters[r],
+	// _splitters[r + 1]).
+	std::vector<host::morton_t> _splitters;
+	std::size_t _rebalanceInterval;
+	std::size_t _stepIndex;
+	// The time taken by the last step on this rank, in seconds.
+	double _cost;
+	
+	// The essential trees received from the other ranks.
+	std::vector<EssentialNode> _remoteNodes;
+	std::vector<EssentialLeaf> _remoteLeafs;
+	
+	host::morton_t key(Particle const& particle) const;
+	std::size_t owner(host::morton_t key) const;
+	
+	bool fitCurveBox(std::vector<Particle> const& particles);
+	void rebalance(std::vector<Particle> const& particles);
+	std::vector<Particle> migrate(std::vector<Particle> const& particles);
+	void exchangeEssentialTrees(std::vector<Particle> const& particles);
+	void buildEssentialTree(
+		std::vector<Particle> const& particles,
+		std::vector<host::morton_t> const& keys,
+		std::size_t begin,
+		std::size_t end,
+		unsigned int depth,
+		device::vector_t cellPosition,
+		device::vector_t cellDimensions,
+		DomainBounds const& target,
+		std::vector<EssentialNode>& nodes,
+		std::vector<EssentialLeaf>& leafs) const;
+	void addRemoteForces(
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces) const;
+	
+public:
+	
+	// Every rank creates its own simulation with any share of the particles
+	// (they are redistributed during the first step). The local simulations
+	// are set up with 'solverSettings', which can't use a particle-mesh, a
+	// periodic box, or the operator cache. The partitions are rebalanced every
+	// 'rebalanceInterval' steps.
+	DistributedSimulation(
+		distributed::Communicator& communicator,
+		device::vector_t bounds,
+		std::vector<Particle> particles,
+		Scalar timeStep,
+		std::ostream& log,
+		DeviceSelection deviceSelection = DeviceSelection(),
+		SolverSettings solverSettings = SolverSettings(),
+		std::size_t rebalanceInterval = 1);
+	
+	Scalar step() override;
+	
+	// Only gives the particles owned by this rank.
+	std::vector<Particle> particles() const override;
+	
+};
+
+}
+
+#endif
+
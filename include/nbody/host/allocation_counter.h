@@ -0,0 +1,26 @@
+#ifndef __NBODY_HOST_ALLOCATION_COUNTER_H_
+#define __NBODY_HOST_ALLOCATION_COUNTER_H_
+
+#include <cstddef>
+
+namespace nbody {
+namespace host {
+
+// Whether the global operator new counts its allocations. Enabled by building
+// with NBODY_COUNT_ALLOCATIONS, which replaces operator new with a version
+// that counts every call before passing it on to malloc.
+#ifdef NBODY_COUNT_ALLOCATIONS
+constexpr bool countsAllocations = true;
+#else
+constexpr bool countsAllocations = false;
+#endif
+
+// The number of allocations made through the global operator new so far, by
+// any thread (always zero unless allocations are counted).
+std::size_t allocationCount();
+
+}
+}
+
+#endif
+
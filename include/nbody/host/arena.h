@@ -0,0 +1,134 @@
+#ifndef __NBODY_HOST_ARENA_H_
+#define __NBODY_HOST_ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Smallest chunk that an arena maps at once.
+#define ARENA_CHUNK_SIZE (64 << 20)
+// Size of a huge page. Chunks backed by huge pages are rounded up to it.
+#define ARENA_HUGE_PAGE_SIZE (2 << 20)
+
+namespace nbody {
+namespace host {
+
+// A monotonic arena for large lists that only live for a single step. Memory
+// is handed out from chunks that are mapped straight from the operating
+// system, and individual allocations are never freed. Instead, the whole arena
+// is reset at once, after which its chunks are reused from the start, so that
+// their pages are already faulted in. The chunks are only unmapped when the
+// arena is destroyed.
+//
+// The chunks can be backed by huge pages, which cuts down on page faults and
+// TLB misses when the lists are hundreds of megabytes long. Explicit huge pages
+// (MAP_HUGETLB) are tried first, and transparent huge pages (madvise) are used
+// if none are reserved.
+//
+// An arena isn't thread-safe.
+class Arena final {
+	
+private:
+	
+	struct Chunk {
+		char* data;
+		std::size_t size;
+	};
+	
+	std::vector<Chunk> _chunks;
+	// The chunk that allocations are currently taken from, and the offset of
+	// the next free byte in it.
+	std::size_t _chunkIndex;
+	std::size_t _offset;
+	bool _hugePages;
+	
+	Chunk mapChunk(std::size_t size) const;
+	
+public:
+	
+	explicit Arena(bool hugePages = false);
+	~Arena();
+	
+	Arena(Arena const&) = delete;
+	Arena& operator=(Arena const&) = delete;
+	
+	// Whether chunks mapped from now on are backed by huge pages.
+	void setHugePages(bool hugePages) {
+		_hugePages = hugePages;
+	}
+	bool hugePages() const {
+		return _hugePages;
+	}
+	
+	void* allocate(std::size_t size, std::size_t alignment);
+	// Makes all of the memory of the arena available again. Anything that was
+	// allocated before must not be used afterwards.
+	void reset();
+	
+	// The total size of the chunks, which only changes when the arena grows.
+	std::size_t capacity() const;
+	
+};
+
+// An allocator that takes its memory from an arena, so that containers using
+// it never call operator new and free nothing until the arena is reset. An
+// allocator without an arena falls back to operator new, so that containers can
+// be created before the arena is known. The arena follows the contents of a
+// container when it is moved or swapped.
+template<typename T>
+class ArenaAllocator {
+	
+private:
+	
+	template<typename U>
+	friend class ArenaAllocator;
+	
+	Arena* _arena;
+	
+public:
+	
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+	
+	ArenaAllocator(Arena* arena = nullptr) : _arena(arena) {
+	}
+	template<typename U>
+	ArenaAllocator(ArenaAllocator<U> const& other) : _arena(other._arena) {
+	}
+	
+	Arena* arena() const {
+		return _arena;
+	}
+	
+	T* allocate(std::size_t n) {
+		if (_arena == nullptr) {
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+		return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+	}
+	
+	void deallocate(T* pointer, std::size_t) {
+		if (_arena == nullptr) {
+			::operator delete(pointer);
+		}
+	}
+	
+};
+
+template<typename T, typename U>
+bool operator==(ArenaAllocator<T> const& a, ArenaAllocator<U> const& b) {
+	return a.arena() == b.arena();
+}
+template<typename T, typename U>
+bool operator!=(ArenaAllocator<T> const& a, ArenaAllocator<U> const& b) {
+	return a.arena() != b.arena();
+}
+
+}
+}
+
+#endif
+
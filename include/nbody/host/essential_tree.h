@@ -0,0 +1,228 @@
+#ifndef __NBODY_HOST_ESSENTIAL_TREE_H_
+#define __NBODY_HOST_ESSENTIAL_TREE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "nbody/device/constants.h"
+#include "nbody/device/types.h"
+#include "nbody/host/multipole.h"
+#include "nbody/host/thread_pool.h"
+
+// The box of the Morton curve over a set of particles is a cube larger than the
+// particles by this fraction, so that it doesn't need to be moved again right
+// away.
+#define CURVE_BOX_MARGIN (0.25f)
+// The box is shrunk when the particles fill less than this fraction of it.
+#define CURVE_BOX_MIN_FILL (0.5f)
+
+namespace nbody {
+namespace host {
+
+// The pieces of a locally essential tree, which stands in for a set of
+// particles that aren't part of a simulation: the moments of the cells that are
+// far enough away to be approximated, and the individual particles of the
+// cells that aren't.
+
+// A cell of a locally essential tree, with moments taken about its center.
+struct EssentialNode {
+	device::vector_t center;
+	device::node_moment_t moment;
+};
+
+// A particle that is too close to be approximated. The mass is only used with
+// NBODY_MASS_CHANNEL.
+struct EssentialLeaf {
+	device::vector_t position;
+	device::scalar_t charge;
+	device::scalar_t mass;
+};
+
+// The region of space containing a set of particles.
+struct DomainBounds {
+	device::vector_t min;
+	device::vector_t max;
+	std::uint64_t numParticles;
+};
+
+// Finds the region containing a set of particles, where 'position' gives the
+// position of the particle with an index.
+template<typename F>
+DomainBounds computeDomainBounds(std::size_t numParticles, F position) {
+	DomainBounds bounds;
+	bounds.numParticles = numParticles;
+	for (unsigned int i = 0; i < 3; ++i) {
+		bounds.min[i] = std::numeric_limits<device::scalar_t>::max();
+		bounds.max[i] = std::numeric_limits<device::scalar_t>::lowest();
+	}
+	for (std::size_t index = 0; index < numParticles; ++index) {
+		device::vector_t next = position(index);
+		for (unsigned int i = 0; i < 3; ++i) {
+			bounds.min[i] = std::min(bounds.min[i], next[i]);
+			bounds.max[i] = std::max(bounds.max[i], next[i]);
+		}
+	}
+	return bounds;
+}
+
+// Combines the regions of several sets of particles into one.
+inline DomainBounds mergeDomainBounds(std::vector<DomainBounds> const& bounds) {
+	// Start from the (empty) region of no particles.
+	DomainBounds result = computeDomainBounds(
+		0,
+		[](std::size_t) {
+			return device::vector_t();
+		});
+	for (DomainBounds const& next : bounds) {
+		if (next.numParticles == 0) {
+			continue;
+		}
+		result.numParticles += next.numParticles;
+		for (unsigned int i = 0; i < 3; ++i) {
+			result.min[i] = std::min(result.min[i], next.min[i]);
+			result.max[i] = std::max(result.max[i], next.max[i]);
+		}
+	}
+	return result;
+}
+
+// The cube at the root of a Morton curve. The cells of the essential trees are
+// the cells of an octree over this cube, so it has to contain every particle
+// for the cells to contain their particles.
+struct CurveBox {
+	device::vector_t position;
+	device::vector_t dimensions;
+};
+
+// Whether a curve box has to be moved to cover a region, either because part
+// of the region is outside of it, or because the region only fills a small
+// part of it.
+inline bool shouldFitCurveBox(CurveBox const& box, DomainBounds const& bounds) {
+	if (bounds.numParticles == 0) {
+		return false;
+	}
+	if (!(box.dimensions[0] > 0)) {
+		return true;
+	}
+	device::scalar_t extent = 0;
+	for (unsigned int i = 0; i < 3; ++i) {
+		if (
+				bounds.min[i] < box.position[i] ||
+				bounds.max[i] >= box.position[i] + box.dimensions[i]) {
+			return true;
+		}
+		extent = std::max(extent, bounds.max[i] - bounds.min[i]);
+	}
+	return extent < CURVE_BOX_MIN_FILL * box.dimensions[0];
+}
+
+// Finds a curve box around a region, with some room to spare on every side.
+inline CurveBox fitCurveBox(DomainBounds const& bounds) {
+	device::scalar_t extent = 0;
+	for (unsigned int i = 0; i < 3; ++i) {
+		extent = std::max(extent, bounds.max[i] - bounds.min[i]);
+	}
+	// A region with no extent (a single particle) still needs a box.
+	device::scalar_t size = (1 + CURVE_BOX_MARGIN) * extent;
+	if (!(size > 0)) {
+		size = 1;
+	}
+	CurveBox box;
+	for (unsigned int i = 0; i < 3; ++i) {
+		box.position[i] = (bounds.min[i] + bounds.max[i]) / 2 - size / 2;
+		box.dimensions[i] = size;
+	}
+	return box;
+}
+
+// Finds the center of a cell, and whether the cell is far enough from a region
+// for its moments to be used there. Uses the same acceptance criterion as the
+// octree interactions.
+inline bool isWellSeparated(
+		device::vector_t cellPosition,
+		device::vector_t cellDimensions,
+		DomainBounds const& target,
+		device::vector_t& center) {
+	// Find the distance from the center of the cell to the closest point of
+	// the target region.
+	device::scalar_t distanceSq = 0;
+	for (unsigned int i = 0; i < 3; ++i) {
+		center[i] = cellPosition[i] + cellDimensions[i] / 2;
+		device::scalar_t offset = std::max({
+			target.min[i] - center[i],
+			center[i] - target.max[i],
+			device::scalar_t(0) });
+		distanceSq += offset * offset;
+	}
+	device::scalar_t extentSq =
+		device::scalar_t(3.0 / 4.0) * cellDimensions[0] * cellDimensions[0];
+	return extentSq < NODE_APPROX_RATIO * NODE_APPROX_RATIO * distanceSq;
+}
+
+// Adds the forces from a locally essential tree to the forces on each leaf.
+inline void addEssentialForces(
+		std::vector<EssentialNode> const& nodes,
+		std::vector<EssentialLeaf> const& essentialLeafs,
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces) {
+	ThreadPool::global().parallelFor(
+		0, numLeafs,
+		[&](std::size_t leafIndex) {
+			device::leaf_t const& leaf = leafs[leafIndex];
+			device::scalar_t field[3] = { 0, 0, 0 };
+			device::scalar_t massField[3] = { 0, 0, 0 };
+			for (EssentialNode const& node : nodes) {
+				device::vector_t next = momentField(
+					node.moment,
+					node.center,
+					leaf.position);
+				for (unsigned int i = 0; i < 3; ++i) {
+					field[i] += next[i];
+				}
+#ifdef NBODY_MASS_CHANNEL
+				device::vector_t nextMass = momentField(
+					swapChannels(node.moment),
+					node.center,
+					leaf.position,
+					MASS_FORCE_CONSTANT);
+				for (unsigned int i = 0; i < 3; ++i) {
+					massField[i] += nextMass[i];
+				}
+#endif
+			}
+			for (EssentialLeaf const& essentialLeaf : essentialLeafs) {
+				device::vector_t next = chargeField(
+					essentialLeaf.charge,
+					essentialLeaf.position,
+					leaf.position);
+				for (unsigned int i = 0; i < 3; ++i) {
+					field[i] += next[i];
+				}
+#ifdef NBODY_MASS_CHANNEL
+				device::vector_t nextMass = chargeField(
+					essentialLeaf.mass,
+					essentialLeaf.position,
+					leaf.position,
+					MASS_FORCE_CONSTANT);
+				for (unsigned int i = 0; i < 3; ++i) {
+					massField[i] += nextMass[i];
+				}
+#endif
+			}
+			for (unsigned int i = 0; i < 3; ++i) {
+				forces[leafIndex][i] +=
+					leaf.value.moment.charge * field[i] +
+					leaf.value.mass * massField[i];
+			}
+		});
+}
+
+}
+}
+
+#endif
+
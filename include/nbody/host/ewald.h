@@ -0,0 +1,29 @@
+#ifndef __NBODY_HOST_EWALD_H_
+#define __NBODY_HOST_EWALD_H_
+
+#include <vector>
+
+#include "nbody/device/constants.h"
+#include "nbody/device/types.h"
+
+namespace nbody {
+namespace host {
+
+// Computes the field of every periodic image of a unit charge at the origin,
+// except for the nearest one, using Ewald summation. The field has the same
+// form as the field of a charge in the kernels, so the periodic field of a
+// charge is the field of its nearest image plus this correction.
+device::vector_t ewaldCorrection(device::vector_t box, device::vector_t r);
+
+// Tabulates the Ewald correction for a periodic box on a grid of
+// (EWALD_TABLE_SIZE + 1)^3 displacements covering [0, box / 2]. Entry (i, j, k)
+// is stored at index (i * (EWALD_TABLE_SIZE + 1) + j) * (EWALD_TABLE_SIZE + 1) +
+// k. The correction is odd along each axis, so the other octants follow by
+// symmetry.
+std::vector<device::vector_t> computeEwaldTable(device::vector_t box);
+
+}
+}
+
+#endif
+
@@ -0,0 +1,75 @@
+#ifndef __NBODY_HOST_FIRST_TOUCH_ALLOCATOR_H_
+#define __NBODY_HOST_FIRST_TOUCH_ALLOCATOR_H_
+
+#include <cstddef>
+#include <new>
+
+#include "nbody/host/thread_pool.h"
+
+#define FIRST_TOUCH_PAGE_SIZE (4096)
+
+namespace nbody {
+namespace host {
+
+// An allocator that touches every page of newly allocated memory from the
+// thread of the global ThreadPool that will later process it. On NUMA systems,
+// the operating system places pages on the node of the thread that first
+// writes to them, so arrays processed with ThreadPool::parallelFor end up
+// spread across the nodes in the same way as the work.
+template<typename T>
+class FirstTouchAllocator {
+	
+public:
+	
+	using value_type = T;
+	
+	FirstTouchAllocator() {
+	}
+	template<typename U>
+	FirstTouchAllocator(FirstTouchAllocator<U> const&) {
+	}
+	
+	T* allocate(std::size_t n) {
+		T* result = static_cast<T*>(::operator new(n * sizeof(T)));
+		// Small allocations fit in a few pages, so they aren't worth waking up
+		// the threads for.
+		std::size_t numBytes = n * sizeof(T);
+		if (numBytes >= ThreadPool::global().size() * FIRST_TOUCH_PAGE_SIZE) {
+			char* bytes = reinterpret_cast<char*>(result);
+			ThreadPool::global().run([&](std::size_t threadIndex) {
+				// Split by element, the same way that parallelFor does.
+				std::pair<std::size_t, std::size_t> range =
+					ThreadPool::global().chunk(threadIndex, 0, n);
+				std::size_t byteBegin = range.first * sizeof(T);
+				std::size_t byteEnd = range.second * sizeof(T);
+				for (
+						std::size_t byte = byteBegin;
+						byte < byteEnd;
+						byte += FIRST_TOUCH_PAGE_SIZE) {
+					bytes[byte] = 0;
+				}
+			});
+		}
+		return result;
+	}
+	
+	void deallocate(T* pointer, std::size_t) {
+		::operator delete(pointer);
+	}
+	
+};
+
+template<typename T, typename U>
+bool operator==(FirstTouchAllocator<T> const&, FirstTouchAllocator<U> const&) {
+	return true;
+}
+template<typename T, typename U>
+bool operator!=(FirstTouchAllocator<T> const&, FirstTouchAllocator<U> const&) {
+	return false;
+}
+
+}
+}
+
+#endif
+
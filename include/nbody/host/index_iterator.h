@@ -0,0 +1,119 @@
+#ifndef __NBODY_HOST_INDEX_ITERATOR_H_
+#define __NBODY_HOST_INDEX_ITERATOR_H_
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace nbody {
+namespace host {
+
+// A random access iterator that gives the result of a function of its index,
+// so that a range can be passed to something expecting iterators without
+// being stored first. The function isn't copied, so it has to outlive the
+// iterator.
+template<typename F>
+class IndexIterator final {
+	
+public:
+	
+	using value_type = typename std::decay<
+		decltype(std::declval<F const&>()(std::size_t()))>::type;
+	using difference_type = std::ptrdiff_t;
+	using reference = value_type;
+	using pointer = void;
+	using iterator_category = std::random_access_iterator_tag;
+	
+private:
+	
+	F const* _function;
+	difference_type _index;
+	
+public:
+	
+	IndexIterator() :
+			_function(NULL),
+			_index(0) {
+	}
+	IndexIterator(F const& function, difference_type index) :
+			_function(&function),
+			_index(index) {
+	}
+	
+	value_type operator*() const {
+		return (*_function)(static_cast<std::size_t>(_index));
+	}
+	value_type operator[](difference_type offset) const {
+		return (*_function)(static_cast<std::size_t>(_index + offset));
+	}
+	
+	IndexIterator& operator++() {
+		++_index;
+		return *this;
+	}
+	IndexIterator operator++(int) {
+		IndexIterator result = *this;
+		++_index;
+		return result;
+	}
+	IndexIterator& operator--() {
+		--_index;
+		return *this;
+	}
+	IndexIterator operator--(int) {
+		IndexIterator result = *this;
+		--_index;
+		return result;
+	}
+	IndexIterator& operator+=(difference_type offset) {
+		_index += offset;
+		return *this;
+	}
+	IndexIterator& operator-=(difference_type offset) {
+		_index -= offset;
+		return *this;
+	}
+	IndexIterator operator+(difference_type offset) const {
+		return IndexIterator(*_function, _index + offset);
+	}
+	IndexIterator operator-(difference_type offset) const {
+		return IndexIterator(*_function, _index - offset);
+	}
+	difference_type operator-(IndexIterator const& other) const {
+		return _index - other._index;
+	}
+	
+	bool operator==(IndexIterator const& other) const {
+		return _index == other._index;
+	}
+	bool operator!=(IndexIterator const& other) const {
+		return _index != other._index;
+	}
+	bool operator<(IndexIterator const& other) const {
+		return _index < other._index;
+	}
+	bool operator>(IndexIterator const& other) const {
+		return _index > other._index;
+	}
+	bool operator<=(IndexIterator const& other) const {
+		return _index <= other._index;
+	}
+	bool operator>=(IndexIterator const& other) const {
+		return _index >= other._index;
+	}
+	
+};
+
+template<typename F>
+IndexIterator<F> indexIterator(F const& function, std::size_t index) {
+	return IndexIterator<F>(
+		function,
+		static_cast<std::ptrdiff_t>(index));
+}
+
+}
+}
+
+#endif
+
@@ -0,0 +1,69 @@
+#ifndef __NBODY_HOST_MAPPED_FILE_H_
+#define __NBODY_HOST_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+
+namespace nbody {
+namespace host {
+
+// A file that is mapped into memory, so that it can be used as an array larger
+// than the memory of the machine. Pages are read in by the operating system as
+// they are touched, and can be read ahead or dropped early with 'prefetch' and
+// 'release'.
+class MappedFile final {
+	
+private:
+	
+	std::string _path;
+	int _fd;
+	char* _data;
+	std::size_t _size;
+	
+	void map();
+	void unmap();
+	
+public:
+	
+	// Maps an existing file.
+	explicit MappedFile(std::string path);
+	// Creates a file of a certain size (or resizes an existing one), and maps
+	// it.
+	MappedFile(std::string path, std::size_t size);
+	
+	MappedFile(MappedFile const& other) = delete;
+	MappedFile(MappedFile&& other);
+	MappedFile& operator=(MappedFile const& other) = delete;
+	MappedFile& operator=(MappedFile&& other);
+	
+	~MappedFile();
+	
+	std::string const& path() const {
+		return _path;
+	}
+	std::size_t size() const {
+		return _size;
+	}
+	template<typename T>
+	T* data() const {
+		return reinterpret_cast<T*>(_data);
+	}
+	
+	// Starts reading a range of bytes in the background.
+	void prefetch(std::size_t offset, std::size_t length);
+	// Writes back a range of bytes and drops it from memory.
+	void release(std::size_t offset, std::size_t length);
+	// Tells the operating system that the whole file is about to be read in
+	// order.
+	void adviseSequential();
+	
+	// Renames the file, keeping it mapped.
+	void rename(std::string path);
+	
+};
+
+}
+}
+
+#endif
+
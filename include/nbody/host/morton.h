@@ -0,0 +1,66 @@
+#ifndef __NBODY_HOST_MORTON_H_
+#define __NBODY_HOST_MORTON_H_
+
+#include <cstdint>
+
+#include "nbody/device/types.h"
+
+// Number of bits used for each dimension of a Morton key.
+#define MORTON_BITS (21)
+
+namespace nbody {
+namespace host {
+
+typedef std::uint64_t morton_t;
+
+// Spreads the lowest 21 bits of a number out so that there are two zero bits
+// between each of them.
+inline morton_t mortonSpread(morton_t x) {
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffff;
+	x = (x | x << 16) & 0x1f0000ff0000ff;
+	x = (x | x << 8) & 0x100f00f00f00f00f;
+	x = (x | x << 4) & 0x10c30c30c30c30c3;
+	x = (x | x << 2) & 0x1249249249249249;
+	return x;
+}
+
+// Computes the Morton key of a position within a box. Positions outside of the
+// box are clamped to its faces. Sorting by Morton key puts particles in the
+// same order as a depth-first traversal of an octree over the box.
+inline morton_t mortonKey(
+		device::vector_t position,
+		device::vector_t boxPosition,
+		device::vector_t boxDimensions) {
+	morton_t key = 0;
+	for (unsigned int i = 0; i < 3; ++i) {
+		double fraction =
+			(position[i] - boxPosition[i]) / boxDimensions[i];
+		double scaled = fraction * (1 << MORTON_BITS);
+		morton_t cell;
+		if (!(scaled > 0)) {
+			cell = 0;
+		}
+		else if (scaled >= (1 << MORTON_BITS) - 1) {
+			cell = (1 << MORTON_BITS) - 1;
+		}
+		else {
+			cell = static_cast<morton_t>(scaled);
+		}
+		key |= mortonSpread(cell) << (2 - i);
+	}
+	return key;
+}
+
+// Gives the octant (from 0 to 7) of a key at a certain depth of the octree,
+// where the root is depth 0.
+inline unsigned int mortonOctant(morton_t key, unsigned int depth) {
+	return static_cast<unsigned int>(
+		(key >> (3 * (MORTON_BITS - depth - 1))) & 7);
+}
+
+}
+}
+
+#endif
+
@@ -0,0 +1,156 @@
+#ifndef __NBODY_HOST_MULTIPOLE_H_
+#define __NBODY_HOST_MULTIPOLE_H_
+
+#include <cmath>
+
+#include "nbody/device/constants.h"
+#include "nbody/device/types.h"
+
+namespace nbody {
+namespace host {
+
+// Host versions of the multipole computations done by the kernels. These are
+// used wherever moments have to be evaluated outside of the octree on the
+// device (for example, for moments received from other processes).
+
+// Adds a point to one set of moments (the charge, the dipole moment, and the
+// quadrupole terms) taken about a center.
+inline void addPointMoment(
+		device::scalar_t& total,
+		device::vector_t& dipoleMoment,
+		device::vector_t& quadrupoleCrossTerms,
+		device::vector_t& quadrupoleTraceTerms,
+		device::vector_t center,
+		device::vector_t position,
+		device::scalar_t charge) {
+	device::scalar_t r[3];
+	for (unsigned int i = 0; i < 3; ++i) {
+		r[i] = position[i] - center[i];
+	}
+	device::scalar_t rSq = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+	total += charge;
+	for (unsigned int i = 0; i < 3; ++i) {
+		dipoleMoment[i] += charge * r[i];
+		quadrupoleTraceTerms[i] += charge * (3 * r[i] * r[i] - rSq);
+	}
+	quadrupoleCrossTerms[0] += 3 * charge * r[1] * r[2];
+	quadrupoleCrossTerms[1] += 3 * charge * r[0] * r[2];
+	quadrupoleCrossTerms[2] += 3 * charge * r[0] * r[1];
+}
+
+// Adds the contribution of a particle to a set of moments taken about a
+// center. The mass is only used with NBODY_MASS_CHANNEL.
+inline void addMoment(
+		device::node_moment_t& moment,
+		device::vector_t center,
+		device::vector_t position,
+		device::scalar_t charge,
+		device::scalar_t mass) {
+	addPointMoment(
+		moment.charge,
+		moment.dipole_moment,
+		moment.quadrupole_cross_terms,
+		moment.quadrupole_trace_terms,
+		center,
+		position,
+		charge);
+#ifdef NBODY_MASS_CHANNEL
+	addPointMoment(
+		moment.mass,
+		moment.mass_dipole_moment,
+		moment.mass_quadrupole_cross_terms,
+		moment.mass_quadrupole_trace_terms,
+		center,
+		position,
+		mass);
+#else
+	(void) mass;
+#endif
+}
+
+#ifdef NBODY_MASS_CHANNEL
+// Exchanges the moments of the charge of a node with those of its mass, so
+// that the field of the mass can be found in the same way.
+inline device::node_moment_t swapChannels(device::node_moment_t moment) {
+	device::node_moment_t result = moment;
+	result.charge = moment.mass;
+	result.dipole_moment = moment.mass_dipole_moment;
+	result.quadrupole_cross_terms = moment.mass_quadrupole_cross_terms;
+	result.quadrupole_trace_terms = moment.mass_quadrupole_trace_terms;
+	result.mass = moment.charge;
+	result.mass_dipole_moment = moment.dipole_moment;
+	result.mass_quadrupole_cross_terms = moment.quadrupole_cross_terms;
+	result.mass_quadrupole_trace_terms = moment.quadrupole_trace_terms;
+	return result;
+}
+#endif
+
+// Computes the field at a point due to a set of moments about a center,
+// including the dipole and quadrupole terms.
+inline device::vector_t momentField(
+		device::node_moment_t const& moment,
+		device::vector_t center,
+		device::vector_t position,
+		device::scalar_t forceConstant = FORCE_CONSTANT) {
+	device::scalar_t r[3];
+	for (unsigned int i = 0; i < 3; ++i) {
+		r[i] = position[i] - center[i];
+	}
+	device::scalar_t rMagSq =
+		r[0] * r[0] + r[1] * r[1] + r[2] * r[2] +
+		PARTICLE_RADIUS * PARTICLE_RADIUS;
+	device::scalar_t rMag = std::sqrt(rMagSq);
+	device::scalar_t rInv3 = 1 / (rMagSq * rMag);
+	device::scalar_t rInv5 = rInv3 / rMagSq;
+	device::scalar_t rInv7 = rInv5 / rMagSq;
+	
+	// Product of the quadrupole tensor with the displacement.
+	device::vector_t const& trace = moment.quadrupole_trace_terms;
+	device::vector_t const& cross = moment.quadrupole_cross_terms;
+	device::scalar_t qr[3] = {
+		trace[0] * r[0] + cross[2] * r[1] + cross[1] * r[2],
+		cross[2] * r[0] + trace[1] * r[1] + cross[0] * r[2],
+		cross[1] * r[0] + cross[0] * r[1] + trace[2] * r[2]
+	};
+	device::scalar_t rqr = r[0] * qr[0] + r[1] * qr[1] + r[2] * qr[2];
+	device::scalar_t pr =
+		moment.dipole_moment[0] * r[0] +
+		moment.dipole_moment[1] * r[1] +
+		moment.dipole_moment[2] * r[2];
+	
+	device::vector_t field;
+	for (unsigned int i = 0; i < 3; ++i) {
+		field[i] = forceConstant * (
+			moment.charge * r[i] * rInv3 +
+			3 * pr * r[i] * rInv5 - moment.dipole_moment[i] * rInv3 +
+			device::scalar_t(2.5) * rqr * r[i] * rInv7 - qr[i] * rInv5);
+	}
+	return field;
+}
+
+// Computes the field at a point due to a single point charge.
+inline device::vector_t chargeField(
+		device::scalar_t charge,
+		device::vector_t source,
+		device::vector_t position,
+		device::scalar_t forceConstant = FORCE_CONSTANT) {
+	device::scalar_t r[3];
+	for (unsigned int i = 0; i < 3; ++i) {
+		r[i] = position[i] - source[i];
+	}
+	device::scalar_t rMagSq =
+		r[0] * r[0] + r[1] * r[1] + r[2] * r[2] +
+		PARTICLE_RADIUS * PARTICLE_RADIUS;
+	device::scalar_t rInv3 = 1 / (rMagSq * std::sqrt(rMagSq));
+	device::vector_t field;
+	for (unsigned int i = 0; i < 3; ++i) {
+		field[i] = forceConstant * charge * r[i] * rInv3;
+	}
+	return field;
+}
+
+}
+}
+
+#endif
+
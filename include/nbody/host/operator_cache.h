@@ -0,0 +1,59 @@
+#ifndef __NBODY_HOST_OPERATOR_CACHE_H_
+#define __NBODY_HOST_OPERATOR_CACHE_H_
+
+#include <array>
+#include <map>
+#include <vector>
+
+#include "nbody/device/types.h"
+
+namespace nbody {
+namespace host {
+
+// A cache of the linear operators that take the moments of a node (expanded
+// about its geometric center) to its field at the geometric center of another
+// node at the same depth. Nodes at the same depth are offset from each other by
+// a whole number of node sizes, and only a small set of offsets ever come up,
+// so the operators can be computed once and reused every step.
+//
+// Each operator is stored as OPERATOR_NUM_MOMENTS columns, in the order
+// charge, dipole (x, y, z), quadrupole cross terms (yz, xz, xy), and
+// quadrupole trace terms (xx, yy, zz). Only one of the offsets o and -o is
+// stored; the other is found by negating the columns of the odd terms (the
+// charge and the quadrupole).
+class OperatorCache final {
+	
+private:
+	
+	// Depth followed by the offset along each axis.
+	using Key = std::array<int, 4>;
+	
+	std::map<Key, device::index_diff_t> _indices;
+	std::vector<device::vector_t> _operators;
+	
+public:
+	
+	// Finds the operator for the field of a source node at a target node,
+	// computing it if it isn't in the cache yet. The result is one more than
+	// the index of the operator, and is negative if the operator has to be
+	// used in reverse. Zero means that the nodes aren't at the same depth, so
+	// no operator applies.
+	device::index_diff_t find(
+		device::node_t const& source,
+		device::node_t const& target);
+	
+	// Removes every operator (for example, when the root of the octree
+	// changes size).
+	void clear();
+	
+	std::vector<device::vector_t> const& operators() const {
+		return _operators;
+	}
+	
+};
+
+}
+}
+
+#endif
+
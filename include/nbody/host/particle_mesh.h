@@ -0,0 +1,85 @@
+#ifndef __NBODY_HOST_PARTICLE_MESH_H_
+#define __NBODY_HOST_PARTICLE_MESH_H_
+
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+#include "nbody/device/types.h"
+
+namespace nbody {
+namespace host {
+
+// Computes the long range part of the forces on a set of particles using a
+// particle-mesh method. The force law is split as
+//     1/r^2 = (long range, smooth) + (short range, decays as erfc(r / 2r_s)),
+// where r_s is the split radius. The charges are deposited onto a mesh with
+// cloud-in-cell weights, the potential of the long range part is found by an
+// FFT convolution, and its gradient is interpolated back to the particles. The
+// mesh is zero-padded to twice its size, so the boundaries are open.
+class ParticleMesh final {
+	
+private:
+	
+	using Complex = std::complex<double>;
+	
+	// Number of cells along each side of the mesh (a power of two).
+	std::size_t _size;
+	device::vector_t _position;
+	device::vector_t _dimensions;
+	double _spacing[3];
+	device::scalar_t _splitRadius;
+	
+	// Fourier transform of the long range Green's function on the padded mesh.
+	std::vector<Complex> _greenTransform;
+	// Workspaces reused between steps.
+	std::vector<Complex> _potential;
+	std::vector<double> _field[3];
+	// One line of the padded mesh for each thread of the pool, used by the
+	// transforms.
+	std::vector<Complex> _lines;
+	
+	std::size_t paddedIndex(std::size_t i, std::size_t j, std::size_t k) const {
+		std::size_t paddedSize = 2 * _size;
+		return (i * paddedSize + j) * paddedSize + k;
+	}
+	std::size_t meshIndex(std::size_t i, std::size_t j, std::size_t k) const {
+		return (i * _size + j) * _size + k;
+	}
+	
+	// Finds the cell-centered mesh point below a position, and the
+	// cloud-in-cell weight of the point above it (along each axis).
+	void cloudInCell(
+		device::vector_t position,
+		std::size_t (&cell)[3],
+		double (&weight)[3]) const;
+	
+	void computeGreenTransform();
+	void transform(std::vector<Complex>& data, bool inverse);
+	
+public:
+	
+	// Creates a mesh covering a box. The size is rounded up to a power of two.
+	ParticleMesh(
+		std::size_t size,
+		device::vector_t position,
+		device::vector_t dimensions,
+		device::scalar_t splitRadius);
+	
+	device::scalar_t splitRadius() const {
+		return _splitRadius;
+	}
+	
+	// Adds the long range forces to the forces on each of the leafs.
+	void addForces(
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces);
+	
+};
+
+}
+}
+
+#endif
+
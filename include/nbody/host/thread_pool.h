@@ -0,0 +1,193 @@
+#ifndef __NBODY_HOST_THREAD_POOL_H_
+#define __NBODY_HOST_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bytes of scratch space for each thread that are set aside when a pool is
+// created, for the results of reductions and scans.
+#define THREAD_POOL_SCRATCH_SIZE (128)
+
+namespace nbody {
+namespace host {
+
+// A fixed set of worker threads that can optionally be pinned to cores. Work
+// is always split statically, so that the same thread handles the same range
+// of every array. Together with the FirstTouchAllocator, this keeps each part
+// of an array in the memory of the NUMA node that uses it.
+class ThreadPool final {
+	
+private:
+	
+	std::vector<std::thread> _threads;
+	
+	// Only one task can be run at a time.
+	std::mutex _runMutex;
+	
+	std::mutex _mutex;
+	std::condition_variable _startCondition;
+	std::condition_variable _doneCondition;
+	// The task is only referred to while it runs, so that running a task
+	// never has to allocate a copy of it.
+	void const* _taskData;
+	void (*_taskFunction)(void const*, std::size_t);
+	std::size_t _generation;
+	std::size_t _numRemaining;
+	bool _stop;
+	
+	// Space for the result of each thread in a reduction or a scan. It is
+	// kept between calls, and only grows for types larger than any before.
+	std::mutex _scratchMutex;
+	std::vector<std::max_align_t> _scratch;
+	
+	void work(std::size_t threadIndex, int core);
+	void runTask(
+		void const* taskData,
+		void (*taskFunction)(void const*, std::size_t));
+	
+	// Gives the scratch space as an array of one value for each thread. The
+	// scratch mutex must be held while it is in use.
+	template<typename T>
+	T* scratch() {
+		static_assert(
+			std::is_trivially_copyable<T>::value,
+			"Only trivially copyable values can be kept in the scratch space");
+		std::size_t numBytes = size() * sizeof(T);
+		std::size_t numWords =
+			(numBytes + sizeof(std::max_align_t) - 1) /
+			sizeof(std::max_align_t);
+		if (_scratch.size() < numWords) {
+			_scratch.resize(numWords);
+		}
+		return reinterpret_cast<T*>(_scratch.data());
+	}
+	
+public:
+	
+	// Creates a pool with a certain number of threads (zero means one per
+	// hardware thread). If any cores are given, then each thread is pinned to
+	// one of them in turn.
+	ThreadPool(std::size_t numThreads = 0, std::vector<int> cores = {});
+	~ThreadPool();
+	
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+	
+	// The pool used by the host side of the simulations. It should be
+	// configured before any simulation is created.
+	static ThreadPool& global();
+	static void configureGlobal(std::size_t numThreads, std::vector<int> cores);
+	
+	std::size_t size() const {
+		return _threads.size();
+	}
+	
+	// Runs a task on every thread (passing it the thread index), and waits
+	// for all of them to finish.
+	template<typename F>
+	void run(F const& task) {
+		runTask(
+			&task,
+			[](void const* taskData, std::size_t threadIndex) {
+				(*static_cast<F const*>(taskData))(threadIndex);
+			});
+	}
+	
+	// Gives the range of [begin, end) that a certain thread is responsible for.
+	std::pair<std::size_t, std::size_t> chunk(
+			std::size_t threadIndex,
+			std::size_t begin,
+			std::size_t end) const {
+		std::size_t count = end - begin;
+		std::size_t numThreads = size();
+		return {
+			begin + count * threadIndex / numThreads,
+			begin + count * (threadIndex + 1) / numThreads
+		};
+	}
+	
+	// Calls a function for every index in [begin, end).
+	template<typename F>
+	void parallelFor(std::size_t begin, std::size_t end, F function) {
+		run([&](std::size_t threadIndex) {
+			std::pair<std::size_t, std::size_t> range =
+				chunk(threadIndex, begin, end);
+			for (std::size_t index = range.first; index < range.second; ++index) {
+				function(index);
+			}
+		});
+	}
+	
+	// Combines the values of a function at every index in [begin, end),
+	// starting from an identity value. The results of the threads are always
+	// combined in the same order.
+	template<typename T, typename F, typename C>
+	T parallelReduce(
+			std::size_t begin,
+			std::size_t end,
+			T identity,
+			F function,
+			C combine) {
+		std::lock_guard<std::mutex> scratchLock(_scratchMutex);
+		T* results = scratch<T>();
+		run([&](std::size_t threadIndex) {
+			std::pair<std::size_t, std::size_t> range =
+				chunk(threadIndex, begin, end);
+			T result = identity;
+			for (std::size_t index = range.first; index < range.second; ++index) {
+				result = combine(result, function(index));
+			}
+			results[threadIndex] = result;
+		});
+		T result = identity;
+		for (std::size_t threadIndex = 0; threadIndex < size(); ++threadIndex) {
+			result = combine(result, results[threadIndex]);
+		}
+		return result;
+	}
+	
+	// Replaces every element of [data, data + count) with the sum of itself
+	// and all of the elements before it.
+	template<typename T>
+	void parallelInclusiveScan(T* data, std::size_t count) {
+		std::lock_guard<std::mutex> scratchLock(_scratchMutex);
+		T* totals = scratch<T>();
+		// Scan each chunk separately.
+		run([&](std::size_t threadIndex) {
+			std::pair<std::size_t, std::size_t> range =
+				chunk(threadIndex, 0, count);
+			T sum = T();
+			for (std::size_t index = range.first; index < range.second; ++index) {
+				sum += data[index];
+				data[index] = sum;
+			}
+			totals[threadIndex] = sum;
+		});
+		// Then offset each chunk by the totals of the chunks before it.
+		T offset = T();
+		for (std::size_t threadIndex = 0; threadIndex < size(); ++threadIndex) {
+			T next = offset + totals[threadIndex];
+			totals[threadIndex] = offset;
+			offset = next;
+		}
+		run([&](std::size_t threadIndex) {
+			std::pair<std::size_t, std::size_t> range =
+				chunk(threadIndex, 0, count);
+			for (std::size_t index = range.first; index < range.second; ++index) {
+				data[index] += totals[threadIndex];
+			}
+		});
+	}
+	
+};
+
+}
+}
+
+#endif
+
@@ -1,6 +1,11 @@
 #ifndef __NBODY_OPEN_CL_SIMULATION_H_
 #define __NBODY_OPEN_CL_SIMULATION_H_
 
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -10,12 +15,89 @@
 #include "nbody/device/cl_includes.h"
 
 #include "nbody/device/buffer_wrapper.h"
+#include "nbody/device/segmented_buffer_wrapper.h"
 #include "nbody/device/types.h"
+#include "nbody/host/arena.h"
+#include "nbody/host/first_touch_allocator.h"
+#include "nbody/host/index_iterator.h"
+#include "nbody/host/operator_cache.h"
+#include "nbody/host/particle_mesh.h"
+#include "nbody/host/thread_pool.h"
 
 #include "nbody/simulation.h"
 
 namespace nbody {
 
+// Describes which OpenCL devices a simulation should be run on. Devices are
+// matched against every filter, and then taken in order starting from
+// 'deviceIndex'.
+struct DeviceSelection {
+	// Only use platforms whose name contains this string (empty for any).
+	std::string platformName;
+	// Only use devices whose name contains this string (empty for any).
+	std::string deviceName;
+	// Only use devices of this type.
+	cl_device_type deviceType = CL_DEVICE_TYPE_ALL;
+	// Index of the first matching device to use.
+	std::size_t deviceIndex = 0;
+	// Maximum number of matching devices to use. If more than one device is
+	// used, then the interactions are split between them. Zero means that
+	// every matching device is used.
+	std::size_t maxDevices = 1;
+	// Split every device that supports it into one sub-device per NUMA node.
+	// Each sub-device gets its own copy of the octree in memory local to its
+	// node, and is given the interactions from its own region of space.
+	bool numaFission = false;
+};
+
+// Describes the numerical methods that a simulation uses to compute the forces.
+struct SolverSettings {
+	// Number of cells along each side of the particle-mesh that computes the
+	// long range forces (rounded up to a power of two). Zero means that the
+	// octree computes the full forces by itself.
+	std::size_t meshSize = 0;
+	// Distance at which the forces are split between the octree and the
+	// particle-mesh. Zero means one and a quarter mesh cells.
+	device::scalar_t splitRadius = 0;
+	// Whether the bounds are a periodic box. Particles that leave through one
+	// side come back through the other, and the forces include every periodic
+	// image (using Ewald summation). Can't be combined with the particle-mesh.
+	bool periodic = false;
+	// Whether the root of the octree follows the particles. The root is
+	// expanded when particles leave it, and shrunk when the particles only fill
+	// a small part of it. Ignored in a periodic box or with the particle-mesh,
+	// since both of them depend on the bounds staying fixed.
+	bool automaticBounds = true;
+	// Target relative error of the field of one node on another for their
+	// interaction to be approximated. Zero means that nodes are approximated
+	// based only on their size and distance.
+	device::scalar_t nodeErrorTolerance = 0;
+	// Whether node interactions between nodes at the same depth use cached
+	// operators that take the moments of one node to its field at the other.
+	// Can't be combined with the particle-mesh or a periodic box, since the
+	// operators only include the plain Coulomb field.
+	bool operatorCache = false;
+	// Whether the interactions are found by a single kernel that walks the
+	// whole octree on the device. Otherwise, or if the walk runs out of space,
+	// the host drives the walk one level at a time.
+	bool persistentTraversal = true;
+	// Whether the forces are summed in fixed-point, so that they come out
+	// exactly the same no matter how the work is split into batches, threads,
+	// and devices.
+	bool reproducibleForces = false;
+	// Whether the leaf interactions read a compact copy of each leaf, with its
+	// position quantized to 16 bits relative to the cell of its node, instead
+	// of the full leaf. This reads a quarter as many bytes, at the cost of
+	// rounding the positions to 1/65535 of the size of a cell. Needs every
+	// particle to be inside of the root, so only works with automatic bounds
+	// or in a periodic box.
+	bool compactLeafs = false;
+	// Whether the lists of interactions on the host are backed by huge pages.
+	// They can be hundreds of megabytes long, so this saves a lot of page
+	// faults and TLB misses while sorting the interactions into batches.
+	bool hugePages = false;
+};
+
 class OpenClSimulation final :
 		public Simulation<device::scalar_t, device::vector_t> {
 	
@@ -29,10 +111,19 @@ private:
 		std::size_t workGroupSizeMultiple;
 	};
 	
+	// Arrays on the host that are processed in parallel by the global thread
+	// pool are first touched by the threads that process them.
+	template<typename T>
+	using HostVector = std::vector<T, host::FirstTouchAllocator<T> >;
+	// Lists that are only needed during a step are taken from an arena, which
+	// is reset at the end of the step.
+	template<typename T>
+	using ArenaVector = std::vector<T, host::ArenaAllocator<T> >;
+	
 	// Octree and simulation data.
 	struct OctreeInternalDetails {
 		template<typename T>
-		using VectorType = std::vector<T>;
+		using VectorType = HostVector<T>;
 		template<typename T>
 		using SizeType = device::index_t;
 		template<typename T>
@@ -46,160 +137,715 @@ private:
 		OctreeInternalDetails>;
 	
 	Octree _octree;
+	// Position of the lower corner and dimensions of the root of the octree.
+	device::vector_t _origin;
+	device::vector_t _bounds;
 	Scalar _time;
 	Scalar _timeStep;
 	
 	std::ostream& _log;
 	
-	// Global OpenCL objects needed by everything.
-	cl::Platform _platform;
-	cl::Device _device;
-	cl::Context _context;
-	cl::CommandQueue _queue;
-	
-	cl_ulong _deviceMaxBufferSize;
-	
-	// OpenCL kernels.
-	KernelData _kernelVerifyDeviceTypeSizes;
-	KernelData _kernelComputeMomentsFromLeafs;
-	KernelData _kernelComputeMomentsFromNodes;
-	KernelData _kernelFindInteractions;
-	KernelData _kernelComputeInteractionIndices;
-	KernelData _kernelComputeNodeMaxInteractionsLeafCount;
-	KernelData _kernelComputeLeafInteractionFields;
-	KernelData _kernelComputeNodeInteractionFields;
-	KernelData _kernelConvertLeafFieldsToForces;
-	KernelData _kernelConvertNodeFieldsToForces;
+	// Every OpenCL device has its own context, command queue, and kernels, so
+	// that devices from different platforms can be used together. The first
+	// device is the primary device, which is used to find the interactions.
+	struct DeviceData {
+		cl::Platform platform;
+		cl::Device device;
+		cl::Context context;
+		cl::CommandQueue queue;
+		
+		cl_ulong maxBufferSize;
+		cl_ulong globalMemSize;
+		cl_uint maxComputeUnits;
+		
+		// Whether the device is one of several NUMA sub-devices of a single
+		// device, in which case its buffers should be first touched by the
+		// device itself so that they are allocated on its own node.
+		bool isNumaSubDevice = false;
+		
+		// Table of the field from periodic images.
+		device::BufferWrapper<device::vector_t> ewaldTable =
+			device::BufferWrapper<device::vector_t>(device::IOFlag::Read);
+		
+		// OpenCL kernels.
+		KernelData kernelVerifyDeviceTypeSizes;
+		KernelData kernelComputeMomentsFromLeafs;
+		KernelData kernelComputeMomentsFromNodes;
+		KernelData kernelFindInteractions;
+		KernelData kernelTraverseInteractions;
+		KernelData kernelComputeInteractionEndpoints;
+		KernelData kernelSortInteractionEndpoints;
+		KernelData kernelFindInteractionEndpointSegments;
+		KernelData kernelRankInteractionEndpoints;
+		KernelData kernelComputeNodeMaxInteractionsLeafCount;
+		KernelData kernelComputeCompactLeafs;
+		KernelData kernelComputeLeafInteractionFields;
+		KernelData kernelComputeNodeInteractionOperatorFields;
+		KernelData kernelComputeNodeInteractionFields;
+		KernelData kernelConvertLeafFieldsToForces;
+		KernelData kernelConvertNodeFieldsToForces;
+	};
+	
+	DeviceSelection _deviceSelection;
+	SolverSettings _solverSettings;
+	std::vector<DeviceData> _devices;
+	// Whether each device is responsible for its own region of space, or
+	// whether all of the devices share the interactions.
+	bool _spatialPartitioning;
+	// Options passed to the compiler when building the kernels.
+	std::string _buildOptions;
+	// Capacity of the queues used by the persistent traversal. Grows whenever
+	// the traversal runs out of space.
+	std::size_t _traversalCapacity;
+	
+	// Long range forces, if they are split off from the octree.
+	std::unique_ptr<host::ParticleMesh> _particleMesh;
+	// Field from the periodic images of a charge, if the box is periodic.
+	std::vector<device::vector_t> _ewaldTable;
+	// Operators for node interactions, if they are cached.
+	host::OperatorCache _operatorCache;
 	
 	// Wrapper functions for the kernels to make it easier to use them.
-	void verifyDeviceTypeSizes();
+	void verifyDeviceTypeSizes(DeviceData& device);
 	void kernelComputeMomentsFromLeafs(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::index_t> processedNodes);
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::index_t>& processedNodes);
 	void kernelComputeMomentsFromNodes(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::index_t> processedNodes,
-		device::BufferWrapper<device::index_t> newProcessedNodes);
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::index_t>& processedNodes,
+		device::BufferWrapper<device::index_t>& newProcessedNodes);
 	void kernelFindInteractions(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> interactions,
-		device::BufferWrapper<device::interaction_t> newInteractions);
-	void kernelComputeInteractionIndices(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> interactions,
-		device::BufferWrapper<device::index_t> nodeNumInteractions);
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<device::interaction_t>& reducibleInteractions,
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_t>& queueCounts);
+	void kernelTraverseInteractions(
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& workQueue,
+		device::BufferWrapper<device::index_t>& workQueueReady,
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_t>& counters);
+	void kernelComputeInteractionEndpoints(
+		DeviceData& device,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<cl_ulong>& endpoints);
+	void kernelSortInteractionEndpoints(
+		DeviceData& device,
+		device::BufferWrapper<cl_ulong>& endpoints,
+		std::size_t blockSize,
+		std::size_t stride);
+	void kernelFindInteractionEndpointSegments(
+		DeviceData& device,
+		device::BufferWrapper<cl_ulong>& endpoints,
+		device::BufferWrapper<device::index_t>& nodeSegmentStarts,
+		device::BufferWrapper<device::index_t>& nodeNumInteractions);
+	void kernelRankInteractionEndpoints(
+		DeviceData& device,
+		device::BufferWrapper<cl_ulong>& endpoints,
+		device::BufferWrapper<device::index_t>& nodeSegmentStarts,
+		device::BufferWrapper<device::index_t>& nodeNumInteractions,
+		device::BufferWrapper<device::index_t>& interactionRanks);
 	void kernelComputeNodeMaxInteractionsLeafCount(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> interactions,
-		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount);
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<device::index_t>& nodeMaxInteractionsLeafCount);
+	void kernelComputeCompactLeafs(
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::compact_leaf_t>& compactLeafs);
 	void kernelComputeLeafInteractionFields(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> leafInteractions,
-		device::BufferWrapper<device::index_t> leafFieldIndices,
-		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount,
-		device::BufferWrapper<device::leaf_field_t> leafFields);
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::compact_leaf_t>& compactLeafs,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::index_t>& leafInteractionRanks,
+		device::BufferWrapper<device::index_t>& leafFieldIndices,
+		device::BufferWrapper<device::index_t>& nodeMaxInteractionsLeafCount,
+		device::SegmentedBufferWrapper<device::leaf_field_t>& leafFields);
+	void kernelComputeNodeInteractionOperatorFields(
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_diff_t>& nodeInteractionOperators,
+		device::BufferWrapper<device::vector_t>& operators,
+		device::BufferWrapper<device::vector_t>& interactionFields);
 	void kernelComputeNodeInteractionFields(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> nodeInteractions,
-		device::BufferWrapper<device::index_t> nodeFieldIndices,
-		device::BufferWrapper<device::index_t> nodeNumNodeParentInteractions,
-		device::BufferWrapper<device::node_field_t> nodeFields);
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_t>& nodeInteractionRanks,
+		device::BufferWrapper<device::index_t>& nodeFieldIndices,
+		device::BufferWrapper<device::index_t>& nodeNumNodeParentInteractions,
+		device::SegmentedBufferWrapper<device::node_field_t>& nodeFields,
+		device::BufferWrapper<device::vector_t>& interactionFields);
 	void kernelConvertLeafFieldsToForces(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::index_t> leafFieldIndices,
-		device::BufferWrapper<device::leaf_field_t> leafFields,
-		device::BufferWrapper<device::force_t> leafForces);
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::index_t>& leafFieldIndices,
+		device::SegmentedBufferWrapper<device::leaf_field_t>& leafFields,
+		device::BufferWrapper<device::force_t>& leafForces,
+		device::BufferWrapper<device::fixed_force_t>& leafFixedForces);
 	void kernelConvertNodeFieldsToForces(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::index_t> nodeFieldIndices,
-		device::BufferWrapper<device::node_field_t> nodeFields,
-		device::BufferWrapper<device::force_t> nodeForces);
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::index_t>& nodeFieldIndices,
+		device::SegmentedBufferWrapper<device::node_field_t>& nodeFields,
+		device::BufferWrapper<device::force_t>& nodeForces,
+		device::BufferWrapper<device::fixed_force_t>& nodeFixedForces);
+	
+	// Sets up the parts of the solver that depend on the settings and the
+	// bounds (the particle-mesh and the Ewald table).
+	void initializeSolver();
 	
 	// Convenience methods for interfacing with OpenCL.
 	void initialize();
-	cl::Program buildSourceFile(std::string fileName);
-	KernelData getKernel(cl::Program const& program, std::string kernelName);
+	std::vector<DeviceData> selectDevices();
+	std::vector<DeviceData> splitNumaDevice(DeviceData const& device);
+	void initializeDevice(DeviceData& device);
+	cl::Program buildSourceFile(DeviceData& device, std::string fileName);
+	KernelData getKernel(
+		DeviceData& device,
+		cl::Program const& program,
+		std::string kernelName);
+	
+	// Structures that hold buffers from intermediate computations. They are
+	// all kept in a workspace from one step to the next, and are only
+	// reallocated when a step needs more space than every step before it, so
+	// that a steady step doesn't allocate anything on the host or the devices.
+	// They are passed between the helpers by reference, and can't be copied.
 	
-	// Structures that hold buffers from intermediate computations.
+	// A set of leaf and node interactions that are to be evaluated.
+	struct InteractionBatch {
+		ArenaVector<device::interaction_t> leafInteractions;
+		ArenaVector<device::interaction_t> nodeInteractions;
+		// The cached operator of each node interaction (only used with the
+		// operator cache).
+		ArenaVector<device::index_diff_t> nodeOperators;
+		bool empty() const {
+			return leafInteractions.empty() && nodeInteractions.empty();
+		}
+		void clear() {
+			leafInteractions.clear();
+			nodeInteractions.clear();
+			nodeOperators.clear();
+		}
+	};
 	struct UnprocessedInteractionBuffers {
-		std::vector<device::interaction_t> interactions = {
-			{
-				0, 0,
-				0, 0,
-				false, true
-			}
+		ArenaVector<device::interaction_t> interactions;
+		// Reducible interactions that were found on the primary device and
+		// left there, to be reduced again without a round trip to the host.
+		device::BufferWrapper<device::interaction_t> residentInteractions {
+			device::IOFlag::ReadWrite
 		};
-		std::vector<device::interaction_t> leafInteractions;
-		std::vector<device::interaction_t> nodeInteractions;
+		// The leaf and node interactions that are waiting to be evaluated.
+		// When the interactions are partitioned spatially, there is one entry
+		// per device. Otherwise, there is a single entry shared by all devices.
+		std::vector<InteractionBatch> pending;
 		bool finished() const {
 			return
 				interactions.empty() &&
-				leafInteractions.empty() &&
-				nodeInteractions.empty();
+				residentInteractions.size() == 0 &&
+				std::all_of(
+					pending.begin(),
+					pending.end(),
+					[](InteractionBatch const& batch) {
+						return batch.empty();
+					});
 		}
 	};
 	struct OctreeBuffers {
-		device::BufferWrapper<device::leaf_t> leafs;
-		device::BufferWrapper<device::node_t> nodes;
+		device::BufferWrapper<device::leaf_t> leafs {
+			device::IOFlag::Read
+		};
+		device::BufferWrapper<device::node_t> nodes {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> processedNodes {
+			device::IOFlag::Read
+		};
+		device::BufferWrapper<device::index_t> newProcessedNodes {
+			device::IOFlag::Write
+		};
+		// The compact copies of the leafs (only used with compact leafs).
+		device::BufferWrapper<device::compact_leaf_t> compactLeafs {
+			device::IOFlag::ReadWrite
+		};
+	};
+	// The queues used to find the interactions, either one level at a time or
+	// by the persistent traversal.
+	struct QueueBuffers {
+		device::BufferWrapper<device::interaction_t> interactions {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::interaction_t> reducibleInteractions {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::interaction_t> leafInteractions {
+			device::IOFlag::Write
+		};
+		device::BufferWrapper<device::interaction_t> nodeInteractions {
+			device::IOFlag::Write
+		};
+		device::BufferWrapper<device::index_t> queueCounts {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::interaction_t> workQueue {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> workQueueReady {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> traversalCounters {
+			device::IOFlag::ReadWrite
+		};
 	};
 	struct InteractionBuffers {
-		device::BufferWrapper<device::interaction_t> leafInteractions;
-		device::BufferWrapper<device::interaction_t> nodeInteractions;
-		device::BufferWrapper<device::index_t> nodeNumLeafInteractions;
-		device::BufferWrapper<device::index_t> nodeNumNodeInteractions;
-		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount;
+		device::BufferWrapper<device::interaction_t> leafInteractions {
+			device::IOFlag::Read
+		};
+		device::BufferWrapper<device::interaction_t> nodeInteractions {
+			device::IOFlag::Read
+		};
+		// The rank of each interaction on each of its nodes, which is only
+		// ever needed on the device.
+		device::BufferWrapper<device::index_t> leafInteractionRanks {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> nodeInteractionRanks {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> nodeNumLeafInteractions {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> nodeNumNodeInteractions {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_diff_t> nodeInteractionOperators {
+			device::IOFlag::Read
+		};
+		device::BufferWrapper<device::vector_t> operators {
+			device::IOFlag::Read
+		};
+		// Used while finding the index of each interaction within the
+		// interactions of its nodes.
+		device::BufferWrapper<cl_ulong> endpoints {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::index_t> nodeSegmentStarts {
+			device::IOFlag::ReadWrite
+		};
 	};
 	struct ForceBuffers {
-		device::BufferWrapper<device::force_t> leafForces;
-		device::BufferWrapper<device::force_t> nodeForces;
+		device::BufferWrapper<device::index_t> leafFieldIndices {
+			device::IOFlag::Read
+		};
+		device::BufferWrapper<device::index_t> nodeFieldIndices {
+			device::IOFlag::Read
+		};
+		device::BufferWrapper<device::index_t> nodeNumNodeParentInteractions {
+			device::IOFlag::ReadWrite
+		};
+		device::SegmentedBufferWrapper<device::leaf_field_t> leafFields;
+		device::SegmentedBufferWrapper<device::node_field_t> nodeFields;
+		// The field of every node interaction (only used with the operator
+		// cache).
+		device::BufferWrapper<device::vector_t> interactionFields {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::force_t> leafForces {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::force_t> nodeForces {
+			device::IOFlag::ReadWrite
+		};
+		// Used instead of the above when the forces are reproducible.
+		device::BufferWrapper<device::fixed_force_t> leafFixedForces {
+			device::IOFlag::ReadWrite
+		};
+		device::BufferWrapper<device::fixed_force_t> nodeFixedForces {
+			device::IOFlag::ReadWrite
+		};
 	};
 	struct IntegrationBuffers {
-		std::vector<device::vector_t> newVelocities;
-		std::vector<device::vector_t> newPositions;
+		HostVector<device::vector_t> newVelocities;
+		HostVector<device::vector_t> newPositions;
+	};
+	// Everything that a device works on during a step.
+	struct DeviceWorkspace {
+		OctreeBuffers octreeBuffers;
+		QueueBuffers queueBuffers;
+		InteractionBuffers interactionBuffers;
+		ForceBuffers forceBuffers;
+		// The batch of interactions that the device is evaluating.
+		InteractionBatch batch;
+		// The forces found by the device, which are kept separate until the
+		// end of the step, when they are merged together.
+		HostVector<device::vector_t> forces;
+		HostVector<device::fixed_force_t> fixedForces;
+		
+		DeviceWorkspace() = default;
+		DeviceWorkspace(DeviceWorkspace const&) = delete;
+		DeviceWorkspace(DeviceWorkspace&&) = default;
+		DeviceWorkspace& operator=(DeviceWorkspace const&) = delete;
+		DeviceWorkspace& operator=(DeviceWorkspace&&) = default;
 	};
+	struct Workspace {
+		// Holds the lists of interactions, which only live for a single step.
+		host::Arena interactionArena;
+		std::vector<DeviceWorkspace> devices;
+		UnprocessedInteractionBuffers unprocessed;
+		IntegrationBuffers integrationBuffers;
+		// Scratch space for splitting the interactions into batches.
+		std::vector<device::index_t> planNodeNumLeafInteractions;
+		std::vector<device::index_t> planNodeMaxInteractionsLeafCount;
+		std::vector<device::index_diff_t> nodeOperators;
+		std::vector<std::pair<device::index_diff_t, device::interaction_t> >
+			operatorInteractions;
+		// Scratch space for handing out new interactions to their devices.
+		ArenaVector<device::interaction_t> newLeafInteractions;
+		ArenaVector<device::interaction_t> newNodeInteractions;
+		
+		Workspace() = default;
+		Workspace(Workspace const&) = delete;
+		Workspace& operator=(Workspace const&) = delete;
+	};
+	
+	Workspace _workspace;
+	
+	// Resets the arena of the lists of interactions. Every list is moved into
+	// the arena, with as much space as it had before, so that it doesn't have
+	// to grow again during the next step.
+	void resetInteractionLists();
 	
 	template<typename T>
 	device::BufferWrapper<T> createBuffer(
+			DeviceData& device,
 			device::IOFlag flag,
 			std::size_t size,
 			T const* data = NULL) {
-		return device::BufferWrapper<T>(_context, _queue, flag, size, data);
+		// A NUMA sub-device fills its buffers itself before any data is
+		// written, so that the pages are placed on the node of the
+		// sub-device rather than the node of the host thread.
+		if (device.isNumaSubDevice) {
+			device::BufferWrapper<T> result(
+				device.context,
+				device.queue,
+				flag,
+				size);
+			result.zero();
+			if (data != NULL) {
+				result.write(data);
+			}
+			return result;
+		}
+		return device::BufferWrapper<T>(
+			device.context,
+			device.queue,
+			flag,
+			size,
+			data);
 	}
 	
-	OctreeBuffers computeOctreeBuffers();
-	InteractionBuffers computeInteractionBuffers(
-		OctreeBuffers octreeBuffers,
+	// Creates a buffer that is split into segments when it is larger than the
+	// largest allocation on the device.
+	template<typename T>
+	device::SegmentedBufferWrapper<T> createSegmentedBuffer(
+			DeviceData& device,
+			device::IOFlag flag,
+			std::size_t size) {
+		device::SegmentedBufferWrapper<T> result(
+			device.context,
+			device.queue,
+			flag,
+			size,
+			device.maxBufferSize / sizeof(T));
+		if (device.isNumaSubDevice) {
+			result.zero();
+		}
+		return result;
+	}
+	
+	// Sets the size of a workspace buffer. It is only reallocated when it
+	// doesn't have enough space, and then gets exactly as much as it needs,
+	// since the batches are planned from the exact sizes of their buffers.
+	// The contents are not kept.
+	template<typename T>
+	void fitBuffer(
+			DeviceData& device,
+			device::BufferWrapper<T>& buffer,
+			std::size_t size,
+			T const* data = NULL) {
+		if (buffer.capacity() == 0 || size > buffer.capacity()) {
+			buffer = createBuffer<T>(device, buffer.ioFlag(), size);
+		}
+		else {
+			buffer.resize(size, true);
+		}
+		if (data != NULL) {
+			buffer.write(data);
+		}
+	}
+	template<typename T>
+	void fitSegmentedBuffer(
+			DeviceData& device,
+			device::SegmentedBufferWrapper<T>& buffer,
+			std::size_t size) {
+		if (buffer.numSegments() == 0 || size > buffer.capacity()) {
+			buffer = createSegmentedBuffer<T>(
+				device,
+				device::IOFlag::ReadWrite,
+				size);
+		}
+		else {
+			buffer.resize(size);
+		}
+	}
+	
+	// Gives up the space of the buffers whose sizes depend on the
+	// interactions in a batch.
+	void releaseBatchBuffers(DeviceWorkspace& workspace);
+	
+	void computeOctreeBuffers(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers);
+	void reduceInteractions(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		QueueBuffers& queueBuffers,
+		UnprocessedInteractionBuffers& unprocessed);
+	bool traverseInteractions(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		QueueBuffers& queueBuffers,
+		UnprocessedInteractionBuffers& unprocessed);
+	void readPendingInteractions(
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
 		UnprocessedInteractionBuffers& unprocessed);
-	ForceBuffers computeForceBuffers(
-		OctreeBuffers octreeBuffers,
-		InteractionBuffers interactionBuffers);
-	IntegrationBuffers computeIntegrationBuffers(
-		ForceBuffers forceBuffers,
-		IntegrationBuffers initialIntegrationBuffers);
-	void updateOctree(IntegrationBuffers integrationBuffers);
+	std::size_t interactionOwner(device::interaction_t interaction) const;
+	// Tracks the exact amount of device memory that a batch of interactions
+	// will need as interactions are added to it.
+	class BatchMemoryPlan;
+	// Moves as many of the pending interactions as fit on a device into the
+	// batch of its workspace.
+	void takeInteractionBatch(
+		DeviceData const& device,
+		DeviceWorkspace& workspace,
+		InteractionBatch& pending);
+	void computeInteractionIndices(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		InteractionBuffers& interactionBuffers,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<device::index_t>& interactionRanks,
+		device::BufferWrapper<device::index_t>& nodeNumInteractions);
+	void computeInteractionBuffers(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		InteractionBatch const& batch,
+		InteractionBuffers& interactionBuffers);
+	void computeForceBuffers(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		InteractionBuffers& interactionBuffers,
+		ForceBuffers& forceBuffers);
+	void accumulateForces(
+		ForceBuffers& forceBuffers,
+		HostVector<device::vector_t>& forces,
+		HostVector<device::fixed_force_t>& fixedForces);
+	void computeBatchForces(DeviceData& device, DeviceWorkspace& workspace);
+	void computeIntegrationBuffers(
+		HostVector<device::vector_t> const& forces,
+		IntegrationBuffers& integrationBuffers);
+	void updateOctree(IntegrationBuffers const& integrationBuffers);
+	
+	// Axis-aligned box containing a set of particles.
+	struct BoundingBox {
+		device::vector_t min;
+		device::vector_t max;
+	};
+	
+	// Finds the bounding box of a set of positions using the thread pool.
+	template<typename F>
+	BoundingBox computeBoundingBox(std::size_t count, F position) {
+		BoundingBox empty;
+		for (unsigned int i = 0; i < 3; ++i) {
+			empty.min[i] = std::numeric_limits<device::scalar_t>::max();
+			empty.max[i] = std::numeric_limits<device::scalar_t>::lowest();
+		}
+		return host::ThreadPool::global().parallelReduce(
+			0, count,
+			empty,
+			[&](std::size_t index) {
+				device::vector_t point = position(index);
+				return BoundingBox { point, point };
+			},
+			[](BoundingBox a, BoundingBox b) {
+				for (unsigned int i = 0; i < 3; ++i) {
+					a.min[i] = std::min(a.min[i], b.min[i]);
+					a.max[i] = std::max(a.max[i], b.max[i]);
+				}
+				return a;
+			});
+	}
+	bool hasAutomaticBounds() const;
+	// Whether the root of the octree should be moved to fit a bounding box,
+	// either because it doesn't contain the box or because it's too loose.
+	bool shouldFitBounds(BoundingBox box) const;
+	void fitBounds(BoundingBox box);
+	void rebuildOctree(IntegrationBuffers const& integrationBuffers);
 	
 	device::index_t computeLeafFieldIndices(
-		device::BufferWrapper<device::index_t> nodeNumNodeInteractions,
-		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount,
-		device::BufferWrapper<device::index_t> leafFieldIndices);
+		device::BufferWrapper<device::index_t>& nodeNumNodeInteractions,
+		device::BufferWrapper<device::index_t>& nodeMaxInteractionsLeafCount,
+		device::BufferWrapper<device::index_t>& leafFieldIndices);
 	device::index_t computeNodeFieldIndices(
-		device::BufferWrapper<device::index_t> nodeNumLeafInteractions,
-		device::BufferWrapper<device::index_t> nodeNumNodeParentInteractions,
-		device::BufferWrapper<device::index_t> nodeFieldIndices);
+		device::BufferWrapper<device::index_t>& nodeNumLeafInteractions,
+		device::BufferWrapper<device::index_t>& nodeNumNodeParentInteractions,
+		device::BufferWrapper<device::index_t>& nodeFieldIndices);
+	
+public:
+	
+	// A function that adds forces from sources outside of the simulation (for
+	// example, particles held by other processes) to the forces on each leaf.
+	using ExternalForces = std::function<void(
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces)>;
+	
+private:
+	
+	ExternalForces _externalForces;
+	// The number of host allocations made by the last step (see
+	// 'stepAllocations').
+	std::size_t _stepAllocations;
+	
+	// Builds the octree in a single pass over the leafs, where 'leafValue'
+	// and 'leafPosition' give the value and the position of the leaf with an
+	// index. Nothing is copied on the way into the octree.
+	template<typename FValue, typename FPosition>
+	void buildOctreeFromLeafs(
+			std::size_t numLeafs,
+			FValue const& leafValue,
+			FPosition const& leafPosition) {
+		// FIXME: The node capacity is arbitrarily set at 8. Should be
+		// adjustable by the user of this class.
+		_octree = Octree(
+			_origin, _bounds,
+			host::indexIterator(leafValue, 0),
+			host::indexIterator(leafValue, numLeafs),
+			host::indexIterator(leafPosition, 0),
+			host::indexIterator(leafPosition, numLeafs),
+			8);
+	}
+	
+	// Fits the bounds to a range of particles (if they are automatic), and
+	// builds the octree from them.
+	template<typename ParticleIt>
+	void buildOctree(ParticleIt particlesBegin, ParticleIt particlesEnd) {
+		std::size_t numParticles =
+			static_cast<std::size_t>(particlesEnd - particlesBegin);
+		if (hasAutomaticBounds()) {
+			BoundingBox box = computeBoundingBox(
+				numParticles,
+				[&](std::size_t index) {
+					return particlesBegin[index].position;
+				});
+			if (shouldFitBounds(box)) {
+				fitBounds(box);
+			}
+		}
+		buildOctreeFromLeafs(
+			numParticles,
+			[&](std::size_t index) {
+				Particle const& particle = particlesBegin[index];
+				device::leaf_value_t leafValue = {
+					particle.velocity,
+					particle.mass,
+					particle.charge
+				};
+				return leafValue;
+			},
+			[&](std::size_t index) {
+				return particlesBegin[index].position;
+			});
+	}
 	
 public:
 	
 	OpenClSimulation(
 		device::vector_t bounds,
-		std::vector<Particle> particles,
+		std::vector<Particle> const& particles,
 		Scalar timeStep,
-		std::ostream& log);
+		std::ostream& log,
+		DeviceSelection deviceSelection = DeviceSelection(),
+		SolverSettings solverSettings = SolverSettings());
+	
+	// Creates a simulation from a range of particles given by random access
+	// iterators. The particles are read straight into the octree, so the
+	// range can be anything (for example, part of a memory-mapped file)
+	// without being copied into a vector first.
+	template<typename ParticleIt>
+	OpenClSimulation(
+			device::vector_t bounds,
+			ParticleIt particlesBegin,
+			ParticleIt particlesEnd,
+			Scalar timeStep,
+			std::ostream& log,
+			DeviceSelection deviceSelection = DeviceSelection(),
+			SolverSettings solverSettings = SolverSettings()) :
+			_octree(device::vector_t(), bounds),
+			_origin(),
+			_bounds(bounds),
+			_time(0.0),
+			_timeStep(timeStep),
+			_log(log),
+			_deviceSelection(deviceSelection),
+			_solverSettings(solverSettings),
+			_spatialPartitioning(false),
+			_traversalCapacity(0),
+			_stepAllocations(0) {
+		initializeSolver();
+		buildOctree(particlesBegin, particlesEnd);
+		initialize();
+	}
 	
 	Scalar step() override;
 	std::vector<Particle> particles() const override;
 	
+	// Replaces all of the particles in the simulation, keeping the same
+	// bounds (unless they are automatic).
+	void setParticles(std::vector<Particle> const& particles);
+	template<typename ParticleIt>
+	void setParticles(ParticleIt particlesBegin, ParticleIt particlesEnd) {
+		buildOctree(particlesBegin, particlesEnd);
+	}
+	// Sets the external forces that are added every step.
+	void setExternalForces(ExternalForces externalForces);
+	
+	// The number of host allocations made by the last step, up to the
+	// integration and leaving out the external forces. Always zero unless
+	// built with NBODY_COUNT_ALLOCATIONS. The allocations of every thread in
+	// the process are counted, so the count only belongs to this simulation
+	// when it is the only one running.
+	std::size_t stepAllocations() const {
+		return _stepAllocations;
+	}
+	
 };
 
 }
@@ -0,0 +1,162 @@
+#ifndef __NBODY_OUT_OF_CORE_SIMULATION_H_
+#define __NBODY_OUT_OF_CORE_SIMULATION_H_
+
+#include <cstddef>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "nbody/device/types.h"
+#include "nbody/host/essential_tree.h"
+#include "nbody/host/mapped_file.h"
+#include "nbody/host/morton.h"
+
+#include "nbody/open_cl_simulation.h"
+#include "nbody/simulation.h"
+
+// Default number of particles in each chunk of an out-of-core simulation.
+#define OUT_OF_CORE_CHUNK_SIZE (1 << 22)
+// Maximum number of particles in the smallest cells of the summary of a chunk.
+// The summaries of every chunk are kept in memory, so they are much coarser
+// than the octree.
+#define OUT_OF_CORE_CELL_CAPACITY (256)
+// Default number of steps between sorts of the whole particle file.
+#define OUT_OF_CORE_RESORT_INTERVAL (8)
+
+namespace nbody {
+
+// A simulation whose particles are kept in a memory-mapped file instead of in
+// memory, so that it can be larger than the memory of the machine. The file is
+// a plain array of particles, ordered along a Morton curve and split into
+// chunks of consecutive particles, each of which covers a compact region of
+// space. Every step, the chunks are first summarized (a coarse tree of moments
+// for each chunk), and then each chunk in turn is loaded into an
+// OpenClSimulation. The forces from the other chunks are added from a locally
+// essential tree built out of their summaries, with the particles of nearby
+// cells read directly from the file. The next chunk is read ahead while the
+// current one is being simulated.
+//
+// The new particles are written to a second file ('<path>.next'), so that every
+// chunk sees the other chunks as they were at the start of the step, and the
+// two files are swapped at the end of the step.
+class OutOfCoreSimulation final :
+		public Simulation<device::scalar_t, device::vector_t> {
+	
+private:
+	
+	// A cell of the summary of a chunk, with moments taken about its center.
+	// The cells are stored in depth-first order, and 'next' is the index of the
+	// cell that follows all of its descendants (so a cell without children has
+	// 'next' equal to its own index plus one). The particles of the cell are
+	// those in the file from 'begin' to 'end'.
+	struct SummaryCell {
+		device::vector_t position;
+		device::vector_t dimensions;
+		device::node_moment_t moment;
+		std::size_t begin;
+		std::size_t end;
+		std::size_t next;
+	};
+	struct ChunkSummary {
+		host::DomainBounds bounds;
+		std::vector<SummaryCell> cells;
+	};
+	
+	host::MappedFile _particles;
+	host::MappedFile _nextParticles;
+	std::size_t _numParticles;
+	std::size_t _chunkSize;
+	// The box of the Morton curve, which covers every particle in the file.
+	// It is checked against the new particles at the end of every step, and
+	// moved when they have left it (or only fill a small part of it).
+	host::CurveBox _curveBox;
+	Scalar _time;
+	Scalar _timeStep;
+	std::ostream& _log;
+	std::size_t _resortInterval;
+	std::size_t _stepIndex;
+	
+	std::vector<ChunkSummary> _summaries;
+	// The essential tree of every other chunk, for the chunk being simulated.
+	std::vector<host::EssentialNode> _remoteNodes;
+	std::vector<host::EssentialLeaf> _remoteLeafs;
+	
+	OpenClSimulation _local;
+	
+	host::morton_t key(Particle const& particle) const;
+	std::size_t numChunks() const;
+	std::size_t chunkBegin(std::size_t chunk) const;
+	std::size_t chunkEnd(std::size_t chunk) const;
+	
+	std::vector<Particle> readChunk(std::size_t chunk) const;
+	void prefetchChunk(std::size_t chunk);
+	void releaseChunk(host::MappedFile& file, std::size_t chunk);
+	
+	std::vector<host::morton_t> sortChunk(std::size_t chunk);
+	void sortFile();
+	void swapFiles();
+	void summarize();
+	void buildSummary(
+		Particle const* particles,
+		std::vector<host::morton_t> const& keys,
+		std::size_t offset,
+		std::size_t begin,
+		std::size_t end,
+		unsigned int depth,
+		device::vector_t cellPosition,
+		device::vector_t cellDimensions,
+		std::vector<SummaryCell>& cells) const;
+	void buildRemoteTree(std::size_t chunk);
+	void addRemoteForces(
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces) const;
+	
+public:
+	
+	// Simulates the particles in an existing file (see 'writeParticles'),
+	// which are sorted before the first step. The file is sorted along the
+	// Morton curve again every 'resortInterval' steps. In between, every chunk
+	// keeps the same particles, and so becomes less compact as they move.
+	OutOfCoreSimulation(
+		std::string path,
+		device::vector_t bounds,
+		Scalar timeStep,
+		std::ostream& log,
+		DeviceSelection deviceSelection = DeviceSelection(),
+		SolverSettings solverSettings = SolverSettings(),
+		std::size_t chunkSize = OUT_OF_CORE_CHUNK_SIZE,
+		std::size_t resortInterval = OUT_OF_CORE_RESORT_INTERVAL);
+	
+	Scalar step() override;
+	
+	// Reads every particle into memory, so should only be used for small
+	// simulations.
+	std::vector<Particle> particles() const override;
+	
+	// The file that currently holds the particles.
+	std::string const& path() const {
+		return _particles.path();
+	}
+	
+	// Creates a particle file with 'numParticles' particles, given one at a
+	// time by 'particle' (so that they never all have to be in memory).
+	template<typename F>
+	static void writeParticles(
+			std::string path,
+			std::size_t numParticles,
+			F particle) {
+		host::MappedFile file(path, numParticles * sizeof(Particle));
+		Particle* data = file.data<Particle>();
+		for (std::size_t index = 0; index < numParticles; ++index) {
+			new (data + index) Particle(particle(index));
+		}
+	}
+	
+};
+
+}
+
+#endif
+
@@ -0,0 +1,66 @@
+#include "nbody/host/allocation_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace nbody::host;
+
+namespace {
+
+std::atomic<std::size_t> numAllocations(0);
+
+#ifdef NBODY_COUNT_ALLOCATIONS
+void* countedAllocate(std::size_t size) {
+	numAllocations.fetch_add(1, std::memory_order_relaxed);
+	void* result = std::malloc(size != 0 ? size : 1);
+	if (result == nullptr) {
+		throw std::bad_alloc();
+	}
+	return result;
+}
+#endif
+
+}
+
+std::size_t nbody::host::allocationCount() {
+	return numAllocations.load(std::memory_order_relaxed);
+}
+
+#ifdef NBODY_COUNT_ALLOCATIONS
+void* operator new(std::size_t size) {
+	return countedAllocate(size);
+}
+void* operator new[](std::size_t size) {
+	return countedAllocate(size);
+}
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+	try {
+		return countedAllocate(size);
+	}
+	catch (std::bad_alloc const&) {
+		return nullptr;
+	}
+}
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept {
+	try {
+		return countedAllocate(size);
+	}
+	catch (std::bad_alloc const&) {
+		return nullptr;
+	}
+}
+void operator delete(void* pointer) noexcept {
+	std::free(pointer);
+}
+void operator delete[](void* pointer) noexcept {
+	std::free(pointer);
+}
+void operator delete(void* pointer, std::size_t) noexcept {
+	std::free(pointer);
+}
+void operator delete[](void* pointer, std::size_t) noexcept {
+	std::free(pointer);
+}
+#endif
+
@@ -0,0 +1,91 @@
+#include "nbody/host/arena.h"
+
+#include <algorithm>
+
+#include <sys/mman.h>
+
+using namespace nbody::host;
+
+Arena::Arena(bool hugePages) :
+		_chunkIndex(0),
+		_offset(0),
+		_hugePages(hugePages) {
+}
+
+Arena::~Arena() {
+	for (Chunk const& chunk : _chunks) {
+		munmap(chunk.data, chunk.size);
+	}
+}
+
+Arena::Chunk Arena::mapChunk(std::size_t size) const {
+	size = std::max<std::size_t>(size, ARENA_CHUNK_SIZE);
+	void* data = MAP_FAILED;
+	if (_hugePages) {
+		size = (size + ARENA_HUGE_PAGE_SIZE - 1) /
+			ARENA_HUGE_PAGE_SIZE * ARENA_HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+		data = mmap(
+			NULL,
+			size,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			-1,
+			0);
+#endif
+	}
+	if (data == MAP_FAILED) {
+		data = mmap(
+			NULL,
+			size,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS,
+			-1,
+			0);
+		if (data == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+#ifdef MADV_HUGEPAGE
+		// This is only a hint, so failures are ignored.
+		if (_hugePages) {
+			madvise(data, size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	return { static_cast<char*>(data), size };
+}
+
+void* Arena::allocate(std::size_t size, std::size_t alignment) {
+	// Look for space in the current chunk, and then in the ones after it
+	// (which are only there if the arena has been reset).
+	while (_chunkIndex < _chunks.size()) {
+		Chunk const& chunk = _chunks[_chunkIndex];
+		std::size_t begin = (_offset + alignment - 1) / alignment * alignment;
+		if (begin <= chunk.size && size <= chunk.size - begin) {
+			_offset = begin + size;
+			return chunk.data + begin;
+		}
+		++_chunkIndex;
+		_offset = 0;
+	}
+	// None of them have space, so map a new chunk. Chunks are always aligned
+	// to pages, which is enough for any type.
+	_chunks.push_back(mapChunk(size));
+	_chunkIndex = _chunks.size() - 1;
+	_offset = size;
+	return _chunks.back().data;
+}
+
+void Arena::reset() {
+	_chunkIndex = 0;
+	_offset = 0;
+}
+
+std::size_t Arena::capacity() const {
+	std::size_t result = 0;
+	for (Chunk const& chunk : _chunks) {
+		result += chunk.size;
+	}
+	return result;
+}
+
@@ -0,0 +1,124 @@
+#include "nbody/distributed/communicator.h"
+
+#include <stdexcept>
+
+#ifdef NBODY_USE_MPI
+#include <mpi.h>
+#endif
+
+using namespace nbody::distributed;
+
+std::vector<LocalCommunicator> LocalCommunicator::createGroup(
+		std::size_t size) {
+	std::shared_ptr<Group> group = std::make_shared<Group>();
+	group->size = size;
+	group->numWaiting = 0;
+	group->generation = 0;
+	group->mail.resize(size, std::vector<Bytes>(size));
+	
+	std::vector<LocalCommunicator> result;
+	result.reserve(size);
+	for (std::size_t rank = 0; rank < size; ++rank) {
+		result.push_back(LocalCommunicator(group, rank));
+	}
+	return result;
+}
+
+void LocalCommunicator::barrier() {
+	std::unique_lock<std::mutex> lock(_group->mutex);
+	std::size_t generation = _group->generation;
+	++_group->numWaiting;
+	if (_group->numWaiting == _group->size) {
+		_group->numWaiting = 0;
+		++_group->generation;
+		_group->condition.notify_all();
+	}
+	else {
+		_group->condition.wait(lock, [&]() {
+			return _group->generation != generation;
+		});
+	}
+}
+
+std::vector<LocalCommunicator::Bytes> LocalCommunicator::allToAll(
+		std::vector<Bytes> const& send) {
+	if (send.size() != size()) {
+		throw std::invalid_argument("Must send a block to every rank");
+	}
+	// Every rank only writes its own row of the mailboxes, and only reads its
+	// own column once every rank has finished writing.
+	{
+		std::lock_guard<std::mutex> lock(_group->mutex);
+		_group->mail[_rank] = send;
+	}
+	barrier();
+	std::vector<Bytes> receive(size());
+	{
+		std::lock_guard<std::mutex> lock(_group->mutex);
+		for (std::size_t source = 0; source < size(); ++source) {
+			receive[source] = std::move(_group->mail[source][_rank]);
+		}
+	}
+	// Wait until everybody has read their mail before it can be overwritten.
+	barrier();
+	return receive;
+}
+
+#ifdef NBODY_USE_MPI
+MpiCommunicator::MpiCommunicator() {
+	int rank;
+	int size;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	_rank = static_cast<std::size_t>(rank);
+	_size = static_cast<std::size_t>(size);
+}
+
+std::vector<MpiCommunicator::Bytes> MpiCommunicator::allToAll(
+		std::vector<Bytes> const& send) {
+	if (send.size() != size()) {
+		throw std::invalid_argument("Must send a block to every rank");
+	}
+	// First exchange the sizes of the blocks, and then the blocks themselves.
+	std::vector<int> sendCounts(_size);
+	std::vector<int> receiveCounts(_size);
+	for (std::size_t rank = 0; rank < _size; ++rank) {
+		sendCounts[rank] = static_cast<int>(send[rank].size());
+	}
+	MPI_Alltoall(
+		sendCounts.data(), 1, MPI_INT,
+		receiveCounts.data(), 1, MPI_INT,
+		MPI_COMM_WORLD);
+	
+	std::vector<int> sendOffsets(_size);
+	std::vector<int> receiveOffsets(_size);
+	int sendTotal = 0;
+	int receiveTotal = 0;
+	for (std::size_t rank = 0; rank < _size; ++rank) {
+		sendOffsets[rank] = sendTotal;
+		receiveOffsets[rank] = receiveTotal;
+		sendTotal += sendCounts[rank];
+		receiveTotal += receiveCounts[rank];
+	}
+	Bytes sendData;
+	sendData.reserve(sendTotal);
+	for (Bytes const& block : send) {
+		sendData.insert(sendData.end(), block.begin(), block.end());
+	}
+	Bytes receiveData(receiveTotal);
+	MPI_Alltoallv(
+		sendData.data(), sendCounts.data(), sendOffsets.data(), MPI_BYTE,
+		receiveData.data(), receiveCounts.data(), receiveOffsets.data(),
+		MPI_BYTE,
+		MPI_COMM_WORLD);
+	
+	std::vector<Bytes> receive(_size);
+	for (std::size_t rank = 0; rank < _size; ++rank) {
+		receive[rank].assign(
+			receiveData.begin() + receiveOffsets[rank],
+			receiveData.begin() + receiveOffsets[rank] + receiveCounts[rank]);
+	}
+	return receive;
+}
+#endif
+
@@ -0,0 +1,362 @@
+#include "nbody/distributed_simulation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+
+#include "nbody/device/constants.h"
+#include "nbody/host/multipole.h"
+
+using namespace nbody;
+
+DistributedSimulation::DistributedSimulation(
+		distributed::Communicator& communicator,
+		device::vector_t bounds,
+		std::vector<Particle> particles,
+		Scalar timeStep,
+		std::ostream& log,
+		DeviceSelection deviceSelection,
+		SolverSettings solverSettings,
+		std::size_t rebalanceInterval) :
+		_communicator(communicator),
+		_local(
+			bounds,
+			particles,
+			timeStep,
+			log,
+			deviceSelection,
+			solverSettings),
+		_log(log),
+		_curveBox(),
+		_rebalanceInterval(std::max<std::size_t>(rebalanceInterval, 1)),
+		_stepIndex(0),
+		_cost(0.0) {
+	// The remote forces are only added as those of free space.
+	if (
+			solverSettings.meshSize != 0 ||
+			solverSettings.periodic ||
+			solverSettings.operatorCache) {
+		throw std::runtime_error(
+			"Distributed simulations can't use a particle-mesh, a periodic "
+			"box, or the operator cache");
+	}
+	_local.setExternalForces(std::bind(
+		&DistributedSimulation::addRemoteForces,
+		this,
+		std::placeholders::_1,
+		std::placeholders::_2,
+		std::placeholders::_3));
+}
+
+std::vector<DistributedSimulation::Particle>
+DistributedSimulation::particles() const {
+	return _local.particles();
+}
+
+DistributedSimulation::Scalar DistributedSimulation::step() {
+	std::vector<Particle> particles = _local.particles();
+	
+	// Choose new partitions based on the cost of the last step, and then send
+	// every particle to the rank that owns it. The keys change when the curve
+	// box moves, so the partitions have to be chosen again.
+	bool curveMoved = fitCurveBox(particles);
+	if (curveMoved || _stepIndex % _rebalanceInterval == 0) {
+		rebalance(particles);
+	}
+	particles = migrate(particles);
+	exchangeEssentialTrees(particles);
+	_local.setParticles(particles);
+	
+	// The remote forces are added by the local simulation through
+	// addRemoteForces, so they count towards the cost.
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	Scalar time = _local.step();
+	std::chrono::duration<double> duration =
+		std::chrono::steady_clock::now() - start;
+	_cost = duration.count();
+	
+	++_stepIndex;
+	return time;
+}
+
+host::morton_t DistributedSimulation::key(Particle const& particle) const {
+	return host::mortonKey(
+		particle.position,
+		_curveBox.position,
+		_curveBox.dimensions);
+}
+
+std::size_t DistributedSimulation::owner(host::morton_t key) const {
+	std::vector<host::morton_t>::const_iterator it = std::upper_bound(
+		_splitters.begin(),
+		_splitters.end() - 1,
+		key);
+	return static_cast<std::size_t>(it - _splitters.begin()) - 1;
+}
+
+bool DistributedSimulation::fitCurveBox(
+		std::vector<Particle> const& particles) {
+	// Every rank gets the same bounds, so they all make the same choice.
+	DomainBounds localBounds = host::computeDomainBounds(
+		particles.size(),
+		[&](std::size_t index) {
+			return particles[index].position;
+		});
+	std::vector<std::vector<DomainBounds> > rankBounds =
+		_communicator.allGather(std::vector<DomainBounds>{ localBounds });
+	std::vector<DomainBounds> allBounds;
+	for (std::vector<DomainBounds> const& next : rankBounds) {
+		allBounds.insert(allBounds.end(), next.begin(), next.end());
+	}
+	DomainBounds bounds = host::mergeDomainBounds(allBounds);
+	if (!host::shouldFitCurveBox(_curveBox, bounds)) {
+		return false;
+	}
+	_curveBox = host::fitCurveBox(bounds);
+	_log << "Moved the Morton curve to a box of size " <<
+		_curveBox.dimensions[0] << ".\n";
+	return true;
+}
+
+void DistributedSimulation::rebalance(std::vector<Particle> const& particles) {
+	std::size_t numRanks = _communicator.size();
+	
+	// Every particle on a rank is given an equal share of that rank's cost.
+	// Before anything has been measured (or if the timer is too coarse), every
+	// particle costs the same.
+	std::vector<std::vector<double> > costs =
+		_communicator.allGather(std::vector<double>{ _cost });
+	bool useCost = std::all_of(
+		costs.begin(),
+		costs.end(),
+		[](std::vector<double> const& cost) {
+			return cost[0] > 0.0;
+		});
+	double particleCost = 1.0;
+	if (useCost && !particles.empty()) {
+		particleCost = _cost / particles.size();
+	}
+	
+	// Take evenly spaced samples along the local part of the curve.
+	std::vector<host::morton_t> keys;
+	keys.reserve(particles.size());
+	for (Particle const& particle : particles) {
+		keys.push_back(key(particle));
+	}
+	std::sort(keys.begin(), keys.end());
+	std::size_t numSamples = std::min<std::size_t>(
+		keys.size(),
+		NUM_CURVE_SAMPLES);
+	std::vector<CurveSample> samples;
+	samples.reserve(numSamples);
+	for (std::size_t index = 0; index < numSamples; ++index) {
+		std::size_t begin = keys.size() * index / numSamples;
+		std::size_t end = keys.size() * (index + 1) / numSamples;
+		samples.push_back({ keys[begin], (end - begin) * particleCost });
+	}
+	
+	// Every rank gets every sample, and makes the same choice of splitters so
+	// that each rank has an equal share of the total cost.
+	std::vector<std::vector<CurveSample> > rankSamples =
+		_communicator.allGather(samples);
+	std::vector<CurveSample> allSamples;
+	for (std::vector<CurveSample> const& next : rankSamples) {
+		allSamples.insert(allSamples.end(), next.begin(), next.end());
+	}
+	std::sort(
+		allSamples.begin(),
+		allSamples.end(),
+		[](CurveSample const& a, CurveSample const& b) {
+			return a.key < b.key;
+		});
+	double totalCost = 0.0;
+	for (CurveSample const& sample : allSamples) {
+		totalCost += sample.cost;
+	}
+	
+	_splitters.assign(numRanks + 1, 0);
+	_splitters[numRanks] = std::numeric_limits<host::morton_t>::max();
+	std::size_t rank = 1;
+	double cumulativeCost = 0.0;
+	for (CurveSample const& sample : allSamples) {
+		while (
+				rank < numRanks &&
+				cumulativeCost >= totalCost * rank / numRanks) {
+			_splitters[rank] = sample.key;
+			++rank;
+		}
+		cumulativeCost += sample.cost;
+	}
+	for (; rank < numRanks; ++rank) {
+		_splitters[rank] = _splitters[numRanks];
+	}
+}
+
+std::vector<DistributedSimulation::Particle> DistributedSimulation::migrate(
+		std::vector<Particle> const& particles) {
+	// Send every particle to its owner.
+	std::vector<std::vector<Particle> > send(_communicator.size());
+	for (Particle const& particle : particles) {
+		send[owner(key(particle))].push_back(particle);
+	}
+	std::vector<std::vector<Particle> > receive =
+		_communicator.allToAll(send);
+	
+	std::vector<Particle> result;
+	for (std::vector<Particle> const& next : receive) {
+		result.insert(result.end(), next.begin(), next.end());
+	}
+	// Keep the particles in curve order, which is needed to build the
+	// essential trees.
+	std::sort(
+		result.begin(),
+		result.end(),
+		[this](Particle const& a, Particle const& b) {
+			return key(a) < key(b);
+		});
+	return result;
+}
+
+void DistributedSimulation::exchangeEssentialTrees(
+		std::vector<Particle> const& particles) {
+	// Share the region that each rank's particles occupy.
+	DomainBounds localBounds = host::computeDomainBounds(
+		particles.size(),
+		[&](std::size_t index) {
+			return particles[index].position;
+		});
+	std::vector<std::vector<DomainBounds> > rankBounds =
+		_communicator.allGather(std::vector<DomainBounds>{ localBounds });
+	
+	// Build an essential tree for every other rank.
+	std::vector<host::morton_t> keys;
+	keys.reserve(particles.size());
+	for (Particle const& particle : particles) {
+		keys.push_back(key(particle));
+	}
+	std::vector<std::vector<EssentialNode> > sendNodes(_communicator.size());
+	std::vector<std::vector<EssentialLeaf> > sendLeafs(_communicator.size());
+	for (std::size_t rank = 0; rank < _communicator.size(); ++rank) {
+		DomainBounds const& target = rankBounds[rank][0];
+		if (rank == _communicator.rank() || target.numParticles == 0) {
+			continue;
+		}
+		buildEssentialTree(
+			particles, keys,
+			0, particles.size(),
+			0,
+			_curveBox.position, _curveBox.dimensions,
+			target,
+			sendNodes[rank], sendLeafs[rank]);
+	}
+	
+	std::vector<std::vector<EssentialNode> > receiveNodes =
+		_communicator.allToAll(sendNodes);
+	std::vector<std::vector<EssentialLeaf> > receiveLeafs =
+		_communicator.allToAll(sendLeafs);
+	_remoteNodes.clear();
+	_remoteLeafs.clear();
+	for (std::size_t rank = 0; rank < _communicator.size(); ++rank) {
+		_remoteNodes.insert(
+			_remoteNodes.end(),
+			receiveNodes[rank].begin(),
+			receiveNodes[rank].end());
+		_remoteLeafs.insert(
+			_remoteLeafs.end(),
+			receiveLeafs[rank].begin(),
+			receiveLeafs[rank].end());
+	}
+	_log << "Received " << _remoteNodes.size() << " remote nodes and " <<
+		_remoteLeafs.size() << " remote leafs.\n";
+}
+
+void DistributedSimulation::buildEssentialTree(
+		std::vector<Particle> const& particles,
+		std::vector<host::morton_t> const& keys,
+		std::size_t begin,
+		std::size_t end,
+		unsigned int depth,
+		device::vector_t cellPosition,
+		device::vector_t cellDimensions,
+		DomainBounds const& target,
+		std::vector<EssentialNode>& nodes,
+		std::vector<EssentialLeaf>& leafs) const {
+	if (begin == end) {
+		return;
+	}
+	
+	// Cells that are far enough from the target region are sent as moments.
+	device::vector_t center;
+	if (host::isWellSeparated(cellPosition, cellDimensions, target, center)) {
+		EssentialNode node = { center, device::node_moment_t() };
+		for (std::size_t index = begin; index < end; ++index) {
+			host::addMoment(
+				node.moment,
+				center,
+				particles[index].position,
+				particles[index].charge,
+				particles[index].mass);
+		}
+		nodes.push_back(node);
+		return;
+	}
+	
+	// Cells that are too close and small enough are sent as particles.
+	if (end - begin <= ESSENTIAL_LEAF_CAPACITY || depth == MORTON_BITS) {
+		for (std::size_t index = begin; index < end; ++index) {
+			leafs.push_back({
+				particles[index].position,
+				particles[index].charge,
+				particles[index].mass
+			});
+		}
+		return;
+	}
+	
+	// Otherwise, refine the cell. The keys are sorted, so the particles in
+	// each octant are contiguous.
+	device::vector_t childDimensions;
+	for (unsigned int i = 0; i < 3; ++i) {
+		childDimensions[i] = cellDimensions[i] / 2;
+	}
+	std::size_t childBegin = begin;
+	for (unsigned int octant = 0; octant < 8; ++octant) {
+		std::size_t childEnd = static_cast<std::size_t>(std::upper_bound(
+			keys.begin() + childBegin,
+			keys.begin() + end,
+			octant,
+			[depth](unsigned int octant, host::morton_t key) {
+				return octant < host::mortonOctant(key, depth);
+			}) - keys.begin());
+		device::vector_t childPosition = cellPosition;
+		for (unsigned int i = 0; i < 3; ++i) {
+			if (octant & (4 >> i)) {
+				childPosition[i] += childDimensions[i];
+			}
+		}
+		buildEssentialTree(
+			particles, keys,
+			childBegin, childEnd,
+			depth + 1,
+			childPosition, childDimensions,
+			target,
+			nodes, leafs);
+		childBegin = childEnd;
+	}
+}
+
+void DistributedSimulation::addRemoteForces(
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces) const {
+	host::addEssentialForces(
+		_remoteNodes,
+		_remoteLeafs,
+		leafs,
+		numLeafs,
+		forces);
+}
+
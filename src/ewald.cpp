@@ -0,0 +1,101 @@
+#include "nbody/host/ewald.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "nbody/host/thread_pool.h"
+
+// Number of periodic images (along each axis, in each direction) included in
+// the real and reciprocal space sums.
+#define EWALD_NUM_IMAGES (3)
+
+using namespace nbody;
+using namespace nbody::host;
+
+device::vector_t nbody::host::ewaldCorrection(
+		device::vector_t box,
+		device::vector_t r) {
+	double minSide = std::min({ box[0], box[1], box[2] });
+	double alpha = 2.0 / minSide;
+	double volume = static_cast<double>(box[0]) * box[1] * box[2];
+	double field[3] = { 0, 0, 0 };
+	
+	for (int nx = -EWALD_NUM_IMAGES; nx <= EWALD_NUM_IMAGES; ++nx) {
+		for (int ny = -EWALD_NUM_IMAGES; ny <= EWALD_NUM_IMAGES; ++ny) {
+			for (int nz = -EWALD_NUM_IMAGES; nz <= EWALD_NUM_IMAGES; ++nz) {
+				// Real space sum over the images, with the nearest image
+				// removed so that only the correction is left.
+				double image[3] = {
+					r[0] - nx * box[0],
+					r[1] - ny * box[1],
+					r[2] - nz * box[2]
+				};
+				double distSq =
+					image[0] * image[0] +
+					image[1] * image[1] +
+					image[2] * image[2];
+				double dist = std::sqrt(distSq);
+				if (dist > 0) {
+					double scale =
+						std::erfc(alpha * dist) / (distSq * dist) +
+						2 * alpha / std::sqrt(M_PI) *
+							std::exp(-alpha * alpha * distSq) / distSq;
+					if (nx == 0 && ny == 0 && nz == 0) {
+						scale -= 1 / (distSq * dist);
+					}
+					for (unsigned int i = 0; i < 3; ++i) {
+						field[i] += scale * image[i];
+					}
+				}
+				
+				// Reciprocal space sum.
+				if (nx == 0 && ny == 0 && nz == 0) {
+					continue;
+				}
+				double k[3] = {
+					2 * M_PI * nx / box[0],
+					2 * M_PI * ny / box[1],
+					2 * M_PI * nz / box[2]
+				};
+				double kSq = k[0] * k[0] + k[1] * k[1] + k[2] * k[2];
+				double scale =
+					4 * M_PI / volume *
+					std::exp(-kSq / (4 * alpha * alpha)) / kSq *
+					std::sin(k[0] * r[0] + k[1] * r[1] + k[2] * r[2]);
+				for (unsigned int i = 0; i < 3; ++i) {
+					field[i] += scale * k[i];
+				}
+			}
+		}
+	}
+	
+	return {
+		static_cast<device::scalar_t>(field[0]),
+		static_cast<device::scalar_t>(field[1]),
+		static_cast<device::scalar_t>(field[2]),
+		0
+	};
+}
+
+std::vector<device::vector_t> nbody::host::computeEwaldTable(
+		device::vector_t box) {
+	std::size_t size = EWALD_TABLE_SIZE + 1;
+	std::vector<device::vector_t> table(size * size * size);
+	ThreadPool::global().parallelFor(
+		0, size,
+		[&](std::size_t i) {
+			for (std::size_t j = 0; j < size; ++j) {
+				for (std::size_t k = 0; k < size; ++k) {
+					device::vector_t r = {
+						box[0] / 2 * i / EWALD_TABLE_SIZE,
+						box[1] / 2 * j / EWALD_TABLE_SIZE,
+						box[2] / 2 * k / EWALD_TABLE_SIZE,
+						0
+					};
+					table[(i * size + j) * size + k] = ewaldCorrection(box, r);
+				}
+			}
+		});
+	return table;
+}
+
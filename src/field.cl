@@ -1,11 +1,16 @@
 #include "types.h"
+#include "constants.h"
+#include "periodic.h"
+#include "multipole.h"
+#include "segmented.h"
 
-#ifndef PARTICLE_RADIUS
-#define PARTICLE_RADIUS ((scalar_t) 0.01)
-#endif
-
-#ifndef FORCE_CONSTANT
-#define FORCE_CONSTANT ((scalar_t) -1.0)
+#ifdef PM_SPLIT_RADIUS
+// The fraction of the force at a distance that is computed by the octree
+// rather than by the particle-mesh.
+scalar_t short_range_factor(scalar_t r_mag) {
+	scalar_t x = r_mag / (2 * PM_SPLIT_RADIUS);
+	return erfc(x) + M_2_SQRTPI_F * x * exp(-x * x);
+}
 #endif
 
 typedef struct {
@@ -13,43 +18,196 @@ typedef struct {
 	leaf_field_t field_b;
 } leaf_field_pair_t;
 
-// Computes the field of two leafs on each other. Returns a pair.
+// Computes the field of two leafs on each other. Returns a pair. The masses
+// are only used with NBODY_MASS_CHANNEL.
 leaf_field_pair_t leaf_moment_field(
 		leaf_moment_t moment_a,
 		leaf_moment_t moment_b,
+		scalar_t mass_a,
+		scalar_t mass_b,
 		vector_t position_a,
-		vector_t position_b) {
-	vector_t r = position_b - position_a;
+		vector_t position_b,
+		global vector_t const* ewald_table) {
+	vector_t r = minimum_image(position_b - position_a);
 	scalar_t r_mag = sqrt(dot(r, r) + PARTICLE_RADIUS * PARTICLE_RADIUS);
-	vector_t unscaled_field = FORCE_CONSTANT * r / (r_mag * r_mag * r_mag);
-	leaf_field_pair_t result = {
-		// Field on A (from B).
-		{ -moment_b.charge * unscaled_field },
-		// Field on B (from A).
-		{ +moment_a.charge * unscaled_field }
-	};
+	vector_t unscaled_field = r / (r_mag * r_mag * r_mag);
+#ifdef PM_SPLIT_RADIUS
+	unscaled_field *= short_range_factor(length(r));
+#endif
+#ifdef PERIODIC_BOX
+	unscaled_field += ewald_correction(ewald_table, r);
+#endif
+	leaf_field_pair_t result;
+	// Field on A (from B).
+	result.field_a.field = -FORCE_CONSTANT * moment_b.charge * unscaled_field;
+	// Field on B (from A).
+	result.field_b.field = +FORCE_CONSTANT * moment_a.charge * unscaled_field;
+#ifdef NBODY_MASS_CHANNEL
+	result.field_a.mass_field = -MASS_FORCE_CONSTANT * mass_b * unscaled_field;
+	result.field_b.mass_field = +MASS_FORCE_CONSTANT * mass_a * unscaled_field;
+#endif
 	return result;
 }
 
-// Computes the field of a node at a certain point.
+// Computes the field of the charge of a node at an offset 'r' from its center,
+// including the dipole and quadrupole terms, given the powers of the inverse
+// of the distance.
+vector_t multipole_field(
+		node_moment_t source_moment,
+		vector_t r,
+		scalar_t r_inv_3,
+		scalar_t r_inv_5,
+		scalar_t r_inv_7,
+		global vector_t const* ewald_table) {
+	vector_t p = source_moment.dipole_moment;
+	vector_t q_r = quadrupole_product(source_moment, r);
+	scalar_t p_dot_r = dot(p, r);
+	scalar_t r_dot_q_r = dot(r, q_r);
+	vector_t field =
+		source_moment.charge * r * r_inv_3 +
+		3 * p_dot_r * r * r_inv_5 - p * r_inv_3 +
+		(scalar_t) 2.5 * r_dot_q_r * r * r_inv_7 - q_r * r_inv_5;
+#ifdef PM_SPLIT_RADIUS
+	field *= short_range_factor(length(r));
+#endif
+#ifdef PERIODIC_BOX
+	// The field of the periodic images includes the monopole and the dipole.
+	// The quadrupole is left out, since the field of the images hardly changes
+	// across a node.
+	field +=
+		source_moment.charge * ewald_correction(ewald_table, r) +
+		ewald_dipole_correction(
+			ewald_table,
+			r,
+			source_moment.dipole_moment);
+#endif
+	return field;
+}
+
+// Computes the field of a node at a certain point, including the dipole and
+// quadrupole terms.
 node_field_t node_moment_field(
 		node_moment_t source_moment,
 		vector_t source_position,
-		vector_t target_position) {
-	vector_t r = target_position - source_position;
-	scalar_t r_mag = sqrt(dot(r, r) + PARTICLE_RADIUS * PARTICLE_RADIUS);
-	vector_t unscaled_field = FORCE_CONSTANT * r / (r_mag * r_mag * r_mag);
-	node_field_t result = {
-		target_position,
-		source_moment.charge * unscaled_field
-	};
+		vector_t target_position,
+		global vector_t const* ewald_table) {
+	vector_t r = minimum_image(target_position - source_position);
+	scalar_t r_mag_sq = dot(r, r) + PARTICLE_RADIUS * PARTICLE_RADIUS;
+	scalar_t r_inv_3 = 1 / (r_mag_sq * sqrt(r_mag_sq));
+	scalar_t r_inv_5 = r_inv_3 / r_mag_sq;
+	scalar_t r_inv_7 = r_inv_5 / r_mag_sq;
+	
+	node_field_t result;
+	result.point = target_position;
+	result.field = FORCE_CONSTANT * multipole_field(
+		source_moment,
+		r,
+		r_inv_3,
+		r_inv_5,
+		r_inv_7,
+		ewald_table);
+#ifdef NBODY_MASS_CHANNEL
+	// The mass has its own moments, but the same distance to the target.
+	result.mass_field = MASS_FORCE_CONSTANT * multipole_field(
+		swap_channels(source_moment),
+		r,
+		r_inv_3,
+		r_inv_5,
+		r_inv_7,
+		ewald_table);
+#endif
 	return result;
 }
 
-void kernel compute_leaf_interaction_fields(
-		// Leafs of the octree.
+// With compact leafs, the leaf interactions read the compact copies of the
+// leafs instead of the leafs themselves, and rebuild their positions from the
+// cells of their nodes.
+#ifdef COMPACT_LEAFS
+typedef compact_leaf_t field_leaf_t;
+
+vector_t field_leaf_position(compact_leaf_t leaf, node_t node) {
+	vector_t fraction = (vector_t) (
+		leaf.position[0],
+		leaf.position[1],
+		leaf.position[2],
+		0) / (scalar_t) QUANTIZED_MAX;
+	return node.position + fraction * node.dimensions;
+}
+
+leaf_moment_t field_leaf_moment(compact_leaf_t leaf) {
+	leaf_moment_t moment = { leaf.charge };
+	return moment;
+}
+
+scalar_t field_leaf_mass(compact_leaf_t leaf) {
+#ifdef NBODY_MASS_CHANNEL
+	return leaf.mass;
+#else
+	return 0;
+#endif
+}
+#else
+typedef leaf_t field_leaf_t;
+
+vector_t field_leaf_position(leaf_t leaf, node_t node) {
+	return leaf.position;
+}
+
+leaf_moment_t field_leaf_moment(leaf_t leaf) {
+	return leaf.value.moment;
+}
+
+scalar_t field_leaf_mass(leaf_t leaf) {
+	return leaf.value.mass;
+}
+#endif
+
+// Fills out the compact copy of every leaf, relative to the cell of the
+// child-less node that contains it.
+void kernel compute_compact_leafs(
 		index_t num_leafs,
 		global leaf_t const* leafs,
+		index_t num_nodes,
+		global node_t const* nodes,
+		global compact_leaf_t* compact_leafs) {
+	
+	index_t node_index = (index_t) get_global_id(0);
+	if (node_index >= num_nodes) {
+		return;
+	}
+	node_t node = nodes[node_index];
+	if (node.has_children) {
+		return;
+	}
+	
+	for (
+			index_t leaf_index = node.leaf_index;
+			leaf_index < node.leaf_index + node.leaf_count;
+			++leaf_index) {
+		leaf_t leaf = leafs[leaf_index];
+		// Every particle is inside of the cell of its node (compact leafs are
+		// only used when the root contains every particle), so the clamp only
+		// catches rounding at the sides.
+		vector_t fraction = clamp(
+			(leaf.position - node.position) / node.dimensions,
+			(scalar_t) 0,
+			(scalar_t) 1);
+		compact_leaf_t result;
+		result.position[0] = (quantized_t) round(fraction.x * QUANTIZED_MAX);
+		result.position[1] = (quantized_t) round(fraction.y * QUANTIZED_MAX);
+		result.position[2] = (quantized_t) round(fraction.z * QUANTIZED_MAX);
+		result.charge = leaf.value.moment.charge;
+#ifdef NBODY_MASS_CHANNEL
+		result.mass = leaf.value.mass;
+#endif
+		compact_leafs[leaf_index] = result;
+	}
+}
+
+void kernel compute_leaf_interaction_fields(
+		// Leafs of the octree (or their compact copies, with compact leafs).
+		index_t num_leafs,
+		global field_leaf_t const* leafs,
 		// The index in the field array that each leaf maps to.
 		global index_t const* leaf_field_indices,
 		// Nodes of the octree.
@@ -57,12 +215,17 @@ void kernel compute_leaf_interaction_fields(
 		global node_t const* nodes,
 		// Number of leaf counts for each node interaction.
 		global index_t const* node_max_interactions_leaf_count,
-		// A set of leaf interactions to be computed.
+		// A set of leaf interactions to be computed, and the rank of each
+		// interaction on each of its nodes.
 		index_t num_interactions,
 		global interaction_t const* interactions,
+		global index_t const* interaction_ranks,
 		// Array of all fields on particles.
 		index_t num_fields,
-		global leaf_field_t* fields) {
+		SEGMENTED_BUFFER(leaf_field_t, fields),
+		// Table of the field from periodic images (only used in a periodic
+		// box).
+		global vector_t const* ewald_table) {
 	
 	index_t interaction_index = (index_t) get_group_id(0);
 	if (interaction_index >= num_interactions) {
@@ -71,8 +234,8 @@ void kernel compute_leaf_interaction_fields(
 	interaction_t interaction = interactions[interaction_index];
 	
 	// Get both nodes involved in the interaction.
-	index_t node_a_index = interaction.node_a_index;
-	index_t node_b_index = interaction.node_b_index;
+	index_t node_a_index = INTERACTION_NODE_A(interaction);
+	index_t node_b_index = INTERACTION_NODE_B(interaction);
 	node_t node_a = nodes[node_a_index];
 	node_t node_b = nodes[node_b_index];
 	
@@ -106,21 +269,22 @@ void kernel compute_leaf_interaction_fields(
 				leaf_b_index < leaf_b_end;
 				++leaf_b_index) {
 			if (
-					interaction.node_a_index == interaction.node_b_index &&
+					node_a_index == node_b_index &&
 					leaf_b_index >= leaf_a_index) {
 				continue;
 			}
-			leaf_t leaf_a = leafs[leaf_a_index];
-			leaf_t leaf_b = leafs[leaf_b_index];
+			field_leaf_t leaf_a = leafs[leaf_a_index];
+			field_leaf_t leaf_b = leafs[leaf_b_index];
 			
 			// Calculate the field of node a on node b.
-			leaf_moment_t moment_a = leafs[leaf_a_index].value.moment;
-			leaf_moment_t moment_b = leafs[leaf_b_index].value.moment;
 			leaf_field_pair_t field_pair = leaf_moment_field(
-				moment_a,
-				moment_b,
-				leaf_a.position,
-				leaf_b.position);
+				field_leaf_moment(leaf_a),
+				field_leaf_moment(leaf_b),
+				field_leaf_mass(leaf_a),
+				field_leaf_mass(leaf_b),
+				field_leaf_position(leaf_a, node_a),
+				field_leaf_position(leaf_b, node_b),
+				ewald_table);
 			
 			// Determine the index of the force in the array of forces. Each
 			// leaf has a set of 'num_leafs_per_node' forces for each leaf in
@@ -128,10 +292,10 @@ void kernel compute_leaf_interaction_fields(
 			// interaction).
 			index_t interaction_a_offset =
 				node_max_interactions_leaf_count[node_a_index] *
-				interaction.node_a_interaction_index;
+				interaction_ranks[2 * interaction_index];
 			index_t interaction_b_offset =
 				node_max_interactions_leaf_count[node_b_index] *
-				interaction.node_b_interaction_index;
+				interaction_ranks[2 * interaction_index + 1];
 			index_t field_a_index =
 				leaf_field_indices[leaf_a_index] +
 				interaction_a_offset +
@@ -141,12 +305,102 @@ void kernel compute_leaf_interaction_fields(
 				interaction_b_offset +
 				(leaf_a_index - node_a.leaf_index);
 			
-			fields[field_a_index] = field_pair.field_a;
-			fields[field_b_index] = field_pair.field_b;
+			SEGMENTED_AT(fields, field_a_index) = field_pair.field_a;
+			SEGMENTED_AT(fields, field_b_index) = field_pair.field_b;
 		}
 	}
 }
 
+#ifdef NODE_OPERATOR_CACHE
+// Applies a cached operator to a set of moments about the geometric center of a
+// node. The reverse of an operator is the operator for the opposite offset.
+vector_t apply_operator(
+		global vector_t const* columns,
+		node_moment_t moment,
+		bool reverse) {
+	// The charge and quadrupole terms are odd in the offset, while the dipole
+	// terms are even.
+	vector_t odd =
+		moment.charge * columns[0] +
+		moment.quadrupole_cross_terms.x * columns[4] +
+		moment.quadrupole_cross_terms.y * columns[5] +
+		moment.quadrupole_cross_terms.z * columns[6] +
+		moment.quadrupole_trace_terms.x * columns[7] +
+		moment.quadrupole_trace_terms.y * columns[8] +
+		moment.quadrupole_trace_terms.z * columns[9];
+	vector_t even =
+		moment.dipole_moment.x * columns[1] +
+		moment.dipole_moment.y * columns[2] +
+		moment.dipole_moment.z * columns[3];
+	return reverse ? even - odd : even + odd;
+}
+
+// Computes the field of each node of a set of node interactions on the other
+// node, using cached operators between the geometric centers of nodes at the
+// same depth. The interactions should be sorted by operator, so that
+// neighbouring work items share the same operator. The fields are stored in
+// pairs: the field on node A, then the field on node B.
+void kernel compute_node_interaction_operator_fields(
+		// Nodes of the octree.
+		index_t num_nodes,
+		global node_t const* nodes,
+		// A set of node interactions to be computed.
+		index_t num_interactions,
+		global interaction_t const* interactions,
+		// The operator of each interaction (one more than its index, negative
+		// if reversed, or zero if there isn't one).
+		global index_diff_t const* interaction_operators,
+		global vector_t const* operators,
+		// The field on each of the nodes of each interaction.
+		global vector_t* interaction_fields) {
+	
+	index_t interaction_index = (index_t) get_global_id(0);
+	if (interaction_index >= num_interactions) {
+		return;
+	}
+	interaction_t interaction = interactions[interaction_index];
+	node_t node_a = nodes[INTERACTION_NODE_A(interaction)];
+	node_t node_b = nodes[INTERACTION_NODE_B(interaction)];
+	node_moment_t moment_a = node_a.value.moment;
+	node_moment_t moment_b = node_b.value.moment;
+	index_diff_t operator_index = interaction_operators[interaction_index];
+	
+	vector_t field_a;
+	vector_t field_b;
+	if (operator_index == 0) {
+		// Nodes at different depths have to be computed directly. The Ewald
+		// table is never needed, since the cache isn't used in periodic boxes.
+		global vector_t const* ewald_table = 0;
+		field_a = node_moment_field(
+			moment_b,
+			moment_b.center,
+			moment_a.center,
+			ewald_table).field;
+		field_b = node_moment_field(
+			moment_a,
+			moment_a.center,
+			moment_b.center,
+			ewald_table).field;
+	}
+	else {
+		// The operators act on moments about the geometric centers.
+		vector_t center_a = node_a.position + node_a.dimensions / 2;
+		vector_t center_b = node_b.position + node_b.dimensions / 2;
+		moment_a = shift_moment(moment_a, moment_a.center - center_a);
+		moment_b = shift_moment(moment_b, moment_b.center - center_b);
+		
+		// The operator takes the moments of A to the field at B.
+		bool reverse = operator_index < 0;
+		global vector_t const* columns =
+			operators + OPERATOR_NUM_MOMENTS * (abs(operator_index) - 1);
+		field_a = apply_operator(columns, moment_b, !reverse);
+		field_b = apply_operator(columns, moment_a, reverse);
+	}
+	interaction_fields[2 * interaction_index] = field_a;
+	interaction_fields[2 * interaction_index + 1] = field_b;
+}
+#endif
+
 // The second step in computing the field on a set of particles. This kernel
 // only calculates node fields. Precise ones need to be calculated using the
 // compute_leaf_interaction_fields.
@@ -159,12 +413,20 @@ void kernel compute_node_interaction_fields(
 		global node_t const* nodes,
 		// Cumulative number of interactions each node is involved in.
 		global index_t const* node_num_parent_interactions,
-		// A set of node interactions to be computed.
+		// A set of node interactions to be computed, and the rank of each
+		// interaction on each of its nodes.
 		index_t num_interactions,
 		global interaction_t const* interactions,
+		global index_t const* interaction_ranks,
 		// Array of all fields on particles.
 		index_t num_fields,
-		global node_field_t* fields) {
+		SEGMENTED_BUFFER(node_field_t, fields),
+		// Table of the field from periodic images (only used in a periodic
+		// box).
+		global vector_t const* ewald_table,
+		// Fields of the interactions found from the operator cache (only used
+		// with the operator cache).
+		global vector_t const* interaction_fields) {
 	
 	index_t interaction_index = (index_t) (get_group_id(0) / 2);
 	bool use_node_a = (bool) (get_group_id(0) % 2);
@@ -173,23 +435,32 @@ void kernel compute_node_interaction_fields(
 	}
 	interaction_t interaction = interactions[interaction_index];
 	index_t target_node_index = use_node_a ?
-		interaction.node_a_index : interaction.node_b_index;
+		INTERACTION_NODE_A(interaction) : INTERACTION_NODE_B(interaction);
 	index_t source_node_index = use_node_a ?
-		interaction.node_b_index : interaction.node_a_index;
+		INTERACTION_NODE_B(interaction) : INTERACTION_NODE_A(interaction);
 	
-	index_t target_node_interaction_index = use_node_a ?
-		interaction.node_a_interaction_index :
-		interaction.node_b_interaction_index;
+	index_t target_node_interaction_index =
+		interaction_ranks[2 * interaction_index + (use_node_a ? 0 : 1)];
 	
 	node_t target_node = nodes[target_node_index];
-	node_t source_node = nodes[source_node_index];
 	
-	// Calculate the field of the source node.
+#ifdef NODE_OPERATOR_CACHE
+	// The field has already been computed, at the geometric center of the
+	// target.
+	node_field_t field = {
+		target_node.position + target_node.dimensions / 2,
+		interaction_fields[2 * interaction_index + (use_node_a ? 0 : 1)]
+	};
+#else
+	// Calculate the field of the source node, from its center of charge to the
+	// center of charge of the target.
 	node_moment_t source_moment = nodes[source_node_index].value.moment;
 	node_field_t field = node_moment_field(
 		source_moment,
-		source_node.position + source_node.dimensions / 2,
-		target_node.position + target_node.dimensions / 2);
+		source_moment.center,
+		target_node.value.moment.center,
+		ewald_table);
+#endif
 	
 	index_t lid = (index_t) get_local_id(0);
 	
@@ -206,7 +477,7 @@ void kernel compute_node_interaction_fields(
 			node_field_indices[leaf_index] +
 			node_num_parent_interactions[target_node_index] +
 			target_node_interaction_index;
-		fields[field_index] = field;
+		SEGMENTED_AT(fields, field_index) = field;
 	}
 }
 
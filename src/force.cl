@@ -1,20 +1,35 @@
 #include "types.h"
+#include "constants.h"
+#include "segmented.h"
+
+#ifdef REPRODUCIBLE_FORCES
+// Converts a force to fixed-point, rounding to the nearest unit.
+long4 fixed_point_force(vector_t force) {
+	return convert_long4_sat_rte(force * FORCE_FIXED_POINT_SCALE);
+}
+#endif
 
 // Computes the force on a leaf as a result of a certain leaf field.
 force_t leaf_field_to_force(
-		leaf_moment_t moment,
+		leaf_value_t value,
 		leaf_field_t field,
 		vector_t position) {
-	force_t result = { moment.charge * field.field };
+	force_t result = { value.moment.charge * field.field };
+#ifdef NBODY_MASS_CHANNEL
+	result.force += value.mass * field.mass_field;
+#endif
 	return result;
 }
 
 // Computes the force on a leaf as a result of a certain node field.
 force_t node_field_to_force(
-		leaf_moment_t moment,
+		leaf_value_t value,
 		node_field_t field,
 		vector_t position) {
-	force_t result = { moment.charge * field.field };
+	force_t result = { value.moment.charge * field.field };
+#ifdef NBODY_MASS_CHANNEL
+	result.force += value.mass * field.mass_field;
+#endif
 	return result;
 }
 
@@ -24,7 +39,10 @@ void kernel convert_leaf_fields_to_forces(
 		global index_t const* leaf_field_indices,
 		global force_t* forces,
 		index_t num_fields,
-		global leaf_field_t const* fields) {
+		SEGMENTED_BUFFER(leaf_field_t const, fields),
+		// The forces in fixed-point (only used for reproducible forces, in
+		// which case they replace 'forces').
+		global fixed_force_t* fixed_forces) {
 	
 	index_t leaf_index = (index_t) get_global_id(0);
 	if (leaf_index >= num_leafs) {
@@ -32,8 +50,11 @@ void kernel convert_leaf_fields_to_forces(
 	}
 	
 	force_t net_force = { (vector_t) (0, 0, 0, 0) };
+#ifdef REPRODUCIBLE_FORCES
+	fixed_force_t net_fixed_force = { (long4) (0, 0, 0, 0) };
+#endif
 	
-	leaf_moment_t moment = leafs[leaf_index].value.moment;
+	leaf_value_t value = leafs[leaf_index].value;
 	vector_t position = leafs[leaf_index].position;
 	
 	index_t field_start = leaf_field_indices[leaf_index];
@@ -42,11 +63,19 @@ void kernel convert_leaf_fields_to_forces(
 			index_t field_index = field_start;
 			field_index < field_end;
 			++field_index) {
-		leaf_field_t field = fields[field_index];
-		force_t next_force = leaf_field_to_force(moment, field, position);
+		leaf_field_t field = SEGMENTED_AT(fields, field_index);
+		force_t next_force = leaf_field_to_force(value, field, position);
+#ifdef REPRODUCIBLE_FORCES
+		net_fixed_force.force += fixed_point_force(next_force.force);
+#else
 		net_force.force += next_force.force;
+#endif
 	}
+#ifdef REPRODUCIBLE_FORCES
+	fixed_forces[leaf_index] = net_fixed_force;
+#else
 	forces[leaf_index].force = net_force.force;
+#endif
 }
 
 void kernel convert_node_fields_to_forces(
@@ -55,7 +84,10 @@ void kernel convert_node_fields_to_forces(
 		global index_t const* leaf_field_indices,
 		global force_t* forces,
 		index_t num_fields,
-		global node_field_t const* fields) {
+		SEGMENTED_BUFFER(node_field_t const, fields),
+		// The forces in fixed-point (only used for reproducible forces, in
+		// which case they replace 'forces').
+		global fixed_force_t* fixed_forces) {
 	
 	index_t leaf_index = (index_t) get_global_id(0);
 	if (leaf_index >= num_leafs) {
@@ -63,8 +95,11 @@ void kernel convert_node_fields_to_forces(
 	}
 	
 	force_t net_force = { (vector_t) (0, 0, 0, 0) };
+#ifdef REPRODUCIBLE_FORCES
+	fixed_force_t net_fixed_force = { (long4) (0, 0, 0, 0) };
+#endif
 	
-	leaf_moment_t moment = leafs[leaf_index].value.moment;
+	leaf_value_t value = leafs[leaf_index].value;
 	vector_t position = leafs[leaf_index].position;
 	
 	index_t field_start = leaf_field_indices[leaf_index];
@@ -73,10 +108,18 @@ void kernel convert_node_fields_to_forces(
 			index_t field_index = field_start;
 			field_index < field_end;
 			++field_index) {
-		node_field_t field = fields[field_index];
-		force_t next_force = node_field_to_force(moment, field, position);
+		node_field_t field = SEGMENTED_AT(fields, field_index);
+		force_t next_force = node_field_to_force(value, field, position);
+#ifdef REPRODUCIBLE_FORCES
+		net_fixed_force.force += fixed_point_force(next_force.force);
+#else
 		net_force.force += next_force.force;
+#endif
 	}
+#ifdef REPRODUCIBLE_FORCES
+	fixed_forces[leaf_index] = net_fixed_force;
+#else
 	forces[leaf_index].force = net_force.force;
+#endif
 }
 
@@ -1,41 +1,75 @@
 #include "types.h"
+#include "constants.h"
+#include "periodic.h"
+#include "multipole.h"
 
-#ifndef NODE_APPROX_RATIO
-#define NODE_APPROX_RATIO ((scalar_t) 0.5)
+#ifdef NODE_ERROR_TOLERANCE
+// Estimates the relative error in the field of a source node at the leafs of a
+// target node, when the field is computed from the moments of the source and
+// is only evaluated once at the center of the target. The error is relative to
+// the field of the absolute charge of the source.
+scalar_t node_approx_error(
+		node_t source_node,
+		node_t target_node,
+		scalar_t center_distance) {
+	node_moment_t source = source_node.value.moment;
+	node_moment_t target = target_node.value.moment;
+	// A node without any charge has no field, so approximating it is exact.
+	if (source_node.leaf_count == 0 || source.absolute_charge == 0) {
+		return 0;
+	}
+	scalar_t separation = center_distance - source.radius - target.radius;
+	if (separation <= 0) {
+		return INFINITY;
+	}
+	// The field changes across the target by about the gradient of the field
+	// times the radius of the target.
+	scalar_t target_error = 2 * target.radius / separation;
+	// The octupole is the first term left out of the field of the source. Its
+	// size is estimated from the quadrupole and the radius of the source.
+	vector_t trace_terms = source.quadrupole_trace_terms;
+	vector_t cross_terms = source.quadrupole_cross_terms;
+	scalar_t quadrupole_norm = sqrt(
+		dot(trace_terms, trace_terms) +
+		2 * dot(cross_terms, cross_terms));
+	scalar_t source_error =
+		(scalar_t) 4.5 * quadrupole_norm * source.radius /
+		(source.absolute_charge * separation * separation * separation);
+	return target_error + source_error;
+}
+
+#ifdef NBODY_MASS_CHANNEL
+// Estimates the relative error in the field of the mass of the source node on
+// the target node, in the same way as for the charge.
+scalar_t node_mass_approx_error(
+		node_t source_node,
+		node_t target_node,
+		scalar_t center_distance) {
+	node_moment_t source = source_node.value.moment;
+	source_node.value.moment = swap_channels(source);
+	source_node.value.moment.absolute_charge = fabs(source.mass);
+	return node_approx_error(source_node, target_node, center_distance);
+}
+#endif
 #endif
 
-// The first step in computing the forces on a set of particles. A set of
-// reducible interactions are reduced to create a list containing both reducable
-// and irreducible interactions.
-__attribute__((reqd_work_group_size(8, 8, 1)))
-void kernel find_interactions(
-		// The nodes that make up the octree.
-		index_t num_nodes,
+// Finds the interaction between one pair of children of a reducible
+// interaction, with 'lid_a' and 'lid_b' picking out the children. Returns the
+// queue that the new interaction belongs in (QUEUE_*_INDEX), or
+// QUEUE_NUM_QUEUES if there is no interaction between the pair.
+index_t reduce_interaction(
 		global node_t const* nodes,
-		// A set of reducible interactions.
-		index_t num_interactions,
-		global interaction_t const* interactions,
-		// The results of reducing the above set of interactions. Size of this
-		// array is 64 * num_interactions.
-		global interaction_t* new_interactions) {
-	
-	index_t interaction_index = (index_t) get_group_id(0);
-	if (interaction_index >= num_interactions) {
-		return;
-	}
-	interaction_t interaction = interactions[interaction_index];
+		interaction_t interaction,
+		index_t lid_a,
+		index_t lid_b,
+		interaction_t* new_interaction) {
 	
 	// Get both nodes involved in the interaction.
-	index_t node_a_index = interaction.node_a_index;
-	index_t node_b_index = interaction.node_b_index;
+	index_t node_a_index = INTERACTION_NODE_A(interaction);
+	index_t node_b_index = INTERACTION_NODE_B(interaction);
 	node_t node_a = nodes[node_a_index];
 	node_t node_b = nodes[node_b_index];
 	
-	// Must break both of the nodes down into their children and go through
-	// every possible interaction between them.
-	index_t lid_a = (index_t) get_local_id(0);
-	index_t lid_b = (index_t) get_local_id(1);
-	
 	// Find the indices of the two children that are going to partake in the
 	// interaction. In the case that one of the nodes doesn't have children,
 	// only consider the other node's children.
@@ -57,69 +91,378 @@ void kernel find_interactions(
 			(node_a_index == node_b_index && lid_b > lid_a) ||
 			(!node_a.has_children && lid_a != 0) ||
 			(!node_b.has_children && lid_b != 0)) {
-		return;
+		return QUEUE_NUM_QUEUES;
 	}
 	
-	// Calculate the distance between the centers of the two children.
-	vector_t displacement =
-		(child_b.position + child_b.dimensions / 2) -
-		(child_a.position + child_a.dimensions / 2);
-	scalar_t distance_sq = dot(displacement, displacement);
+	// Calculate the distance between the centers of charge of the two children
+	// (between the nearest images in a periodic box). The fields of the
+	// children are expanded about these centers, and every leaf of a child is
+	// within its radius of the center.
+	node_moment_t moment_a = child_a.value.moment;
+	node_moment_t moment_b = child_b.value.moment;
+	vector_t displacement = minimum_image(moment_b.center - moment_a.center);
+	scalar_t center_distance = length(displacement);
+	scalar_t radius_sum = moment_a.radius + moment_b.radius;
 	
-	// Calculate the maximum possible perpendicular average extent of the
-	// children (from opposite corners of a node's volume).
-	scalar_t extent_sum = child_a.dimensions.x + child_b.dimensions.x;
-	scalar_t extent_sq = (scalar_t) (3.0 / 4.0) * extent_sum * extent_sum;
+#ifdef PM_SPLIT_RADIUS
+	// The particle-mesh takes care of children that are so far apart that none
+	// of their leafs are within the cutoff, so no interaction is needed.
+	scalar_t separation = center_distance - radius_sum;
+	if (separation > PM_CUTOFF_FACTOR * PM_SPLIT_RADIUS) {
+		return QUEUE_NUM_QUEUES;
+	}
+#endif
 	
-	// If the ratio of the extent to the distances is small enough, then
-	// long distance approximations can be used.
-	scalar_t approx_ratio_sq = NODE_APPROX_RATIO * NODE_APPROX_RATIO;
+#ifdef NODE_ERROR_TOLERANCE
+	// Use long distance approximations if the estimated error in both
+	// directions is small enough.
+	bool can_approx =
+		(child_a_index != child_b_index) &&
+		node_approx_error(child_a, child_b, center_distance) <
+			NODE_ERROR_TOLERANCE &&
+		node_approx_error(child_b, child_a, center_distance) <
+			NODE_ERROR_TOLERANCE;
+#ifdef NBODY_MASS_CHANNEL
+	can_approx =
+		can_approx &&
+		node_mass_approx_error(child_a, child_b, center_distance) <
+			NODE_ERROR_TOLERANCE &&
+		node_mass_approx_error(child_b, child_a, center_distance) <
+			NODE_ERROR_TOLERANCE;
+#endif
+#else
+	// If the ratio of the radii to the distance is small enough, then long
+	// distance approximations can be used.
 	bool can_approx =
 		(child_a_index != child_b_index) &&
-		(extent_sq / distance_sq < approx_ratio_sq);
+		(radius_sum < NODE_APPROX_RATIO * center_distance);
+#endif
 	bool can_reduce =
 		!can_approx &&
 		(child_a.has_children || child_b.has_children);
 	
 	// Fill out the details of the new interaction.
-	interaction_t new_interaction = {
-		child_a_index,
-		child_b_index,
-		0,
-		0,
-		can_approx,
-		can_reduce
+	interaction_t result = {
+		INTERACTION_PACK(child_a_index, can_approx),
+		INTERACTION_PACK(child_b_index, can_reduce)
 	};
+	*new_interaction = result;
+	return
+		can_reduce ? QUEUE_REDUCIBLE_INDEX :
+		can_approx ? QUEUE_NODE_INDEX :
+		QUEUE_LEAF_INDEX;
+}
+
+// The first step in computing the forces on a set of particles. A set of
+// reducible interactions are reduced, and the resulting interactions are
+// appended to one of three queues: the reducible interactions (to be
+// substituted back into this kernel), the leaf interactions, and the node
+// interactions. Each work group reserves space in the queues with a single
+// atomic per queue.
+__attribute__((reqd_work_group_size(8, 8, 1)))
+void kernel find_interactions(
+		// The nodes that make up the octree.
+		index_t num_nodes,
+		global node_t const* nodes,
+		// A set of reducible interactions.
+		index_t num_interactions,
+		global interaction_t const* interactions,
+		// The queues of new interactions. Each queue has space for
+		// 64 * num_interactions interactions.
+		global interaction_t* reducible_interactions,
+		global interaction_t* leaf_interactions,
+		global interaction_t* node_interactions,
+		// The number of interactions in each queue (indexed by
+		// QUEUE_*_INDEX).
+		global index_t* queue_counts) {
+	
+	local index_t group_counts[QUEUE_NUM_QUEUES];
+	local index_t group_offsets[QUEUE_NUM_QUEUES];
+	
+	index_t interaction_index = (index_t) get_group_id(0);
+	if (interaction_index >= num_interactions) {
+		return;
+	}
+	
+	// Each work item looks at one pair of the children of the interaction.
+	index_t lid_a = (index_t) get_local_id(0);
+	index_t lid_b = (index_t) get_local_id(1);
+	if (lid_a == 0 && lid_b < QUEUE_NUM_QUEUES) {
+		group_counts[lid_b] = 0;
+	}
+	interaction_t new_interaction;
+	index_t queue_index = reduce_interaction(
+		nodes,
+		interactions[interaction_index],
+		lid_a,
+		lid_b,
+		&new_interaction);
+	bool has_interaction = queue_index != QUEUE_NUM_QUEUES;
+	
+	// Find the position of the interaction within the work group's part of its
+	// queue, then reserve space in every queue for the whole work group.
+	barrier(CLK_LOCAL_MEM_FENCE);
+	index_t group_offset = 0;
+	if (has_interaction) {
+		group_offset = INDEX_ATOMIC_INC(group_counts + queue_index);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid_a == 0 && lid_b < QUEUE_NUM_QUEUES) {
+		group_offsets[lid_b] = group_counts[lid_b] == 0 ?
+			0 :
+			INDEX_ATOMIC_ADD(queue_counts + lid_b, group_counts[lid_b]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (!has_interaction) {
+		return;
+	}
 	
-	// In the returning array, any interactions between node '0' and node '0'
-	// will be removed, and the other interactions will be sorted into the
-	// irreducible and the reducible interactions. The reducable interactions
-	// will be substituted back into this kernel until there are none left.
-	index_t new_interaction_index = 64 * interaction_index + 8 * lid_b + lid_a;
-	new_interactions[new_interaction_index] = new_interaction;
+	index_t new_interaction_index = group_offsets[queue_index] + group_offset;
+	if (queue_index == QUEUE_REDUCIBLE_INDEX) {
+		reducible_interactions[new_interaction_index] = new_interaction;
+	}
+	else if (queue_index == QUEUE_LEAF_INDEX) {
+		leaf_interactions[new_interaction_index] = new_interaction;
+	}
+	else {
+		node_interactions[new_interaction_index] = new_interaction;
+	}
 }
 
-// Fills out the interactions so that they know what index they are within the
-// set of all interactions acting on a node.
-void kernel compute_interaction_indices(
+// Reduces interactions all the way down, starting from the interaction of the
+// root with itself, without returning to the host in between. The work items
+// keep running for the whole traversal, taking reducible interactions from a
+// work queue and adding the reducible interactions they find back onto it,
+// until there are none left. The leaf and node interactions are appended to
+// their own queues.
+//
+// Every queue has a fixed capacity. If any of them runs out, the overflow flag
+// is set, every work item stops, and the traversal has to be done again (with
+// larger queues, or level by level with 'find_interactions').
+void kernel traverse_interactions(
+		// The nodes that make up the octree.
 		index_t num_nodes,
-		// A record of how many interactions each node is part of.
-		global index_t* node_num_interactions,
+		global node_t const* nodes,
+		// The capacity of each of the queues.
+		index_t queue_capacity,
+		// The work queue, together with a flag for each entry that is set once
+		// the entry has been written. Starts with the root interaction.
+		volatile global interaction_t* work_queue,
+		volatile global index_t* work_queue_ready,
+		// The queues of leaf and node interactions.
+		global interaction_t* leaf_interactions,
+		global interaction_t* node_interactions,
+		// The counters (indexed by TRAVERSAL_*_INDEX).
+		volatile global index_t* counters) {
+	
+	// The work items never wait on each other inside of a loop iteration, so
+	// that a work item can't hold up others running in lockstep with it. An
+	// entry that has been taken from the work queue but isn't ready yet is held
+	// onto until a later iteration.
+	bool holding = false;
+	index_t held_index = 0;
+	while (true) {
+		if (INDEX_ATOMIC_OR(counters + TRAVERSAL_OVERFLOW_INDEX, 0) != 0) {
+			break;
+		}
+		
+		// Try to take the next entry off of the work queue.
+		if (!holding) {
+			index_t head = INDEX_ATOMIC_OR(counters + TRAVERSAL_HEAD_INDEX, 0);
+			index_t tail = INDEX_ATOMIC_OR(counters + TRAVERSAL_TAIL_INDEX, 0);
+			if (
+					head < tail &&
+					INDEX_ATOMIC_CMPXCHG(
+						counters + TRAVERSAL_HEAD_INDEX,
+						head,
+						head + 1) == head) {
+				holding = true;
+				held_index = head;
+			}
+		}
+		
+		if (holding && INDEX_ATOMIC_OR(work_queue_ready + held_index, 0) != 0) {
+			holding = false;
+			// Pairs with the fence between the write of the entry and the
+			// ready flag, so that the entry isn't read before the flag.
+			read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			interaction_t interaction = work_queue[held_index];
+			
+			// Go through every pair of children of the interaction.
+			for (index_t lid_b = 0; lid_b < 8; ++lid_b) {
+				for (index_t lid_a = 0; lid_a < 8; ++lid_a) {
+					interaction_t new_interaction;
+					index_t queue_index = reduce_interaction(
+						nodes,
+						interaction,
+						lid_a,
+						lid_b,
+						&new_interaction);
+					if (queue_index == QUEUE_NUM_QUEUES) {
+						continue;
+					}
+					
+					index_t counter_index =
+						queue_index == QUEUE_REDUCIBLE_INDEX ?
+							TRAVERSAL_TAIL_INDEX :
+						queue_index == QUEUE_LEAF_INDEX ?
+							TRAVERSAL_LEAF_COUNT_INDEX :
+							TRAVERSAL_NODE_COUNT_INDEX;
+					if (queue_index == QUEUE_REDUCIBLE_INDEX) {
+						// The new entry counts as pending before it is added,
+						// so that the number of pending entries can't reach
+						// zero early.
+						INDEX_ATOMIC_INC(counters + TRAVERSAL_PENDING_INDEX);
+					}
+					index_t new_index =
+						INDEX_ATOMIC_INC(counters + counter_index);
+					if (new_index >= queue_capacity) {
+						INDEX_ATOMIC_XCHG(
+							counters + TRAVERSAL_OVERFLOW_INDEX,
+							1);
+						return;
+					}
+					if (queue_index == QUEUE_REDUCIBLE_INDEX) {
+						work_queue[new_index] = new_interaction;
+						mem_fence(CLK_GLOBAL_MEM_FENCE);
+						INDEX_ATOMIC_XCHG(work_queue_ready + new_index, 1);
+					}
+					else if (queue_index == QUEUE_LEAF_INDEX) {
+						leaf_interactions[new_index] = new_interaction;
+					}
+					else {
+						node_interactions[new_index] = new_interaction;
+					}
+				}
+			}
+			
+			// Only now that its children are on the queue is the interaction
+			// finished.
+			INDEX_ATOMIC_DEC(counters + TRAVERSAL_PENDING_INDEX);
+		}
+		
+		if (
+				!holding &&
+				INDEX_ATOMIC_OR(counters + TRAVERSAL_PENDING_INDEX, 0) == 0) {
+			break;
+		}
+	}
+}
+
+// Every interaction has two endpoints, one on each of its nodes. The position
+// of an interaction within the set of all interactions acting on a node is
+// found by sorting the endpoints by node and ranking them within each node.
+// The endpoints are packed into a single key, with the node in the upper half
+// and the endpoint (twice the interaction index, plus one for node B) in the
+// lower half, so the ranking doesn't depend on the order in which anything
+// runs.
+
+// Fills out the endpoint keys of a set of interactions. The keys are padded to
+// a power of two for sorting.
+void kernel compute_interaction_endpoints(
 		// The interactions.
 		index_t num_interactions,
-		global interaction_t* interactions) {
+		global interaction_t const* interactions,
+		// The endpoints of the interactions, followed by padding.
+		index_t num_endpoints,
+		global ulong* endpoints) {
 	
-	index_t interaction_index = (index_t) get_global_id(0);
-	if (interaction_index >= num_interactions) {
+	index_t endpoint_index = (index_t) get_global_id(0);
+	if (endpoint_index >= num_endpoints) {
 		return;
 	}
-	interaction_t interaction = interactions[interaction_index];
+	if (endpoint_index >= 2 * num_interactions) {
+		endpoints[endpoint_index] = ULONG_MAX;
+		return;
+	}
+	interaction_t interaction = interactions[endpoint_index / 2];
+	index_t node_index = endpoint_index % 2 == 0 ?
+		INTERACTION_NODE_A(interaction) :
+		INTERACTION_NODE_B(interaction);
+	endpoints[endpoint_index] =
+		((ulong) node_index << 32) | (ulong) endpoint_index;
+}
+
+// One step of a bitonic sort of the endpoint keys. Each work item compares a
+// pair of keys 'stride' apart, within blocks of size 'block_size' that are
+// sorted in alternating directions.
+void kernel sort_interaction_endpoints(
+		index_t num_endpoints,
+		global ulong* endpoints,
+		index_t block_size,
+		index_t stride) {
+	
+	index_t pair_index = (index_t) get_global_id(0);
+	if (pair_index >= num_endpoints / 2) {
+		return;
+	}
+	index_t low = 2 * stride * (pair_index / stride) + pair_index % stride;
+	index_t high = low + stride;
+	bool ascending = (low & block_size) == 0;
+	ulong low_key = endpoints[low];
+	ulong high_key = endpoints[high];
+	if ((low_key > high_key) == ascending) {
+		endpoints[low] = high_key;
+		endpoints[high] = low_key;
+	}
+}
+
+// Finds where the sorted endpoints of each node start and end. The end of each
+// node is temporarily stored as its number of interactions.
+void kernel find_interaction_endpoint_segments(
+		// The sorted endpoints, without padding.
+		index_t num_endpoints,
+		global ulong const* endpoints,
+		// The start and end of the endpoints of each node.
+		index_t num_nodes,
+		global index_t* node_segment_starts,
+		global index_t* node_num_interactions) {
+	
+	index_t endpoint_index = (index_t) get_global_id(0);
+	if (endpoint_index >= num_endpoints) {
+		return;
+	}
+	index_t node_index = (index_t) (endpoints[endpoint_index] >> 32);
+	if (
+			endpoint_index == 0 ||
+			(index_t) (endpoints[endpoint_index - 1] >> 32) != node_index) {
+		node_segment_starts[node_index] = endpoint_index;
+	}
+	if (
+			endpoint_index == num_endpoints - 1 ||
+			(index_t) (endpoints[endpoint_index + 1] >> 32) != node_index) {
+		node_num_interactions[node_index] = endpoint_index + 1;
+	}
+}
+
+// Finds the rank of each endpoint, which is the index of the interaction
+// within the set of all interactions acting on the node, and counts the
+// interactions of each node.
+void kernel rank_interaction_endpoints(
+		// The sorted endpoints, without padding.
+		index_t num_endpoints,
+		global ulong const* endpoints,
+		// The start of the endpoints of each node, and the end of the endpoints
+		// of each node (which is turned into the number of interactions).
+		index_t num_nodes,
+		global index_t const* node_segment_starts,
+		global index_t* node_num_interactions,
+		// The ranks of the endpoints (two for each interaction, in the same
+		// order as the endpoints before sorting).
+		global index_t* ranks) {
 	
-	// Increment the number of interactions that the nodes are a part of.
-	interaction.node_a_interaction_index =
-		atomic_inc(node_num_interactions + interaction.node_a_index);
-	interaction.node_b_interaction_index =
-		atomic_inc(node_num_interactions + interaction.node_b_index);
+	index_t endpoint_index = (index_t) get_global_id(0);
+	if (endpoint_index >= num_endpoints) {
+		return;
+	}
+	ulong key = endpoints[endpoint_index];
+	index_t node_index = (index_t) (key >> 32);
+	index_t endpoint = (index_t) key;
+	index_t rank = endpoint_index - node_segment_starts[node_index];
+	ranks[endpoint] = rank;
+	if (rank == 0) {
+		node_num_interactions[node_index] -= endpoint_index;
+	}
 }
 
 // Determine the maximum number of leafs acting on each other in a leaf
@@ -141,14 +484,14 @@ void kernel compute_node_max_interactions_leaf_count(
 	interaction_t interaction = interactions[interaction_index];
 	
 	// Store the maximum number of 
-	index_t node_a_index = interaction.node_a_index;
-	index_t node_b_index = interaction.node_b_index;
+	index_t node_a_index = INTERACTION_NODE_A(interaction);
+	index_t node_b_index = INTERACTION_NODE_B(interaction);
 	node_t node_a = nodes[node_a_index];
 	node_t node_b = nodes[node_b_index];
-	atomic_max(
+	INDEX_ATOMIC_MAX(
 		node_max_interactions_leaf_count + node_a_index,
 		node_b.leaf_count);
-	atomic_max(
+	INDEX_ATOMIC_MAX(
 		node_max_interactions_leaf_count + node_b_index,
 		node_a.leaf_count);
 }
@@ -2,35 +2,106 @@
 #include <cmath>
 #include <ctime>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#ifdef NBODY_USE_MPI
+#include <mpi.h>
+#endif
+
 #include "nbody/animation.h"
+#include "nbody/distributed/communicator.h"
+#include "nbody/distributed_simulation.h"
+#include "nbody/host/thread_pool.h"
 #include "nbody/naive_simulation.h"
 #include "nbody/open_cl_simulation.h"
+#include "nbody/out_of_core_simulation.h"
 
 using Simulation = nbody::OpenClSimulation;
+using BaseSimulation = nbody::Simulation<Simulation::Scalar, Simulation::Vector>;
+
+// Options that can be given on the command line.
+struct Options {
+	nbody::DeviceSelection deviceSelection;
+	nbody::SolverSettings solverSettings;
+	std::size_t numThreads = 0;
+	std::vector<int> cores;
+	std::size_t numRanks = 1;
+	bool useMpi = false;
+	std::string outOfCorePath;
+	std::size_t chunkSize = OUT_OF_CORE_CHUNK_SIZE;
+};
 
 Simulation::Scalar uniformRandom();
+Options parseOptions(int argc, char** argv);
+std::vector<int> parseCores(std::string value);
+void runSimulation(BaseSimulation& simulation, std::string fileName);
+void runDistributed(
+	nbody::distributed::Communicator& communicator,
+	Options const& options,
+	Simulation::Vector bounds,
+	std::vector<Simulation::Particle> particles,
+	Simulation::Scalar timeStep);
 
 int main(int argc, char** argv) {
 	try {
+		Options options = parseOptions(argc, argv);
+		nbody::host::ThreadPool::configureGlobal(
+			options.numThreads,
+			options.cores);
+		
+		if (
+				(options.useMpi || options.numRanks > 1) &&
+				!options.outOfCorePath.empty()) {
+			throw std::runtime_error(
+				"Out-of-core simulations can't be distributed");
+		}
+		if (
+				(options.useMpi || options.numRanks > 1) &&
+				(options.solverSettings.meshSize != 0 ||
+				options.solverSettings.periodic ||
+				options.solverSettings.operatorCache)) {
+			throw std::runtime_error(
+				"Distributed simulations can't use a particle-mesh, a "
+				"periodic box, or the operator cache");
+		}
+		
+		// Every MPI process generates its own share of the particles, so MPI
+		// has to be started first. The processes share a seed, offset by their
+		// rank so that they don't all generate the same particles.
 		unsigned int seed = std::time(NULL);
-		std::srand(seed);
+		std::size_t mpiRank = 0;
+		std::size_t mpiSize = 1;
+		if (options.useMpi) {
+#ifdef NBODY_USE_MPI
+			MPI_Init(&argc, &argv);
+			int rank;
+			int size;
+			MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+			MPI_Comm_size(MPI_COMM_WORLD, &size);
+			MPI_Bcast(&seed, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+			mpiRank = static_cast<std::size_t>(rank);
+			mpiSize = static_cast<std::size_t>(size);
+#else
+			throw std::runtime_error("Not built with MPI support");
+#endif
+		}
+		std::srand(seed + mpiRank);
 		std::cout << "Using random number generator seed " << seed << ".\n";
 		
 		// Parameters for simulation initial state.
-		unsigned int numParticles = 1000000;
+		std::size_t numParticles =
+			1000000 * (mpiRank + 1) / mpiSize - 1000000 * mpiRank / mpiSize;
 		Simulation::Vector bounds = { 1.0, 1.0, 1.0, 0.0 };
 		Simulation::Scalar velocityMax = 0.1;
 		Simulation::Scalar massRange[2] = { 1.0, 10.0 };
 		Simulation::Scalar chargeRange[2] = { 0.1, 1.0 };
 		
 		// Create randomly positioned particles.
-		std::cout << "Generating particles.\n";
-		std::vector<Simulation::Particle> particles;
-		particles.reserve(numParticles);
-		for (unsigned int i = 0; i < numParticles; ++i) {
+		auto randomParticle = [&]() {
 			Simulation::Vector position = {
 				bounds[0] * (uniformRandom()),
 				bounds[1] * (uniformRandom()),
@@ -62,43 +133,92 @@ int main(int argc, char** argv) {
 				mass,
 				charge
 			};
-			particles.push_back(particle);
-		}
+			return particle;
+		};
 		
-		// Create the simulation.
 		Simulation::Scalar timeStep = 0.001;
-		Simulation simulation(
-			bounds,
-			particles,
-			timeStep,
-			std::cout);
+		if (!options.outOfCorePath.empty()) {
+			// The particles are written straight to the file, so that they
+			// never all have to be in memory.
+			std::cout << "Generating particles.\n";
+			nbody::OutOfCoreSimulation::writeParticles(
+				options.outOfCorePath,
+				numParticles,
+				[&](std::size_t) {
+					return randomParticle();
+				});
+			nbody::OutOfCoreSimulation simulation(
+				options.outOfCorePath,
+				bounds,
+				timeStep,
+				std::cout,
+				options.deviceSelection,
+				options.solverSettings,
+				options.chunkSize);
+			runSimulation(simulation, "");
+			return 0;
+		}
 		
-		// Create a .CSV file to store the data in.
-		std::ofstream dataFile("particles.csv");
+		std::cout << "Generating particles.\n";
+		std::vector<Simulation::Particle> particles;
+		particles.reserve(numParticles);
+		for (std::size_t i = 0; i < numParticles; ++i) {
+			particles.push_back(randomParticle());
+		}
 		
-		std::cout << "Starting simulation.\n";
-		std::size_t stepIndex = 0;
-		Simulation::Scalar time = 0.0;
-		Simulation::Scalar maxTime = 0.01;
-		while (time < maxTime) {
-			// Take a step.
-			time = simulation.step();
-			
-			// Output to data file.
-			dataFile << time;
-			for (Simulation::Particle p : simulation.particles()) {
-				dataFile <<
-					"," << p.position[0] <<
-					"," << p.position[1] <<
-					"," << p.position[2];
+		if (options.useMpi) {
+#ifdef NBODY_USE_MPI
+			// Every process generated its own share of the particles, so they
+			// can be used directly.
+			nbody::distributed::MpiCommunicator communicator;
+			runDistributed(
+				communicator,
+				options,
+				bounds,
+				particles,
+				timeStep);
+			MPI_Finalize();
+#endif
+		}
+		else if (options.numRanks > 1) {
+			// Run every rank in its own thread, each starting with an equal
+			// share of the particles.
+			std::vector<nbody::distributed::LocalCommunicator> communicators =
+				nbody::distributed::LocalCommunicator::createGroup(
+					options.numRanks);
+			std::vector<std::future<void> > results;
+			for (std::size_t rank = 0; rank < options.numRanks; ++rank) {
+				std::vector<Simulation::Particle> rankParticles(
+					particles.begin() + particles.size() * rank / options.numRanks,
+					particles.begin() +
+						particles.size() * (rank + 1) / options.numRanks);
+				results.push_back(std::async(
+					std::launch::async,
+					runDistributed,
+					std::ref(communicators[rank]),
+					std::cref(options),
+					bounds,
+					rankParticles,
+					timeStep));
+			}
+			for (std::future<void>& result : results) {
+				result.get();
 			}
-			dataFile << "\n";
-			
-			// Update the counter.
-			++stepIndex;
 		}
-		
-		dataFile.close();
+		else {
+			// Create the simulation.
+			Simulation simulation(
+				bounds,
+				particles,
+				timeStep,
+				std::cout,
+				options.deviceSelection,
+				options.solverSettings);
+			// The simulation keeps its own copy of the particles in the
+			// octree, so this one is no longer needed.
+			std::vector<Simulation::Particle>().swap(particles);
+			runSimulation(simulation, "particles.csv");
+		}
 	}
 	catch (cl::BuildError error) {
 		std::cerr << "OpenCL build error " << error.err() <<
@@ -111,13 +231,216 @@ int main(int argc, char** argv) {
 		std::cerr << "OpenCL error " << error.err() <<
 			" in " << error.what() << "\n";
 	}
+	catch (std::exception const& error) {
+		std::cerr << "Error: " << error.what() << "\n";
+	}
 	
 	return 0;
 }
 
+// Runs a simulation, saving the positions of the particles after each step to
+// a .CSV file (unless the file name is empty).
+void runSimulation(BaseSimulation& simulation, std::string fileName) {
+	// Create a .CSV file to store the data in.
+	std::ofstream dataFile;
+	if (!fileName.empty()) {
+		dataFile.open(fileName);
+	}
+	
+	std::cout << "Starting simulation.\n";
+	std::size_t stepIndex = 0;
+	Simulation::Scalar time = 0.0;
+	Simulation::Scalar maxTime = 0.01;
+	while (time < maxTime) {
+		// Take a step.
+		time = simulation.step();
+		
+		// Output to data file.
+		if (dataFile.is_open()) {
+			dataFile << time;
+			for (Simulation::Particle p : simulation.particles()) {
+				dataFile <<
+					"," << p.position[0] <<
+					"," << p.position[1] <<
+					"," << p.position[2];
+			}
+			dataFile << "\n";
+		}
+		
+		// Update the counter.
+		++stepIndex;
+	}
+	
+	dataFile.close();
+}
+
+// Runs one rank of a distributed simulation. Each rank saves its own
+// particles to a separate file.
+void runDistributed(
+		nbody::distributed::Communicator& communicator,
+		Options const& options,
+		Simulation::Vector bounds,
+		std::vector<Simulation::Particle> particles,
+		Simulation::Scalar timeStep) {
+	nbody::DistributedSimulation simulation(
+		communicator,
+		bounds,
+		particles,
+		timeStep,
+		std::cout,
+		options.deviceSelection,
+		options.solverSettings);
+	runSimulation(
+		simulation,
+		"particles-" + std::to_string(communicator.rank()) + ".csv");
+}
+
 Simulation::Scalar uniformRandom() {
 	Simulation::Scalar rand =
 		static_cast<Simulation::Scalar>(std::rand());
 	return rand / RAND_MAX;
 }
 
+
+// Reads the options from the command line. The OpenCL devices are selected
+// with '--platform <name>', '--device <name>', '--type <cpu|gpu|accelerator|
+// all>', '--index <n>', '--devices <n>' (where 0 means all matching devices),
+// and '--numa <0|1>' (whether to split devices by NUMA node). The host threads
+// are set with '--threads <n>' and '--pin <core,core,...>'. A distributed
+// simulation is run with '--ranks <n>' (as threads of this process) or with
+// '--mpi 1' (as MPI processes). The long range forces are computed on a
+// particle-mesh with '--mesh <n>' cells per side, split from the octree at the
+// distance given by '--split <r>'. The bounds are made into a periodic box with
+// '--periodic 1'. The root of the octree follows the particles unless
+// '--auto-bounds 0' is given. Nodes are approximated based on an estimate of
+// the relative error with '--tolerance <error>'. Node interactions use cached
+// operators with '--operator-cache 1'. The octree is walked level by level from
+// the host with '--persistent 0'. Forces are summed in fixed-point, so that
+// every run gives the same result, with '--reproducible 1'. Leaf interactions
+// read leafs with quantized positions with '--compact-leafs 1'. The lists of
+// interactions on the host are kept in huge pages with '--huge-pages 1'. The
+// particles are kept in a memory-mapped file instead of in memory with
+// '--out-of-core <file>', and are simulated '--chunk <n>' particles at a time.
+Options parseOptions(int argc, char** argv) {
+	Options options;
+	nbody::DeviceSelection& selection = options.deviceSelection;
+	for (int index = 1; index < argc; ++index) {
+		std::string option = argv[index];
+		if (index + 1 >= argc) {
+			throw std::runtime_error("Missing value for option " + option);
+		}
+		std::string value = argv[++index];
+		if (option == "--platform") {
+			selection.platformName = value;
+		}
+		else if (option == "--device") {
+			selection.deviceName = value;
+		}
+		else if (option == "--type") {
+			if (value == "cpu") {
+				selection.deviceType = CL_DEVICE_TYPE_CPU;
+			}
+			else if (value == "gpu") {
+				selection.deviceType = CL_DEVICE_TYPE_GPU;
+			}
+			else if (value == "accelerator") {
+				selection.deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+			}
+			else if (value == "all") {
+				selection.deviceType = CL_DEVICE_TYPE_ALL;
+			}
+			else {
+				throw std::runtime_error("Unknown device type " + value);
+			}
+		}
+		else if (option == "--index") {
+			selection.deviceIndex = std::stoul(value);
+		}
+		else if (option == "--devices") {
+			selection.maxDevices = std::stoul(value);
+		}
+		else if (option == "--numa") {
+			selection.numaFission = (std::stoul(value) != 0);
+		}
+		else if (option == "--mesh") {
+			options.solverSettings.meshSize = std::stoul(value);
+		}
+		else if (option == "--split") {
+			options.solverSettings.splitRadius = std::stof(value);
+		}
+		else if (option == "--periodic") {
+			options.solverSettings.periodic = (std::stoul(value) != 0);
+		}
+		else if (option == "--auto-bounds") {
+			options.solverSettings.automaticBounds = (std::stoul(value) != 0);
+		}
+		else if (option == "--tolerance") {
+			options.solverSettings.nodeErrorTolerance = std::stof(value);
+		}
+		else if (option == "--operator-cache") {
+			options.solverSettings.operatorCache = (std::stoul(value) != 0);
+		}
+		else if (option == "--persistent") {
+			options.solverSettings.persistentTraversal =
+				(std::stoul(value) != 0);
+		}
+		else if (option == "--reproducible") {
+			options.solverSettings.reproducibleForces =
+				(std::stoul(value) != 0);
+		}
+		else if (option == "--compact-leafs") {
+			options.solverSettings.compactLeafs = (std::stoul(value) != 0);
+		}
+		else if (option == "--huge-pages") {
+			options.solverSettings.hugePages = (std::stoul(value) != 0);
+		}
+		else if (option == "--threads") {
+			options.numThreads = std::stoul(value);
+		}
+		else if (option == "--pin") {
+			options.cores = parseCores(value);
+		}
+		else if (option == "--ranks") {
+			options.numRanks = std::stoul(value);
+		}
+		else if (option == "--mpi") {
+			options.useMpi = (std::stoul(value) != 0);
+		}
+		else if (option == "--out-of-core") {
+			options.outOfCorePath = value;
+		}
+		else if (option == "--chunk") {
+			options.chunkSize = std::stoul(value);
+		}
+		else {
+			throw std::runtime_error("Unknown option " + option);
+		}
+	}
+	return options;
+}
+
+// Reads a comma separated list of cores, where ranges like '0-7' are allowed.
+std::vector<int> parseCores(std::string value) {
+	std::vector<int> cores;
+	std::size_t start = 0;
+	while (start < value.size()) {
+		std::size_t end = value.find(',', start);
+		if (end == std::string::npos) {
+			end = value.size();
+		}
+		std::string item = value.substr(start, end - start);
+		std::size_t dash = item.find('-');
+		if (dash == std::string::npos) {
+			cores.push_back(std::stoi(item));
+		}
+		else {
+			int first = std::stoi(item.substr(0, dash));
+			int last = std::stoi(item.substr(dash + 1));
+			for (int core = first; core <= last; ++core) {
+				cores.push_back(core);
+			}
+		}
+		start = end + 1;
+	}
+	return cores;
+}
@@ -0,0 +1,158 @@
+#include "nbody/host/mapped_file.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace nbody::host;
+
+namespace {
+
+std::runtime_error systemError(std::string what, std::string path) {
+	return std::runtime_error(
+		what + " '" + path + "': " + std::strerror(errno));
+}
+
+// Expands a range of bytes to whole pages, as needed by madvise.
+void alignToPages(std::size_t& offset, std::size_t& length) {
+	std::size_t pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	std::size_t end = offset + length;
+	offset -= offset % pageSize;
+	length = end - offset;
+}
+
+}
+
+MappedFile::MappedFile(std::string path) :
+		_path(path),
+		_fd(-1),
+		_data(NULL),
+		_size(0) {
+	_fd = open(_path.c_str(), O_RDWR);
+	if (_fd < 0) {
+		throw systemError("Couldn't open", _path);
+	}
+	struct stat status;
+	if (fstat(_fd, &status) != 0) {
+		close(_fd);
+		throw systemError("Couldn't find the size of", _path);
+	}
+	_size = static_cast<std::size_t>(status.st_size);
+	map();
+}
+
+MappedFile::MappedFile(std::string path, std::size_t size) :
+		_path(path),
+		_fd(-1),
+		_data(NULL),
+		_size(size) {
+	_fd = open(_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (_fd < 0) {
+		throw systemError("Couldn't create", _path);
+	}
+	if (ftruncate(_fd, static_cast<off_t>(_size)) != 0) {
+		close(_fd);
+		throw systemError("Couldn't resize", _path);
+	}
+	map();
+}
+
+MappedFile::MappedFile(MappedFile&& other) :
+		_path(std::move(other._path)),
+		_fd(other._fd),
+		_data(other._data),
+		_size(other._size) {
+	other._fd = -1;
+	other._data = NULL;
+	other._size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+	if (this != &other) {
+		unmap();
+		_path = std::move(other._path);
+		_fd = other._fd;
+		_data = other._data;
+		_size = other._size;
+		other._fd = -1;
+		other._data = NULL;
+		other._size = 0;
+	}
+	return *this;
+}
+
+MappedFile::~MappedFile() {
+	unmap();
+}
+
+void MappedFile::map() {
+	// An empty file can't be mapped, but doesn't need to be.
+	if (_size == 0) {
+		return;
+	}
+	void* data = mmap(
+		NULL,
+		_size,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED,
+		_fd,
+		0);
+	if (data == MAP_FAILED) {
+		close(_fd);
+		_fd = -1;
+		throw systemError("Couldn't map", _path);
+	}
+	_data = static_cast<char*>(data);
+}
+
+void MappedFile::unmap() {
+	if (_data != NULL) {
+		munmap(_data, _size);
+		_data = NULL;
+	}
+	if (_fd >= 0) {
+		close(_fd);
+		_fd = -1;
+	}
+}
+
+void MappedFile::prefetch(std::size_t offset, std::size_t length) {
+	if (_data == NULL || length == 0) {
+		return;
+	}
+	alignToPages(offset, length);
+	// This is only a hint, so failures are ignored.
+	madvise(_data + offset, length, MADV_WILLNEED);
+}
+
+void MappedFile::release(std::size_t offset, std::size_t length) {
+	if (_data == NULL || length == 0) {
+		return;
+	}
+	alignToPages(offset, length);
+	// The pages are written back before being dropped, so that they can be
+	// reclaimed right away.
+	msync(_data + offset, length, MS_ASYNC);
+	madvise(_data + offset, length, MADV_DONTNEED);
+}
+
+void MappedFile::adviseSequential() {
+	if (_data != NULL) {
+		madvise(_data, _size, MADV_SEQUENTIAL);
+	}
+}
+
+void MappedFile::rename(std::string path) {
+	if (std::rename(_path.c_str(), path.c_str()) != 0) {
+		throw systemError("Couldn't rename", _path);
+	}
+	_path = path;
+}
+
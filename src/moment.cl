@@ -1,4 +1,5 @@
 #include "types.h"
+#include "multipole.h"
 
 // The first step in computing the moments of a set of particles. All child-less
 // nodes are identified, and the particles contained within them are used to
@@ -19,47 +20,70 @@ void kernel compute_moments_from_leafs(
 	if (!node.has_children) {
 		processed_node_indices[node_index] = node_index;
 		
-		scalar_t charge = 0.0;
-		vector_t dipole_moment = 0.0;
-		vector_t quadrupole_cross_terms = 0.0;
-		vector_t quadrupole_trace_terms = 0.0;
-		
 		vector_t center = node.position + node.dimensions / (scalar_t) 2;
 		
 		// Sum contributions from each of the particles contained within the
 		// node.
 		index_t leaf_start = node.leaf_index;
 		index_t leaf_end = node.leaf_index + node.leaf_count;
+		
+		// Find the center of the absolute charge first, and then the furthest
+		// leaf from it.
+		scalar_t absolute_charge = 0.0;
+		vector_t charge_center = 0.0;
+		for (
+				index_t leaf_index = leaf_start;
+				leaf_index < leaf_end;
+				++leaf_index) {
+			scalar_t q = fabs(leafs[leaf_index].value.moment.charge);
+			absolute_charge += q;
+			charge_center += q * leafs[leaf_index].position;
+		}
+		charge_center = absolute_charge != 0 ?
+			charge_center / absolute_charge :
+			center;
+		scalar_t radius = 0.0;
+		for (
+				index_t leaf_index = leaf_start;
+				leaf_index < leaf_end;
+				++leaf_index) {
+			radius = max(
+				radius,
+				distance(leafs[leaf_index].position, charge_center));
+		}
+		
+		node_moment_t moment = { 0 };
+#ifdef NBODY_MASS_CHANNEL
+		// The moments of the mass are found in the same way, and are expanded
+		// about the same center.
+		node_moment_t mass_moment = { 0 };
+#endif
 		for (
 				index_t leaf_index = leaf_start;
 				leaf_index < leaf_end;
 				++leaf_index) {
-			// Get the intrinsic moments of the leaf.
-			leaf_moment_t leaf_moment = leafs[leaf_index].value.moment;
-			vector_t r = leafs[leaf_index].position - center;
-			scalar_t q = leaf_moment.charge;
-			
 			// Compute the contribution of the leaf the moments of the node.
-			charge += q;
-			dipole_moment += q * r;
-			quadrupole_cross_terms += (scalar_t) 3 * q * (vector_t) (
-				r.y * r.z,
-				r.x * r.z,
-				r.x * r.y,
-				0);
-			quadrupole_trace_terms += q * (vector_t) (
-				(scalar_t) 2 * r.x * r.x - r.y * r.y - r.z * r.z,
-				(scalar_t) 2 * r.y * r.y - r.x * r.x - r.z * r.z,
-				(scalar_t) 2 * r.z * r.z - r.x * r.x - r.y * r.y,
-				0);
+			// The moments are taken about the center of charge.
+			vector_t r = leafs[leaf_index].position - charge_center;
+			moment = add_point_moment(
+				moment,
+				r,
+				leafs[leaf_index].value.moment.charge);
+#ifdef NBODY_MASS_CHANNEL
+			mass_moment = add_point_moment(
+				mass_moment,
+				r,
+				leafs[leaf_index].value.mass);
+#endif
 		}
+#ifdef NBODY_MASS_CHANNEL
+		moment = set_mass_channel(moment, mass_moment);
+#endif
 		
-		nodes[node_index].value.moment.charge = charge;
-		nodes[node_index].value.moment.dipole_moment = dipole_moment;
-		nodes[node_index].value.moment.quadrupole_cross_terms =
-			quadrupole_cross_terms;
-		nodes[node_index].value.moment.quadrupole_trace_terms =
-			quadrupole_trace_terms;
+		moment.center = charge_center;
+		moment.absolute_charge = absolute_charge;
+		moment.radius = radius;
+		nodes[node_index].value.moment = moment;
 	}
 	else {
 		processed_node_indices[node_index] = 0;
@@ -109,6 +133,7 @@ void kernel compute_moments_from_nodes(
 				++sibling_num) {
 			sibling_index += nodes[sibling_index].child_indices[8];
 			if (
+					processed_index + sibling_num >= num_processed_nodes ||
 					processed_node_indices[processed_index + sibling_num] !=
 					sibling_index) {
 				valid_node = false;
@@ -125,6 +150,11 @@ void kernel compute_moments_from_nodes(
 			vector_t dipole_moment = 0.0;
 			vector_t quadrupole_cross_terms = 0.0;
 			vector_t quadrupole_trace_terms = 0.0;
+			scalar_t absolute_charge = 0.0;
+			vector_t charge_center = 0.0;
+#ifdef NBODY_MASS_CHANNEL
+			node_moment_t mass_moment = { 0 };
+#endif
 			
 			for (index_t sibling_num = 0; sibling_num < 8; ++sibling_num) {
 				index_t sibling_index =
@@ -132,22 +162,77 @@ void kernel compute_moments_from_nodes(
 				node_moment_t node_moment = nodes[sibling_index].value.moment;
 				
 				charge += node_moment.charge;
-				dipole_moment += node_moment.dipole_moment;
-				quadrupole_cross_terms += node_moment.quadrupole_cross_terms;
-				quadrupole_trace_terms += node_moment.quadrupole_trace_terms;
+#ifdef NBODY_MASS_CHANNEL
+				mass_moment.charge += node_moment.mass;
+#endif
+				absolute_charge += node_moment.absolute_charge;
+				charge_center +=
+					node_moment.absolute_charge * node_moment.center;
 				
 				// Remove child from the processed nodes.
 				new_processed_node_indices[processed_index + sibling_num] = 0;
 			}
 			
-			// Set parent's moments.
+			// The moments of the children are shifted to the center of the
+			// parent before being added together. The parent's radius is
+			// bounded both by the spheres of its children and by its own
+			// corners.
 			index_t parent_index = node_index + node.parent_index;
+			node_t parent = nodes[parent_index];
+			vector_t parent_center =
+				parent.position + parent.dimensions / (scalar_t) 2;
+			charge_center = absolute_charge != 0 ?
+				charge_center / absolute_charge :
+				parent_center;
+			vector_t corner_offset = max(
+				charge_center - parent.position,
+				parent.position + parent.dimensions - charge_center);
+			scalar_t radius = 0.0;
+			for (index_t sibling_num = 0; sibling_num < 8; ++sibling_num) {
+				index_t sibling_index =
+					processed_node_indices[processed_index + sibling_num];
+				if (nodes[sibling_index].leaf_count != 0) {
+					node_moment_t node_moment = shift_moment(
+						nodes[sibling_index].value.moment,
+						nodes[sibling_index].value.moment.center -
+							charge_center);
+					dipole_moment += node_moment.dipole_moment;
+					quadrupole_cross_terms += node_moment.quadrupole_cross_terms;
+					quadrupole_trace_terms += node_moment.quadrupole_trace_terms;
+#ifdef NBODY_MASS_CHANNEL
+					node_moment_t shifted_mass = shift_moment(
+						swap_channels(nodes[sibling_index].value.moment),
+						nodes[sibling_index].value.moment.center -
+							charge_center);
+					mass_moment.dipole_moment += shifted_mass.dipole_moment;
+					mass_moment.quadrupole_cross_terms +=
+						shifted_mass.quadrupole_cross_terms;
+					mass_moment.quadrupole_trace_terms +=
+						shifted_mass.quadrupole_trace_terms;
+#endif
+					radius = max(
+						radius,
+						distance(node_moment.center, charge_center) +
+							node_moment.radius);
+				}
+			}
+			radius = min(radius, length(corner_offset));
+			
+			// Set parent's moments.
 			nodes[parent_index].value.moment.charge = charge;
 			nodes[parent_index].value.moment.dipole_moment = dipole_moment;
 			nodes[parent_index].value.moment.quadrupole_cross_terms =
 				quadrupole_cross_terms;
 			nodes[parent_index].value.moment.quadrupole_trace_terms =
 				quadrupole_trace_terms;
+			nodes[parent_index].value.moment.center = charge_center;
+			nodes[parent_index].value.moment.absolute_charge = absolute_charge;
+			nodes[parent_index].value.moment.radius = radius;
+#ifdef NBODY_MASS_CHANNEL
+			nodes[parent_index].value.moment = set_mass_channel(
+				nodes[parent_index].value.moment,
+				mass_moment);
+#endif
 			
 			// Add parent to the processed nodes.
 			new_processed_node_indices[processed_index] = parent_index;
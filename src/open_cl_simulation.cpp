@@ -1,53 +1,119 @@
 #include "nbody/open_cl_simulation.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <ctime>
 #include <fstream>
+#include <future>
+#include <iomanip>
 #include <iterator>
+#include <limits>
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
+#include "nbody/device/constants.h"
+#include "nbody/host/allocation_counter.h"
+#include "nbody/host/ewald.h"
+
+// When the root of the octree is fit to the particles, it is made larger than
+// the particles by this fraction, so that it doesn't need to be moved again
+// right away.
+#define ROOT_BOUNDS_MARGIN (0.25f)
+// The root is shrunk when the particles fill less than this fraction of it.
+#define ROOT_BOUNDS_MIN_FILL (0.5f)
+// Batches of interactions are planned to use at most this fraction of the
+// global memory of a device, leaving the rest for the driver.
+#define DEVICE_MEMORY_BUDGET (0.875)
+
 using namespace nbody;
 
 OpenClSimulation::OpenClSimulation(
 		device::vector_t bounds,
-		std::vector<Particle> particles,
+		std::vector<Particle> const& particles,
 		Scalar timeStep,
-		std::ostream& log) :
-		_octree(device::vector_t(), bounds),
-		_time(0.0),
-		_timeStep(timeStep),
-		_log(log) {
-	// Fill vectors with all of the leaf data.
-	std::vector<device::leaf_value_t> leafValues;
-	std::vector<device::vector_t> leafPositions;
-	leafValues.reserve(particles.size());
-	leafPositions.reserve(particles.size());
-	for (std::size_t index = 0; index < particles.size(); ++index) {
-		Particle particle = particles[index];
-		device::leaf_value_t leafValue = {
-			particle.velocity,
-			particle.mass,
-			particle.charge
-		};
-		leafValues.push_back(leafValue);
-		leafPositions.push_back(particle.position);
+		std::ostream& log,
+		DeviceSelection deviceSelection,
+		SolverSettings solverSettings) :
+		OpenClSimulation(
+			bounds,
+			particles.begin(),
+			particles.end(),
+			timeStep,
+			log,
+			deviceSelection,
+			solverSettings) {
+}
+
+void OpenClSimulation::initializeSolver() {
+	// Split the long range forces off onto a mesh covering the bounds.
+	if (_solverSettings.meshSize != 0) {
+		if (_solverSettings.periodic) {
+			throw std::runtime_error(
+				"The particle-mesh can't be used in a periodic box");
+		}
+		if (_solverSettings.splitRadius == 0) {
+			device::scalar_t cellSize = std::max({
+				_bounds[0], _bounds[1], _bounds[2]
+			}) / _solverSettings.meshSize;
+			_solverSettings.splitRadius = 1.25f * cellSize;
+		}
+		_particleMesh.reset(new host::ParticleMesh(
+			_solverSettings.meshSize,
+			device::vector_t(),
+			_bounds,
+			_solverSettings.splitRadius));
 	}
 	
-	// It's most efficient to add every particle at once.
-	// FIXME: The node capacity is arbitrarily set at 8. Should be
-	// adjustable by the user of this class.
-	_octree = Octree(
-		device::vector_t(), bounds,
-		leafValues.begin(), leafValues.end(),
-		leafPositions.begin(), leafPositions.end(),
-		8);
+	if (
+			_solverSettings.operatorCache &&
+			(_solverSettings.meshSize != 0 || _solverSettings.periodic)) {
+		throw std::runtime_error(
+			"The operator cache can't be used with a particle-mesh or in a "
+			"periodic box");
+	}
 	
-	// Initialize OpenCL.
-	initialize();
+	// The compact leafs are stored relative to the cells of their nodes, so
+	// every particle has to be inside of the root. That's only guaranteed when
+	// the root follows the particles or the particles wrap around the box.
+	if (
+			_solverSettings.compactLeafs &&
+			!_solverSettings.periodic &&
+			!hasAutomaticBounds()) {
+		throw std::runtime_error(
+			"Compact leafs can only be used with automatic bounds or in a "
+			"periodic box");
+	}
+	
+#ifdef NBODY_MASS_CHANNEL
+	// Only the charges are deposited onto the mesh, and the cached operators
+	// only act on the moments of the charges.
+	if (_solverSettings.meshSize != 0 || _solverSettings.operatorCache) {
+		throw std::runtime_error(
+			"The particle-mesh and the operator cache can't be used with "
+			"NBODY_MASS_CHANNEL");
+	}
+#endif
+	
+	// The field from the periodic images only depends on the shape of the box,
+	// so it can be tabulated once.
+	if (_solverSettings.periodic) {
+		_log << "Computing Ewald table.\n";
+		_ewaldTable = host::computeEwaldTable(_bounds);
+	}
+}
+
+void OpenClSimulation::setParticles(std::vector<Particle> const& particles) {
+	buildOctree(particles.begin(), particles.end());
+}
+
+void OpenClSimulation::setExternalForces(ExternalForces externalForces) {
+	_externalForces = externalForces;
 }
 
 std::vector<OpenClSimulation::Particle> OpenClSimulation::particles() const {
@@ -69,52 +135,266 @@ std::vector<OpenClSimulation::Particle> OpenClSimulation::particles() const {
 
 OpenClSimulation::Scalar OpenClSimulation::step() {
 	_log << "Starting a new step (t=" << _time << ").\n";
-	
-	// Octree buffers.
+	std::chrono::steady_clock::time_point stepStart =
+		std::chrono::steady_clock::now();
+	// Once the workspace is large enough, nothing up to the update of the
+	// octree should allocate (with a single device, since several devices
+	// are driven from new threads).
+	std::size_t allocationsStart = host::allocationCount();
+	
+	// Octree buffers. Every device gets its own copy of the octree.
 	_log << "Computing moments.\n";
-	OctreeBuffers octreeBuffers = computeOctreeBuffers();
+	for (std::size_t index = 0; index < _devices.size(); ++index) {
+		computeOctreeBuffers(
+			_devices[index],
+			_workspace.devices[index].octreeBuffers);
+	}
+	
+	// The forces computed by each device are kept separate until the end of
+	// the step, when they are merged together.
+	std::size_t numLeafs = _octree.leafs().size();
+	for (DeviceWorkspace& workspace : _workspace.devices) {
+		workspace.forces.resize(numLeafs);
+		workspace.fixedForces.resize(
+			_solverSettings.reproducibleForces ? numLeafs : 0);
+		host::ThreadPool::global().parallelFor(
+			0, numLeafs,
+			[&](std::size_t leafIndex) {
+				workspace.forces[leafIndex] = device::vector_t();
+				if (_solverSettings.reproducibleForces) {
+					workspace.fixedForces[leafIndex] = device::fixed_force_t();
+				}
+			});
+	}
 	
 	// A set of interactions that still need to be processed (starting with just
 	// the root node interacting with itself).
-	UnprocessedInteractionBuffers unprocessedInteractions;
-	IntegrationBuffers integrationBuffers;
+	UnprocessedInteractionBuffers& unprocessedInteractions =
+		_workspace.unprocessed;
+	unprocessedInteractions.interactions.assign(1, {
+		INTERACTION_PACK(0, false),
+		INTERACTION_PACK(0, true)
+	});
+	// Try to find all of the interactions at once on the primary device. If
+	// that fails, they are found one level at a time below.
+	if (_solverSettings.persistentTraversal) {
+		_log << "Traversing octree.\n";
+		traverseInteractions(
+			_devices[0],
+			_workspace.devices[0].octreeBuffers,
+			_workspace.devices[0].queueBuffers,
+			unprocessedInteractions);
+	}
 	do {
-		// Interactions.
+		// Interactions are always found using the primary device.
 		_log << "Computing interactions.\n";
-		InteractionBuffers interactionBuffers = computeInteractionBuffers(
-			octreeBuffers,
+		reduceInteractions(
+			_devices[0],
+			_workspace.devices[0].octreeBuffers,
+			_workspace.devices[0].queueBuffers,
 			unprocessedInteractions);
+		
+		// Hand out a batch of the interactions to each of the devices.
+		for (std::size_t index = 0; index < _devices.size(); ++index) {
+			InteractionBatch& pending = unprocessedInteractions.pending[
+				_spatialPartitioning ? index : 0];
+			takeInteractionBatch(
+				_devices[index],
+				_workspace.devices[index],
+				pending);
+		}
+		
 		// Fields and forces.
 		_log << "Computing forces.\n";
-		ForceBuffers forceBuffers = computeForceBuffers(
-			octreeBuffers,
-			interactionBuffers);
-		// Integration.
-		_log << "Computing integration.\n";
-		integrationBuffers = computeIntegrationBuffers(
-			forceBuffers,
-			integrationBuffers);
+		if (_devices.size() == 1) {
+			computeBatchForces(_devices[0], _workspace.devices[0]);
+		}
+		else {
+			// Each device has its own context and queue, so the devices can be
+			// driven in parallel from separate threads.
+			std::vector<std::future<void> > results;
+			results.reserve(_devices.size());
+			for (std::size_t index = 0; index < _devices.size(); ++index) {
+				if (_workspace.devices[index].batch.empty()) {
+					continue;
+				}
+				results.push_back(std::async(
+					std::launch::async,
+					&OpenClSimulation::computeBatchForces,
+					this,
+					std::ref(_devices[index]),
+					std::ref(_workspace.devices[index])));
+			}
+			// Wait for every device to finish (rethrowing any errors).
+			for (std::future<void>& result : results) {
+				result.get();
+			}
+		}
 	}
 	while (!unprocessedInteractions.finished());
 	
+	// The lists of interactions aren't needed any more this step.
+	resetInteractionLists();
+	
+	// Merge the forces from every device (always in the same order).
+	std::vector<DeviceWorkspace>& workspaces = _workspace.devices;
+	HostVector<device::vector_t>& forces = workspaces[0].forces;
+	if (_solverSettings.reproducibleForces) {
+		host::ThreadPool::global().parallelFor(
+			0, numLeafs,
+			[&](std::size_t leafIndex) {
+				cl_long force[3] = { 0, 0, 0 };
+				for (DeviceWorkspace const& workspace : workspaces) {
+					for (unsigned int i = 0; i < 3; ++i) {
+						force[i] += workspace.fixedForces[leafIndex].force[i];
+					}
+				}
+				for (unsigned int i = 0; i < 3; ++i) {
+					forces[leafIndex][i] = static_cast<device::scalar_t>(
+						force[i] / static_cast<double>(FORCE_FIXED_POINT_SCALE));
+				}
+			});
+	}
+	else if (workspaces.size() > 1) {
+		host::ThreadPool::global().parallelFor(
+			0, numLeafs,
+			[&](std::size_t leafIndex) {
+				for (
+						std::size_t index = 1;
+						index < workspaces.size();
+						++index) {
+					device::vector_t const& deviceForce =
+						workspaces[index].forces[leafIndex];
+					for (unsigned int i = 0; i < 3; ++i) {
+						forces[leafIndex][i] += deviceForce[i];
+					}
+				}
+			});
+	}
+	
+	// Add the long range forces from the particle-mesh.
+	if (_particleMesh) {
+		_log << "Computing long range forces.\n";
+		_particleMesh->addForces(
+			reinterpret_cast<device::leaf_t const*>(_octree.leafs().data()),
+			numLeafs,
+			forces.data());
+	}
+	
+	// Add any forces from outside of the simulation. They belong to someone
+	// else, so their allocations aren't counted against the step.
+	std::size_t externalAllocations = 0;
+	if (_externalForces) {
+		_log << "Computing external forces.\n";
+		std::size_t externalStart = host::allocationCount();
+		_externalForces(
+			reinterpret_cast<device::leaf_t const*>(_octree.leafs().data()),
+			numLeafs,
+			forces.data());
+		externalAllocations = host::allocationCount() - externalStart;
+	}
+	
+	// Integration.
+	_log << "Computing integration.\n";
+	IntegrationBuffers& integrationBuffers = _workspace.integrationBuffers;
+	computeIntegrationBuffers(forces, integrationBuffers);
+	
+	if (host::countsAllocations) {
+		_stepAllocations =
+			host::allocationCount() - allocationsStart - externalAllocations;
+		_log << "Step made " << _stepAllocations << " host allocations.\n";
+	}
+	
+	// The octree is rebuilt instead of updated if the root has to move.
 	_log << "Updating octree.\n";
-	updateOctree(integrationBuffers);
+	bool fitRoot = false;
+	if (hasAutomaticBounds()) {
+		BoundingBox box = computeBoundingBox(
+			integrationBuffers.newPositions.size(),
+			[&](std::size_t index) {
+				return integrationBuffers.newPositions[index];
+			});
+		fitRoot = shouldFitBounds(box);
+		if (fitRoot) {
+			fitBounds(box);
+		}
+	}
+	if (fitRoot) {
+		rebuildOctree(integrationBuffers);
+	}
+	else {
+		updateOctree(integrationBuffers);
+	}
 	
 	_time += _timeStep;
-	_log << "Step finished.\n";
+	std::chrono::duration<double, std::milli> stepDuration =
+		std::chrono::steady_clock::now() - stepStart;
+	_log << "Step finished in " << stepDuration.count() << " ms.\n";
 	return _time;
 }
 
-void OpenClSimulation::updateOctree(IntegrationBuffers integrationBuffers) {
+void OpenClSimulation::resetInteractionLists() {
+	// The lists are emptied before the arena is reset, and are only given
+	// their new space from the arena afterwards.
+	host::Arena& arena = _workspace.interactionArena;
+	auto forEachList = [&](auto function) {
+		function(_workspace.unprocessed.interactions);
+		function(_workspace.newLeafInteractions);
+		function(_workspace.newNodeInteractions);
+		auto forEachBatchList = [&](InteractionBatch& batch) {
+			function(batch.leafInteractions);
+			function(batch.nodeInteractions);
+			function(batch.nodeOperators);
+		};
+		for (InteractionBatch& pending : _workspace.unprocessed.pending) {
+			forEachBatchList(pending);
+		}
+		for (DeviceWorkspace& workspace : _workspace.devices) {
+			forEachBatchList(workspace.batch);
+		}
+	};
+	forEachList([](auto& list) {
+		list.clear();
+	});
+	arena.reset();
+	forEachList([&](auto& list) {
+		using List = typename std::decay<decltype(list)>::type;
+		std::size_t capacity = list.capacity();
+		list = List(typename List::allocator_type(&arena));
+		list.reserve(capacity);
+	});
+}
+
+void OpenClSimulation::computeBatchForces(
+		DeviceData& device,
+		DeviceWorkspace& workspace) {
+	computeInteractionBuffers(
+		device,
+		workspace.octreeBuffers,
+		workspace.batch,
+		workspace.interactionBuffers);
+	computeForceBuffers(
+		device,
+		workspace.octreeBuffers,
+		workspace.interactionBuffers,
+		workspace.forceBuffers);
+	accumulateForces(
+		workspace.forceBuffers,
+		workspace.forces,
+		workspace.fixedForces);
+}
+
+void OpenClSimulation::updateOctree(
+		IntegrationBuffers const& integrationBuffers) {
 	// Update the leaf velocities.
-	for (
-			Octree::LeafListSizeType leafIndex = 0;
-			leafIndex < _octree.leafs().size();
-			++leafIndex) {
-		Octree::LeafIterator leafIt = _octree.leafs().begin() + leafIndex;
-		device::vector_t velocity = integrationBuffers.newVelocities[leafIndex];
-		leafIt->value.velocity = velocity;
-	}
+	host::ThreadPool::global().parallelFor(
+		0, _octree.leafs().size(),
+		[&](std::size_t leafIndex) {
+			Octree::LeafIterator leafIt = _octree.leafs().begin() + leafIndex;
+			device::vector_t velocity =
+				integrationBuffers.newVelocities[leafIndex];
+			leafIt->value.velocity = velocity;
+		});
 	
 	// Move all of the leafs to their new positions.
 	_octree.move(
@@ -123,255 +403,930 @@ void OpenClSimulation::updateOctree(IntegrationBuffers integrationBuffers) {
 		integrationBuffers.newPositions.end());
 }
 
-OpenClSimulation::OctreeBuffers OpenClSimulation::computeOctreeBuffers() {
-	// First, create buffers to hold the leafs and the nodes.
-	device::BufferWrapper<device::leaf_t> leafs = createBuffer(
-		device::IOFlag::Read,
+bool OpenClSimulation::hasAutomaticBounds() const {
+	return
+		_solverSettings.automaticBounds &&
+		!_solverSettings.periodic &&
+		!_particleMesh;
+}
+
+bool OpenClSimulation::shouldFitBounds(BoundingBox box) const {
+	device::scalar_t extent = 0;
+	device::scalar_t side = 0;
+	for (unsigned int i = 0; i < 3; ++i) {
+		// Particles outside of the root would end up at the bottom of long
+		// chains of nodes along its edges.
+		if (box.min[i] < _origin[i] || box.max[i] >= _origin[i] + _bounds[i]) {
+			return true;
+		}
+		extent = std::max(extent, box.max[i] - box.min[i]);
+		side = std::max(side, _bounds[i]);
+	}
+	// A root much larger than the particles wastes the top levels of the
+	// octree. Don't bother when the new root wouldn't be much smaller.
+	device::scalar_t newSide = std::max(
+		(1 + ROOT_BOUNDS_MARGIN) * extent,
+		PARTICLE_RADIUS);
+	return newSide < ROOT_BOUNDS_MIN_FILL * side;
+}
+
+void OpenClSimulation::fitBounds(BoundingBox box) {
+	// The node approximations assume that every node is a cube, so the root is
+	// made into a cube centered on the box.
+	device::scalar_t extent = 0;
+	for (unsigned int i = 0; i < 3; ++i) {
+		extent = std::max(extent, box.max[i] - box.min[i]);
+	}
+	device::scalar_t side = std::max(
+		(1 + ROOT_BOUNDS_MARGIN) * extent,
+		PARTICLE_RADIUS);
+	for (unsigned int i = 0; i < 3; ++i) {
+		_origin[i] = (box.min[i] + box.max[i]) / 2 - side / 2;
+		_bounds[i] = side;
+	}
+	// The operators depend on the size of the nodes at each depth.
+	_operatorCache.clear();
+	_log << "Moving octree root to (" <<
+		_origin[0] << ", " << _origin[1] << ", " << _origin[2] <<
+		") with side " << side << ".\n";
+}
+
+void OpenClSimulation::rebuildOctree(
+		IntegrationBuffers const& integrationBuffers) {
+	// The new octree is built straight from the leafs of the old one and the
+	// integrated positions and velocities.
+	Octree::ConstLeafIterator leafs = _octree.cleafs().begin();
+	buildOctreeFromLeafs(
+		_octree.leafs().size(),
+		[&](std::size_t leafIndex) {
+			device::leaf_value_t leafValue = (leafs + leafIndex)->value;
+			leafValue.velocity = integrationBuffers.newVelocities[leafIndex];
+			return leafValue;
+		},
+		[&](std::size_t leafIndex) {
+			return integrationBuffers.newPositions[leafIndex];
+		});
+}
+
+void OpenClSimulation::computeOctreeBuffers(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers) {
+	// The top bit of the node indices in an interaction is taken by a flag.
+	if (_octree.nodes().size() > INTERACTION_FLAG_BIT) {
+		throw std::runtime_error(
+			"Too many nodes to be packed into interactions");
+	}
+	
+	// First, fill the buffers that hold the leafs and the nodes.
+	device::BufferWrapper<device::leaf_t>& leafs = octreeBuffers.leafs;
+	device::BufferWrapper<device::node_t>& nodes = octreeBuffers.nodes;
+	fitBuffer(
+		device,
+		leafs,
 		_octree.leafs().size(),
 		reinterpret_cast<device::leaf_t const*>(_octree.leafs().data()));
-	device::BufferWrapper<device::node_t> nodes = createBuffer(
-		device::IOFlag::ReadWrite,
+	fitBuffer(
+		device,
+		nodes,
 		_octree.nodes().size(),
 		reinterpret_cast<device::node_t const*>(_octree.nodes().data()));
-	// Create additional buffers to store the processed nodes and the updated
+	// The additional buffers store the processed nodes and the updated
 	// processed nodes.
-	device::BufferWrapper<device::index_t> processedNodes =
-		createBuffer<device::index_t>(
-			device::IOFlag::Read, _octree.nodes().size());
-	device::BufferWrapper<device::index_t> newProcessedNodes =
-		createBuffer<device::index_t>(
-			device::IOFlag::Write, _octree.nodes().size());
+	device::BufferWrapper<device::index_t>& processedNodes =
+		octreeBuffers.processedNodes;
+	device::BufferWrapper<device::index_t>& newProcessedNodes =
+		octreeBuffers.newProcessedNodes;
+	fitBuffer(device, processedNodes, _octree.nodes().size());
+	fitBuffer(device, newProcessedNodes, _octree.nodes().size());
 	
 	// Do the first pass: calculate the moments of the child-less nodes.
-	kernelComputeMomentsFromLeafs(leafs, nodes, newProcessedNodes);
+	kernelComputeMomentsFromLeafs(device, leafs, nodes, newProcessedNodes);
 	
 	// Now recursively move up the octree until all node moments have been
-	// computed.
-	Octree::LeafListSizeType numProcessedNodes = leafs.size();
+	// computed. The first pass leaves an entry for every node, and the root
+	// (index zero) drops out once its moments are done.
+	std::size_t numProcessedNodes = nodes.size();
 	while (numProcessedNodes != 0) {
 		// Remove zeros from the processed nodes and collapse the remaining
 		// entries to the front of the array.
 		device::index_t* processedNodesData = newProcessedNodes.map(
 			device::IOFlag::ReadWrite);
-		numProcessedNodes = 0;
-		for (device::index_t i = 0; i < numProcessedNodes; ++i) {
+		std::size_t numRemaining = 0;
+		for (std::size_t i = 0; i < newProcessedNodes.size(); ++i) {
 			if (processedNodesData[i] != 0) {
-				processedNodesData[numProcessedNodes] = processedNodesData[i];
-				++numProcessedNodes;
+				processedNodesData[numRemaining] = processedNodesData[i];
+				++numRemaining;
 			}
 		}
 		newProcessedNodes.unmap(processedNodesData);
-		// Move the result to the other buffer.
-		newProcessedNodes.resize(numProcessedNodes, false, true);
-		processedNodes.resize(numProcessedNodes, false, true);
+		numProcessedNodes = numRemaining;
+		if (numProcessedNodes == 0) {
+			break;
+		}
+		// Move the result to the other buffer. The buffers keep their space,
+		// since they only ever shrink here.
+		newProcessedNodes.resize(numProcessedNodes, true);
+		processedNodes.resize(numProcessedNodes, true);
 		processedNodes.copyFrom(newProcessedNodes);
 		
 		// Call the kernel to reduce any nodes.
-		kernelComputeMomentsFromNodes(nodes, processedNodes, newProcessedNodes);
+		kernelComputeMomentsFromNodes(
+			device,
+			nodes,
+			processedNodes,
+			newProcessedNodes);
 	}
 	
-	return { leafs, nodes };
+	// The leaf interactions read the compact copies of the leafs, which only
+	// change when the octree does.
+	if (_solverSettings.compactLeafs) {
+		fitBuffer(device, octreeBuffers.compactLeafs, leafs.size());
+		kernelComputeCompactLeafs(
+			device,
+			leafs,
+			nodes,
+			octreeBuffers.compactLeafs);
+	}
 }
 
-OpenClSimulation::InteractionBuffers OpenClSimulation::computeInteractionBuffers(
-		OctreeBuffers octreeBuffers,
+void OpenClSimulation::reduceInteractions(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		QueueBuffers& queueBuffers,
 		UnprocessedInteractionBuffers& unprocessed) {
 	// Determine how many of the unprocessed interactions will be processed
 	// during this step.
 	std::size_t maxProcessed =
-		_deviceMaxBufferSize / (8 * 8 * sizeof(device::interaction_t));
-	std::size_t numProcessed = std::min<std::size_t>(
-		unprocessed.interactions.size(),
-		maxProcessed);
-	device::interaction_t* processedData =
-		unprocessed.interactions.data() +
-		unprocessed.interactions.size() -
-		numProcessed;
-	
-	// Create buffers to hold the interactions.
-	device::BufferWrapper<device::interaction_t> interactions =
-		createBuffer<device::interaction_t>(
-			device::IOFlag::Read,
-			numProcessed,
-			processedData);
-	device::BufferWrapper<device::interaction_t> newInteractions =
-		createBuffer<device::interaction_t>(
-			device::IOFlag::Write,
-			8 * 8 * numProcessed);
-	
-	// Remove the interactions that will be processed from the unprocessed list.
-	unprocessed.interactions.resize(
-		unprocessed.interactions.size() - numProcessed);
-	// But reserve space for the new interactions that will be added later.
-	unprocessed.interactions.reserve(
-		unprocessed.interactions.size() + 64 * numProcessed);
-	
-	// Create buffers to hold the leaf and node interactions.
-	device::BufferWrapper<device::interaction_t> leafInteractions =
-		createBuffer<device::interaction_t>(device::IOFlag::Read, 0);
-	device::BufferWrapper<device::interaction_t> nodeInteractions =
-		createBuffer<device::interaction_t>(device::IOFlag::Read, 0);
-	// Create buffers to hold the node counts per interaction.
-	device::BufferWrapper<device::index_t> nodeNumLeafInteractions =
-		createBuffer<device::index_t>(
-			device::IOFlag::ReadWrite,
-			octreeBuffers.nodes.size());
-	device::BufferWrapper<device::index_t> nodeNumNodeInteractions =
-		createBuffer<device::index_t>(
-			device::IOFlag::ReadWrite,
-			octreeBuffers.nodes.size());
-	// Create a buffer to hold the max leaf count of a node's interactions.
-	device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount =
-		createBuffer<device::index_t>(
-			device::IOFlag::ReadWrite,
-			_octree.nodes().size());
-	
-	nodeNumLeafInteractions.zero();
-	nodeNumNodeInteractions.zero();
-	nodeMaxInteractionsLeafCount.zero();
-	
-	// So long as there is still an interaction to reduce, perform one more
-	// reduction step.
-	if (interactions.size() != 0) {
-		// Call the kernel to reduce the current set of interactions.
-		newInteractions.zero();
-		kernelFindInteractions(
-			octreeBuffers.nodes,
-			interactions,
-			newInteractions);
-		device::interaction_t* newInteractionsData =
-			newInteractions.map(device::IOFlag::Read);
+		device.maxBufferSize / (8 * 8 * sizeof(device::interaction_t));
+	
+	// The interactions left on the device by the last reduction are processed
+	// first. Otherwise, some are taken from the host.
+	device::BufferWrapper<device::interaction_t>& interactions =
+		queueBuffers.interactions;
+	if (unprocessed.residentInteractions.size() != 0) {
+		std::swap(interactions, unprocessed.residentInteractions);
+		unprocessed.residentInteractions.resize(0, true);
+	}
+	else {
+		std::size_t numProcessed = std::min<std::size_t>(
+			unprocessed.interactions.size(),
+			maxProcessed);
+		if (numProcessed == 0) {
+			return;
+		}
+		device::interaction_t* processedData =
+			unprocessed.interactions.data() +
+			unprocessed.interactions.size() -
+			numProcessed;
+		fitBuffer(device, interactions, numProcessed, processedData);
 		
-		// Loop through the new interactions and divide them into three sets:
-		// reducible, leaf, and node interactions.
-		for (
-				std::size_t index = 0;
-				index < newInteractions.size();
-				++index) {
-			device::interaction_t newInteraction = newInteractionsData[index];
-			if (
-					newInteraction.node_a_index == 0 &&
-					newInteraction.node_b_index == 0) {
-				// In this case, there is no interaction (placeholder value).
-			}
-			else if (newInteraction.can_reduce) {
-				unprocessed.interactions.push_back(newInteraction);
-			}
-			else if (!newInteraction.can_approx) {
-				unprocessed.leafInteractions.push_back(newInteraction);
-			}
-			else if (newInteraction.can_approx) {
-				unprocessed.nodeInteractions.push_back(newInteraction);
-			}
+		// Remove the interactions that will be processed from the unprocessed
+		// list.
+		unprocessed.interactions.resize(
+			unprocessed.interactions.size() - numProcessed);
+	}
+	std::size_t numProcessed = interactions.size();
+	
+	// Fill the queues that hold the new interactions. Every queue must have
+	// space for the case where all of the new interactions go into it.
+	device::BufferWrapper<device::interaction_t>& reducibleInteractions =
+		queueBuffers.reducibleInteractions;
+	device::BufferWrapper<device::interaction_t>& leafInteractions =
+		queueBuffers.leafInteractions;
+	device::BufferWrapper<device::interaction_t>& nodeInteractions =
+		queueBuffers.nodeInteractions;
+	device::BufferWrapper<device::index_t>& queueCounts =
+		queueBuffers.queueCounts;
+	fitBuffer(device, reducibleInteractions, 8 * 8 * numProcessed);
+	fitBuffer(device, leafInteractions, 8 * 8 * numProcessed);
+	fitBuffer(device, nodeInteractions, 8 * 8 * numProcessed);
+	fitBuffer(device, queueCounts, QUEUE_NUM_QUEUES);
+	
+	// Call the kernel to reduce the current set of interactions. The kernel
+	// sorts the new interactions into reducible, leaf, and node interactions,
+	// so only the number of each has to be read back.
+	queueCounts.zero();
+	kernelFindInteractions(
+		device,
+		octreeBuffers.nodes,
+		interactions,
+		reducibleInteractions,
+		leafInteractions,
+		nodeInteractions,
+		queueCounts);
+	device::index_t counts[QUEUE_NUM_QUEUES];
+	queueCounts.read(counts);
+	
+	// The reducible interactions stay on the device as the input to the next
+	// reduction, unless there are too many of them to process at once. The
+	// buffers are swapped rather than copied, and the old resident buffer
+	// becomes the next reducible queue.
+	reducibleInteractions.resize(counts[QUEUE_REDUCIBLE_INDEX], true);
+	if (reducibleInteractions.size() <= maxProcessed) {
+		std::swap(unprocessed.residentInteractions, reducibleInteractions);
+	}
+	else {
+		std::size_t oldSize = unprocessed.interactions.size();
+		unprocessed.interactions.resize(
+			oldSize + reducibleInteractions.size());
+		reducibleInteractions.read(unprocessed.interactions.data() + oldSize);
+	}
+	
+	leafInteractions.resize(counts[QUEUE_LEAF_INDEX], true);
+	nodeInteractions.resize(counts[QUEUE_NODE_INDEX], true);
+	readPendingInteractions(leafInteractions, nodeInteractions, unprocessed);
+}
+
+bool OpenClSimulation::traverseInteractions(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		QueueBuffers& queueBuffers,
+		UnprocessedInteractionBuffers& unprocessed) {
+	// The traversal always starts from the root, so it can only be used
+	// before any interactions have been reduced.
+	if (
+			unprocessed.interactions.size() != 1 ||
+			unprocessed.residentInteractions.size() != 0) {
+		return false;
+	}
+	std::size_t maxCapacity =
+		device.maxBufferSize / sizeof(device::interaction_t);
+	if (_traversalCapacity == 0) {
+		_traversalCapacity = 8 * 8 * octreeBuffers.nodes.size();
+	}
+	_traversalCapacity = std::min(_traversalCapacity, maxCapacity);
+	
+	// Fill the queues, with the root interaction on the work queue. The leaf
+	// and node queues are shared with the reduction.
+	device::BufferWrapper<device::interaction_t>& workQueue =
+		queueBuffers.workQueue;
+	device::BufferWrapper<device::index_t>& workQueueReady =
+		queueBuffers.workQueueReady;
+	device::BufferWrapper<device::interaction_t>& leafInteractions =
+		queueBuffers.leafInteractions;
+	device::BufferWrapper<device::interaction_t>& nodeInteractions =
+		queueBuffers.nodeInteractions;
+	device::BufferWrapper<device::index_t>& countersBuffer =
+		queueBuffers.traversalCounters;
+	fitBuffer(device, workQueue, _traversalCapacity);
+	fitBuffer(device, workQueueReady, _traversalCapacity);
+	fitBuffer(device, leafInteractions, _traversalCapacity);
+	fitBuffer(device, nodeInteractions, _traversalCapacity);
+	device::index_t counters[TRAVERSAL_NUM_COUNTERS] = { 0 };
+	counters[TRAVERSAL_TAIL_INDEX] = 1;
+	counters[TRAVERSAL_PENDING_INDEX] = 1;
+	fitBuffer(device, countersBuffer, TRAVERSAL_NUM_COUNTERS, counters);
+	workQueueReady.zero();
+	device::index_t rootReady = 1;
+	device.queue.enqueueWriteBuffer(
+		workQueue.buffer(),
+		CL_TRUE,
+		0,
+		sizeof(device::interaction_t),
+		unprocessed.interactions.data());
+	device.queue.enqueueWriteBuffer(
+		workQueueReady.buffer(),
+		CL_TRUE,
+		0,
+		sizeof(device::index_t),
+		&rootReady);
+	
+	kernelTraverseInteractions(
+		device,
+		octreeBuffers.nodes,
+		workQueue,
+		workQueueReady,
+		leafInteractions,
+		nodeInteractions,
+		countersBuffer);
+	countersBuffer.read(counters);
+	
+	// Give up if any of the queues ran out of space, making them larger for
+	// the next time.
+	if (counters[TRAVERSAL_OVERFLOW_INDEX] != 0) {
+		_log << "Traversal queues overflowed, finding interactions by level.\n";
+		_traversalCapacity = std::min(2 * _traversalCapacity, maxCapacity);
+		return false;
+	}
+	
+	unprocessed.interactions.clear();
+	leafInteractions.resize(counters[TRAVERSAL_LEAF_COUNT_INDEX], true);
+	nodeInteractions.resize(counters[TRAVERSAL_NODE_COUNT_INDEX], true);
+	readPendingInteractions(leafInteractions, nodeInteractions, unprocessed);
+	return true;
+}
+
+void OpenClSimulation::readPendingInteractions(
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		UnprocessedInteractionBuffers& unprocessed) {
+	// The leaf and node interactions are needed on the host to be split into
+	// batches for each device.
+	if (!_spatialPartitioning) {
+		InteractionBatch& pending = unprocessed.pending[0];
+		std::size_t oldLeafSize = pending.leafInteractions.size();
+		std::size_t oldNodeSize = pending.nodeInteractions.size();
+		pending.leafInteractions.resize(
+			oldLeafSize + leafInteractions.size());
+		pending.nodeInteractions.resize(
+			oldNodeSize + nodeInteractions.size());
+		leafInteractions.read(pending.leafInteractions.data() + oldLeafSize);
+		nodeInteractions.read(pending.nodeInteractions.data() + oldNodeSize);
+	}
+	else {
+		ArenaVector<device::interaction_t>& newLeafInteractions =
+			_workspace.newLeafInteractions;
+		ArenaVector<device::interaction_t>& newNodeInteractions =
+			_workspace.newNodeInteractions;
+		newLeafInteractions.resize(leafInteractions.size());
+		newNodeInteractions.resize(nodeInteractions.size());
+		leafInteractions.read(newLeafInteractions.data());
+		nodeInteractions.read(newNodeInteractions.data());
+		for (device::interaction_t newInteraction : newLeafInteractions) {
+			unprocessed.pending[interactionOwner(newInteraction)]
+				.leafInteractions.push_back(newInteraction);
+		}
+		for (device::interaction_t newInteraction : newNodeInteractions) {
+			unprocessed.pending[interactionOwner(newInteraction)]
+				.nodeInteractions.push_back(newInteraction);
+		}
+	}
+}
+
+std::size_t OpenClSimulation::interactionOwner(
+		device::interaction_t interaction) const {
+	// The leafs are stored in the order of the octree, so splitting them into
+	// equal contiguous ranges divides space into compact regions. An
+	// interaction belongs to the device that owns the region containing the
+	// first node.
+	device::node_t const* nodes =
+		reinterpret_cast<device::node_t const*>(_octree.nodes().data());
+	std::size_t leafIndex = nodes[INTERACTION_NODE_A(interaction)].leaf_index;
+	std::size_t numLeafs = std::max<std::size_t>(_octree.leafs().size(), 1);
+	return std::min(
+		leafIndex * _devices.size() / numLeafs,
+		_devices.size() - 1);
+}
+
+class OpenClSimulation::BatchMemoryPlan final {
+	
+private:
+	
+	OpenClSimulation const& _simulation;
+	DeviceData const& _device;
+	device::node_t const* _nodes;
+	
+	// Memory available for the buffers of a batch, after the octree buffers
+	// and the queues used to find the interactions.
+	cl_ulong _budget;
+	// Buffers whose sizes don't depend on the interactions in the batch.
+	cl_ulong _fixedSize;
+	cl_ulong _operatorsSize;
+	// The space that the buffers of the workspace already have. They keep it
+	// between batches, so each of them takes up the larger of its old space
+	// and the size that the batch needs.
+	cl_ulong _operatorsCapacity;
+	cl_ulong _leafInteractionsCapacity;
+	cl_ulong _nodeInteractionsCapacity;
+	cl_ulong _nodeOperatorsCapacity;
+	cl_ulong _endpointsCapacity;
+	cl_ulong _leafFieldsCapacity;
+	cl_ulong _nodeFieldsCapacity;
+	
+	std::size_t _numLeafInteractions;
+	std::size_t _numNodeInteractions;
+	// The number of leaf interactions of each node, and the largest leaf count
+	// of the nodes that it has leaf interactions with. Every leaf of a node
+	// gets one field for each leaf of the largest node, for each interaction.
+	std::vector<device::index_t>& _nodeNumLeafInteractions;
+	std::vector<device::index_t>& _nodeMaxInteractionsLeafCount;
+	cl_ulong _numLeafFields;
+	// Every node interaction gives a field to each leaf of both nodes.
+	cl_ulong _numNodeFields;
+	
+	cl_ulong leafFieldsSize(cl_ulong numLeafFields) const {
+		return numLeafFields * sizeof(device::leaf_field_t);
+	}
+	cl_ulong nodeFieldsSize(cl_ulong numNodeFields) const {
+		return numNodeFields * sizeof(device::node_field_t);
+	}
+	cl_ulong interactionsSize(std::size_t numInteractions) const {
+		return numInteractions * sizeof(device::interaction_t);
+	}
+	// Each interaction has a rank on both of its nodes.
+	cl_ulong ranksSize(std::size_t numInteractions) const {
+		return 2 * numInteractions * sizeof(device::index_t);
+	}
+	cl_ulong nodeOperatorsSize(std::size_t numNodeInteractions) const {
+		return _simulation._solverSettings.operatorCache ?
+			numNodeInteractions * (
+				sizeof(device::index_diff_t) +
+				2 * sizeof(device::vector_t)) :
+			0;
+	}
+	// The sort of the endpoints of the interactions is padded to a power of
+	// two. Only one set of interactions is sorted at a time.
+	cl_ulong endpointsSize(std::size_t numInteractions) const {
+		cl_ulong numEndpoints = 1;
+		while (numEndpoints < 2 * numInteractions) {
+			numEndpoints *= 2;
 		}
-		newInteractions.unmap(newInteractionsData);
+		return numEndpoints * sizeof(cl_ulong);
 	}
 	
-	// Determine how many leaf/node interactions can be calculated without
-	// running out of memory.
-	std::size_t numLeafInteractions = 0;
-	std::size_t numNodeInteractions = 0;
-	std::size_t leafInteractionsMemUsage = 0;
-	std::size_t nodeInteractionsMemUsage = 0;
-	
-	// It isn't too expensive (I think!) to measure the space needed directly.
-	// Regardless, this could easily be replaced by a heuristic.
-	
-	// FIXME: These expressions are not quite correct because of the effects of
-	// when some nodes have more leafs than their capacity. Hard to fix, so the
-	// leaf sizes are arbitrarily rescaled by a factor of two when calculating
-	// memory usage.
-	
-	// First calculate the leaf interactions space needed.
-	while (numLeafInteractions < unprocessed.leafInteractions.size()) {
-		device::interaction_t interaction = unprocessed.leafInteractions[
-			unprocessed.leafInteractions.size() -
-			numLeafInteractions - 1];
-		Octree::NodeIterator nodeA =
-			_octree.nodes().begin() + interaction.node_a_index;
-		Octree::NodeIterator nodeB =
-			_octree.nodes().begin() + interaction.node_b_index;
-		std::size_t nextMemUsage =
-			2 * (2 * nodeA->leafs.size()) * (2 * nodeB->leafs.size()) *
-			sizeof(device::leaf_field_t);
-		if (leafInteractionsMemUsage + nextMemUsage >= _deviceMaxBufferSize) {
-			break;
+	// Checks whether a batch with these sizes fits, both within the budget and
+	// within the largest allowed buffer. The fields can be split between
+	// several buffers, but must still be indexable by an index_t.
+	bool fits(
+			std::size_t numLeafInteractions,
+			std::size_t numNodeInteractions,
+			cl_ulong numLeafFields,
+			cl_ulong numNodeFields) const {
+		cl_ulong maxBufferSize = _device.maxBufferSize;
+		cl_ulong maxIndex = std::numeric_limits<device::index_t>::max();
+		if (
+				numLeafInteractions > maxIndex ||
+				numNodeInteractions > maxIndex ||
+				numLeafFields > maxIndex ||
+				numNodeFields > maxIndex) {
+			return false;
 		}
-		else {
-			leafInteractionsMemUsage += nextMemUsage;
-			++numLeafInteractions;
+		cl_ulong endpoints = std::max(
+			endpointsSize(numLeafInteractions),
+			endpointsSize(numNodeInteractions));
+		if (
+				interactionsSize(numLeafInteractions) > maxBufferSize ||
+				interactionsSize(numNodeInteractions) > maxBufferSize ||
+				ranksSize(numLeafInteractions) > maxBufferSize ||
+				ranksSize(numNodeInteractions) > maxBufferSize ||
+				endpoints > maxBufferSize ||
+				leafFieldsSize(numLeafFields) >
+					BUFFER_MAX_SEGMENTS * maxBufferSize ||
+				nodeFieldsSize(numNodeFields) >
+					BUFFER_MAX_SEGMENTS * maxBufferSize) {
+			return false;
 		}
+		// The endpoints and the fields are both kept in the workspace, so both
+		// are counted.
+		cl_ulong size =
+			_fixedSize +
+			std::max(_operatorsSize, _operatorsCapacity) +
+			std::max(
+				interactionsSize(numLeafInteractions) +
+					ranksSize(numLeafInteractions),
+				_leafInteractionsCapacity) +
+			std::max(
+				interactionsSize(numNodeInteractions) +
+					ranksSize(numNodeInteractions),
+				_nodeInteractionsCapacity) +
+			std::max(
+				nodeOperatorsSize(numNodeInteractions),
+				_nodeOperatorsCapacity) +
+			std::max(endpoints, _endpointsCapacity) +
+			std::max(leafFieldsSize(numLeafFields), _leafFieldsCapacity) +
+			std::max(nodeFieldsSize(numNodeFields), _nodeFieldsCapacity);
+		return size <= _budget;
 	}
 	
-	// Then calculate the node interactions space needed.
-	while (numNodeInteractions < unprocessed.nodeInteractions.size()) {
-		device::interaction_t interaction = unprocessed.nodeInteractions[
-			unprocessed.nodeInteractions.size() -
-			numNodeInteractions - 1];
-		Octree::NodeIterator nodeA =
-			_octree.nodes().begin() + interaction.node_a_index;
-		Octree::NodeIterator nodeB =
-			_octree.nodes().begin() + interaction.node_b_index;
-		std::size_t nextMemUsage =
-			(2 * nodeA->leafs.size() + 2 * nodeB->leafs.size()) *
-			sizeof(device::node_field_t);
-		if (nodeInteractionsMemUsage + nextMemUsage >= _deviceMaxBufferSize) {
-			break;
+	template<typename T>
+	static cl_ulong capacitySize(device::BufferWrapper<T> const& buffer) {
+		return buffer.capacity() * sizeof(T);
+	}
+	template<typename T>
+	static cl_ulong capacitySize(
+			device::SegmentedBufferWrapper<T> const& buffer) {
+		return buffer.capacity() * sizeof(T);
+	}
+	
+public:
+	
+	BatchMemoryPlan(
+			OpenClSimulation& simulation,
+			DeviceData const& device,
+			DeviceWorkspace const& workspace) :
+			_simulation(simulation),
+			_device(device),
+			_nodes(reinterpret_cast<device::node_t const*>(
+				simulation._octree.nodes().data())),
+			_numLeafInteractions(0),
+			_numNodeInteractions(0),
+			_nodeNumLeafInteractions(
+				simulation._workspace.planNodeNumLeafInteractions),
+			_nodeMaxInteractionsLeafCount(
+				simulation._workspace.planNodeMaxInteractionsLeafCount),
+			_numLeafFields(0),
+			_numNodeFields(0) {
+		std::size_t numLeafs = simulation._octree.leafs().size();
+		std::size_t numNodes = simulation._octree.nodes().size();
+		_nodeNumLeafInteractions.assign(numNodes, 0);
+		_nodeMaxInteractionsLeafCount.assign(numNodes, 0);
+		
+		// The octree, the nodes processed while computing the moments, and
+		// the queues used to find the interactions all stay on the device.
+		OctreeBuffers const& octreeBuffers = workspace.octreeBuffers;
+		QueueBuffers const& queueBuffers = workspace.queueBuffers;
+		cl_ulong resident =
+			numLeafs * sizeof(device::leaf_t) +
+			numNodes * sizeof(device::node_t) +
+			simulation._ewaldTable.size() * sizeof(device::vector_t) +
+			capacitySize(octreeBuffers.processedNodes) +
+			capacitySize(octreeBuffers.newProcessedNodes) +
+			capacitySize(octreeBuffers.compactLeafs) +
+			capacitySize(queueBuffers.interactions) +
+			capacitySize(queueBuffers.reducibleInteractions) +
+			capacitySize(queueBuffers.leafInteractions) +
+			capacitySize(queueBuffers.nodeInteractions) +
+			capacitySize(queueBuffers.workQueue) +
+			capacitySize(queueBuffers.workQueueReady) +
+			capacitySize(
+				simulation._workspace.unprocessed.residentInteractions);
+		cl_ulong available = static_cast<cl_ulong>(
+			DEVICE_MEMORY_BUDGET * device.globalMemSize);
+		_budget = available > resident ? available - resident : 0;
+		
+		// The counts of interactions for each node (three of them, plus the
+		// ancestor interactions and the starts of the sorted endpoints), the
+		// field indices of each leaf, and the forces on each leaf.
+		std::size_t forceSize = simulation._solverSettings.reproducibleForces ?
+			sizeof(device::fixed_force_t) :
+			sizeof(device::force_t);
+		_fixedSize =
+			5 * numNodes * sizeof(device::index_t) +
+			2 * (numLeafs + 1) * sizeof(device::index_t) +
+			2 * numLeafs * forceSize;
+		_operatorsSize = 0;
+		
+		InteractionBuffers const& interactionBuffers =
+			workspace.interactionBuffers;
+		ForceBuffers const& forceBuffers = workspace.forceBuffers;
+		_operatorsCapacity = capacitySize(interactionBuffers.operators);
+		_leafInteractionsCapacity =
+			capacitySize(interactionBuffers.leafInteractions) +
+			capacitySize(interactionBuffers.leafInteractionRanks);
+		_nodeInteractionsCapacity =
+			capacitySize(interactionBuffers.nodeInteractions) +
+			capacitySize(interactionBuffers.nodeInteractionRanks);
+		_nodeOperatorsCapacity =
+			capacitySize(interactionBuffers.nodeInteractionOperators) +
+			capacitySize(forceBuffers.interactionFields);
+		_endpointsCapacity = capacitySize(interactionBuffers.endpoints);
+		_leafFieldsCapacity = capacitySize(forceBuffers.leafFields);
+		_nodeFieldsCapacity = capacitySize(forceBuffers.nodeFields);
+	}
+	
+	// Adds a leaf interaction to the batch if it fits.
+	bool addLeafInteraction(device::interaction_t interaction) {
+		device::index_t nodeA = INTERACTION_NODE_A(interaction);
+		device::index_t nodeB = INTERACTION_NODE_B(interaction);
+		cl_ulong numLeafFields = _numLeafFields;
+		
+		// Remove the old fields of both nodes, update the counts, and then add
+		// back the new fields.
+		auto nodeFields = [&](device::index_t node) {
+			return
+				static_cast<cl_ulong>(_nodes[node].leaf_count) *
+				_nodeNumLeafInteractions[node] *
+				_nodeMaxInteractionsLeafCount[node];
+		};
+		numLeafFields -= nodeFields(nodeA);
+		if (nodeB != nodeA) {
+			numLeafFields -= nodeFields(nodeB);
 		}
-		else {
-			nodeInteractionsMemUsage += nextMemUsage;
+		device::index_t oldNumA = _nodeNumLeafInteractions[nodeA];
+		device::index_t oldNumB = _nodeNumLeafInteractions[nodeB];
+		device::index_t oldMaxA = _nodeMaxInteractionsLeafCount[nodeA];
+		device::index_t oldMaxB = _nodeMaxInteractionsLeafCount[nodeB];
+		_nodeNumLeafInteractions[nodeA] += 1;
+		_nodeNumLeafInteractions[nodeB] += 1;
+		_nodeMaxInteractionsLeafCount[nodeA] = std::max(
+			oldMaxA,
+			_nodes[nodeB].leaf_count);
+		_nodeMaxInteractionsLeafCount[nodeB] = std::max(
+			_nodeMaxInteractionsLeafCount[nodeB],
+			_nodes[nodeA].leaf_count);
+		numLeafFields += nodeFields(nodeA);
+		if (nodeB != nodeA) {
+			numLeafFields += nodeFields(nodeB);
+		}
+		
+		if (!fits(
+				_numLeafInteractions + 1,
+				_numNodeInteractions,
+				numLeafFields,
+				_numNodeFields)) {
+			_nodeNumLeafInteractions[nodeA] = oldNumA;
+			_nodeNumLeafInteractions[nodeB] = oldNumB;
+			_nodeMaxInteractionsLeafCount[nodeA] = oldMaxA;
+			_nodeMaxInteractionsLeafCount[nodeB] = oldMaxB;
+			return false;
+		}
+		_numLeafFields = numLeafFields;
+		++_numLeafInteractions;
+		return true;
+	}
+	
+	// Adds a node interaction to the batch if it fits.
+	bool addNodeInteraction(device::interaction_t interaction) {
+		cl_ulong numNodeFields =
+			_numNodeFields +
+			_nodes[INTERACTION_NODE_A(interaction)].leaf_count +
+			_nodes[INTERACTION_NODE_B(interaction)].leaf_count;
+		if (!fits(
+				_numLeafInteractions,
+				_numNodeInteractions + 1,
+				_numLeafFields,
+				numNodeFields)) {
+			return false;
+		}
+		_numNodeFields = numNodeFields;
+		++_numNodeInteractions;
+		return true;
+	}
+	
+	// Sets the number of columns of cached operators that are uploaded with
+	// the batch.
+	void setNumOperatorColumns(std::size_t numColumns) {
+		_operatorsSize = numColumns * sizeof(device::vector_t);
+	}
+	
+};
+
+void OpenClSimulation::takeInteractionBatch(
+		DeviceData const& device,
+		DeviceWorkspace& workspace,
+		InteractionBatch& pending) {
+	// Determine how many leaf/node interactions can be calculated without
+	// running out of memory, from the exact sizes of the buffers that they
+	// will need.
+	device::node_t const* nodes =
+		reinterpret_cast<device::node_t const*>(_octree.nodes().data());
+	std::vector<device::index_diff_t>& nodeOperators = _workspace.nodeOperators;
+	std::size_t numLeafInteractions = 0;
+	std::size_t numNodeInteractions = 0;
+	for (unsigned int attempt = 0; attempt < 2; ++attempt) {
+		BatchMemoryPlan plan(*this, device, workspace);
+		plan.setNumOperatorColumns(_operatorCache.operators().size());
+		numLeafInteractions = 0;
+		numNodeInteractions = 0;
+		nodeOperators.clear();
+		
+		// First add the leaf interactions.
+		while (
+				numLeafInteractions < pending.leafInteractions.size() &&
+				plan.addLeafInteraction(pending.leafInteractions[
+					pending.leafInteractions.size() -
+					numLeafInteractions - 1])) {
+			++numLeafInteractions;
+		}
+		
+		// Then add the node interactions. With the operator cache, the
+		// operator of each node interaction is looked up as it is added, since
+		// new operators take up space as well.
+		while (numNodeInteractions < pending.nodeInteractions.size()) {
+			device::interaction_t interaction = pending.nodeInteractions[
+				pending.nodeInteractions.size() -
+				numNodeInteractions - 1];
+			device::index_diff_t nodeOperator = 0;
+			if (_solverSettings.operatorCache) {
+				nodeOperator = _operatorCache.find(
+					nodes[INTERACTION_NODE_A(interaction)],
+					nodes[INTERACTION_NODE_B(interaction)]);
+				plan.setNumOperatorColumns(_operatorCache.operators().size());
+			}
+			if (!plan.addNodeInteraction(interaction)) {
+				break;
+			}
+			nodeOperators.push_back(nodeOperator);
 			++numNodeInteractions;
 		}
+		
+		// The space kept by the workspace from earlier batches counts against
+		// the budget. If not even one interaction fits next to it, then it is
+		// given up and the batch is planned again.
+		if (
+				numLeafInteractions != 0 ||
+				numNodeInteractions != 0 ||
+				pending.empty()) {
+			break;
+		}
+		releaseBatchBuffers(workspace);
 	}
 	
-	// Transfer the maximum interactions that can be processed to some buffers.
-	leafInteractions.resize(numLeafInteractions);
-	nodeInteractions.resize(numNodeInteractions);
-	leafInteractions.write(
-		unprocessed.leafInteractions.data() +
-		unprocessed.leafInteractions.size() -
-		numLeafInteractions);
-	nodeInteractions.write(
-		unprocessed.nodeInteractions.data() +
-		unprocessed.nodeInteractions.size() -
-		numNodeInteractions);
-	unprocessed.leafInteractions.resize(
-		unprocessed.leafInteractions.size() -
+	if (
+			numLeafInteractions == 0 &&
+			numNodeInteractions == 0 &&
+			!pending.empty()) {
+		throw std::runtime_error(
+			"Not enough device memory for a single interaction");
+	}
+	
+	// Move the interactions out of the pending lists.
+	InteractionBatch& batch = workspace.batch;
+	batch.clear();
+	batch.leafInteractions.assign(
+		pending.leafInteractions.end() - numLeafInteractions,
+		pending.leafInteractions.end());
+	batch.nodeInteractions.assign(
+		pending.nodeInteractions.end() - numNodeInteractions,
+		pending.nodeInteractions.end());
+	pending.leafInteractions.resize(
+		pending.leafInteractions.size() -
 		numLeafInteractions);
-	unprocessed.nodeInteractions.resize(
-		unprocessed.nodeInteractions.size() -
+	pending.nodeInteractions.resize(
+		pending.nodeInteractions.size() -
 		numNodeInteractions);
 	
+	// Sort the node interactions so that the ones sharing an operator are next
+	// to each other. The operators were found starting from the end.
+	if (_solverSettings.operatorCache) {
+		std::vector<std::pair<device::index_diff_t, device::interaction_t> >&
+			operatorInteractions = _workspace.operatorInteractions;
+		operatorInteractions.clear();
+		for (std::size_t index = 0; index < numNodeInteractions; ++index) {
+			operatorInteractions.push_back({
+				nodeOperators[numNodeInteractions - index - 1],
+				batch.nodeInteractions[index]
+			});
+		}
+		std::stable_sort(
+			operatorInteractions.begin(),
+			operatorInteractions.end(),
+			[](
+					std::pair<device::index_diff_t, device::interaction_t> a,
+					std::pair<device::index_diff_t, device::interaction_t> b) {
+				return std::abs(a.first) < std::abs(b.first);
+			});
+		for (std::size_t index = 0; index < operatorInteractions.size(); ++index) {
+			batch.nodeOperators.push_back(operatorInteractions[index].first);
+			batch.nodeInteractions[index] = operatorInteractions[index].second;
+		}
+	}
+}
+
+void OpenClSimulation::releaseBatchBuffers(DeviceWorkspace& workspace) {
+	InteractionBuffers& interactionBuffers = workspace.interactionBuffers;
+	ForceBuffers& forceBuffers = workspace.forceBuffers;
+	interactionBuffers.leafInteractions =
+		device::BufferWrapper<device::interaction_t>(device::IOFlag::Read);
+	interactionBuffers.nodeInteractions =
+		device::BufferWrapper<device::interaction_t>(device::IOFlag::Read);
+	interactionBuffers.leafInteractionRanks =
+		device::BufferWrapper<device::index_t>(device::IOFlag::ReadWrite);
+	interactionBuffers.nodeInteractionRanks =
+		device::BufferWrapper<device::index_t>(device::IOFlag::ReadWrite);
+	interactionBuffers.nodeInteractionOperators =
+		device::BufferWrapper<device::index_diff_t>(device::IOFlag::Read);
+	interactionBuffers.operators =
+		device::BufferWrapper<device::vector_t>(device::IOFlag::Read);
+	interactionBuffers.endpoints =
+		device::BufferWrapper<cl_ulong>(device::IOFlag::ReadWrite);
+	forceBuffers.leafFields =
+		device::SegmentedBufferWrapper<device::leaf_field_t>();
+	forceBuffers.nodeFields =
+		device::SegmentedBufferWrapper<device::node_field_t>();
+	forceBuffers.interactionFields =
+		device::BufferWrapper<device::vector_t>(device::IOFlag::ReadWrite);
+}
+
+void OpenClSimulation::computeInteractionBuffers(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		InteractionBatch const& batch,
+		InteractionBuffers& interactionBuffers) {
+	// Fill the buffers that hold the leaf and node interactions. The device
+	// finds the index of each interaction within the interactions of its
+	// nodes, and keeps them in separate buffers.
+	fitBuffer(
+		device,
+		interactionBuffers.leafInteractions,
+		batch.leafInteractions.size(),
+		batch.leafInteractions.data());
+	fitBuffer(
+		device,
+		interactionBuffers.nodeInteractions,
+		batch.nodeInteractions.size(),
+		batch.nodeInteractions.data());
+	// Fill the buffers that hold the cached operators of the node
+	// interactions.
+	fitBuffer(
+		device,
+		interactionBuffers.nodeInteractionOperators,
+		batch.nodeOperators.size(),
+		batch.nodeOperators.data());
+	fitBuffer(
+		device,
+		interactionBuffers.operators,
+		_operatorCache.operators().size(),
+		_operatorCache.operators().data());
+	// The node counts per interaction, and the max leaf count of a node's
+	// interactions.
+	fitBuffer(
+		device,
+		interactionBuffers.nodeNumLeafInteractions,
+		octreeBuffers.nodes.size());
+	fitBuffer(
+		device,
+		interactionBuffers.nodeNumNodeInteractions,
+		octreeBuffers.nodes.size());
+	fitBuffer(
+		device,
+		interactionBuffers.nodeMaxInteractionsLeafCount,
+		octreeBuffers.nodes.size());
+	
+	interactionBuffers.nodeNumLeafInteractions.zero();
+	interactionBuffers.nodeNumNodeInteractions.zero();
+	interactionBuffers.nodeMaxInteractionsLeafCount.zero();
+	
 	// Compute the interaction indices separately for leaf and node
 	// interactions.
-	kernelComputeInteractionIndices(
-		octreeBuffers.nodes,
-		leafInteractions,
-		nodeNumLeafInteractions);
-	kernelComputeInteractionIndices(
-		octreeBuffers.nodes,
-		nodeInteractions,
-		nodeNumNodeInteractions);
+	computeInteractionIndices(
+		device,
+		octreeBuffers,
+		interactionBuffers,
+		interactionBuffers.leafInteractions,
+		interactionBuffers.leafInteractionRanks,
+		interactionBuffers.nodeNumLeafInteractions);
+	computeInteractionIndices(
+		device,
+		octreeBuffers,
+		interactionBuffers,
+		interactionBuffers.nodeInteractions,
+		interactionBuffers.nodeInteractionRanks,
+		interactionBuffers.nodeNumNodeInteractions);
 	
 	// Compute max leafs that a node can interact with (by leaf interactions).
 	kernelComputeNodeMaxInteractionsLeafCount(
+		device,
 		octreeBuffers.nodes,
-		leafInteractions,
-		nodeMaxInteractionsLeafCount);
+		interactionBuffers.leafInteractions,
+		interactionBuffers.nodeMaxInteractionsLeafCount);
+}
+
+void OpenClSimulation::computeInteractionIndices(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		InteractionBuffers& interactionBuffers,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<device::index_t>& interactionRanks,
+		device::BufferWrapper<device::index_t>& nodeNumInteractions) {
+	fitBuffer(device, interactionRanks, 2 * interactions.size());
+	if (interactions.size() == 0) {
+		return;
+	}
 	
-	return {
-		leafInteractions,
-		nodeInteractions,
-		nodeNumLeafInteractions,
-		nodeNumNodeInteractions,
-		nodeMaxInteractionsLeafCount
-	};
+	// Sort the endpoints of the interactions by node (padded to a power of two
+	// for the bitonic sort).
+	std::size_t numEndpoints = 2 * interactions.size();
+	// The keys pack the node into the upper 32 bits and the endpoint into the
+	// lower ones, even with 64-bit indices.
+	if (
+			octreeBuffers.nodes.size() > UINT32_MAX ||
+			numEndpoints > UINT32_MAX) {
+		throw std::runtime_error(
+			"Too many nodes or interactions to sort the interaction endpoints");
+	}
+	std::size_t numPaddedEndpoints = 1;
+	while (numPaddedEndpoints < numEndpoints) {
+		numPaddedEndpoints *= 2;
+	}
+	device::BufferWrapper<cl_ulong>& endpoints = interactionBuffers.endpoints;
+	fitBuffer(device, endpoints, numPaddedEndpoints);
+	kernelComputeInteractionEndpoints(device, interactions, endpoints);
+	for (
+			std::size_t blockSize = 2;
+			blockSize <= numPaddedEndpoints;
+			blockSize *= 2) {
+		for (std::size_t stride = blockSize / 2; stride > 0; stride /= 2) {
+			kernelSortInteractionEndpoints(device, endpoints, blockSize, stride);
+		}
+	}
+	
+	// The padding ends up at the end, and can be left off from here on.
+	endpoints.resize(numEndpoints, true);
+	
+	// Rank the endpoints within the run of endpoints of each node.
+	device::BufferWrapper<device::index_t>& nodeSegmentStarts =
+		interactionBuffers.nodeSegmentStarts;
+	fitBuffer(device, nodeSegmentStarts, octreeBuffers.nodes.size());
+	kernelFindInteractionEndpointSegments(
+		device,
+		endpoints,
+		nodeSegmentStarts,
+		nodeNumInteractions);
+	kernelRankInteractionEndpoints(
+		device,
+		endpoints,
+		nodeSegmentStarts,
+		nodeNumInteractions,
+		interactionRanks);
 }
 
+void checkIndexRange(cl_ulong count, std::string name);
+
 device::index_t OpenClSimulation::computeLeafFieldIndices(
-		device::BufferWrapper<device::index_t> nodeNumLeafInteractions,
-		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount,
-		device::BufferWrapper<device::index_t> leafFieldIndices) {
+		device::BufferWrapper<device::index_t>& nodeNumLeafInteractions,
+		device::BufferWrapper<device::index_t>& nodeMaxInteractionsLeafCount,
+		device::BufferWrapper<device::index_t>& leafFieldIndices) {
 	// Map the buffers so they can be operated on in host.
 	device::index_t* nodeNumLeafInteractionsData =
 		nodeNumLeafInteractions.map(device::IOFlag::Read); 
@@ -383,27 +1338,44 @@ device::index_t OpenClSimulation::computeLeafFieldIndices(
 		reinterpret_cast<device::node_t const*>(_octree.nodes().data());
 	
 	// For each leaf, add up all of the interactions that it is part of and use
-	// that to give it a unique index in the fields array.
-	leafFieldIndicesData[0] = 0;
+	// that to give it a unique index in the fields array. First, every leaf
+	// gets the number of fields it needs, and then they are summed. The total
+	// is found in 64 bits beforehand, so that an overflow of the indices is
+	// caught instead of silently wrapping around.
+	cl_ulong totalNumFields = 0;
 	for (
-			device::index_t nodeIndex = 0;
+			std::size_t nodeIndex = 0;
 			nodeIndex < _octree.nodes().size();
 			++nodeIndex) {
-		device::node_t node = nodes[nodeIndex];
-		// Skip nodes with children.
-		if (!node.has_children) {
-			device::index_t numFields =
+		if (!nodes[nodeIndex].has_children) {
+			totalNumFields +=
+				static_cast<cl_ulong>(nodes[nodeIndex].leaf_count) *
 				nodeMaxInteractionsLeafCountData[nodeIndex] *
 				nodeNumLeafInteractionsData[nodeIndex];
-			for (
-					device::index_t leafIndex = node.leaf_index;
-					leafIndex < node.leaf_index + node.leaf_count;
-					++leafIndex) {
-				device::index_t previous = leafFieldIndicesData[leafIndex];
-				leafFieldIndicesData[leafIndex + 1] = previous + numFields;
-			}
 		}
 	}
+	checkIndexRange(totalNumFields, "leaf fields");
+	leafFieldIndicesData[0] = 0;
+	host::ThreadPool::global().parallelFor(
+		0, _octree.nodes().size(),
+		[&](std::size_t nodeIndex) {
+			device::node_t node = nodes[nodeIndex];
+			// Skip nodes with children.
+			if (!node.has_children) {
+				device::index_t numFields =
+					nodeMaxInteractionsLeafCountData[nodeIndex] *
+					nodeNumLeafInteractionsData[nodeIndex];
+				for (
+						device::index_t leafIndex = node.leaf_index;
+						leafIndex < node.leaf_index + node.leaf_count;
+						++leafIndex) {
+					leafFieldIndicesData[leafIndex + 1] = numFields;
+				}
+			}
+		});
+	host::ThreadPool::global().parallelInclusiveScan(
+		leafFieldIndicesData + 1,
+		_octree.leafs().size());
 	
 	// Return the total number of fields needed.
 	device::index_t numFields = leafFieldIndicesData[_octree.leafs().size()];
@@ -417,9 +1389,9 @@ device::index_t OpenClSimulation::computeLeafFieldIndices(
 }
 
 device::index_t OpenClSimulation::computeNodeFieldIndices(
-		device::BufferWrapper<device::index_t> nodeNumNodeInteractions,
-		device::BufferWrapper<device::index_t> nodeNumNodeParentInteractions,
-		device::BufferWrapper<device::index_t> nodeFieldIndices) {
+		device::BufferWrapper<device::index_t>& nodeNumNodeInteractions,
+		device::BufferWrapper<device::index_t>& nodeNumNodeParentInteractions,
+		device::BufferWrapper<device::index_t>& nodeFieldIndices) {
 	// Map both the buffers so they can be operated on in host.
 	device::index_t* nodeNumNodeInteractionsData =
 		nodeNumNodeInteractions.map(device::IOFlag::Read); 
@@ -451,26 +1423,41 @@ device::index_t OpenClSimulation::computeNodeFieldIndices(
 	
 	// For each leaf, add up all of the interactions that it is part of and use
 	// that to give it a unique index in the fields array.
-	nodeFieldIndicesData[0] = 0;
+	cl_ulong totalNumFields = 0;
 	for (
-			device::index_t nodeIndex = 0;
+			std::size_t nodeIndex = 0;
 			nodeIndex < _octree.nodes().size();
 			++nodeIndex) {
-		device::node_t node = nodes[nodeIndex];
-		// Skip nodes with children.
-		if (!node.has_children) {
-			device::index_t numFields =
-				nodeNumNodeInteractionsData[nodeIndex] +
-				nodeNumNodeParentInteractionsData[nodeIndex];
-			for (
-					device::index_t leafIndex = node.leaf_index;
-					leafIndex < node.leaf_index + node.leaf_count;
-					++leafIndex) {
-				device::index_t previous = nodeFieldIndicesData[leafIndex];
-				nodeFieldIndicesData[leafIndex + 1] = previous + numFields;
-			}
+		if (!nodes[nodeIndex].has_children) {
+			totalNumFields +=
+				static_cast<cl_ulong>(nodes[nodeIndex].leaf_count) * (
+					static_cast<cl_ulong>(
+						nodeNumNodeInteractionsData[nodeIndex]) +
+					nodeNumNodeParentInteractionsData[nodeIndex]);
 		}
 	}
+	checkIndexRange(totalNumFields, "node fields");
+	nodeFieldIndicesData[0] = 0;
+	host::ThreadPool::global().parallelFor(
+		0, _octree.nodes().size(),
+		[&](std::size_t nodeIndex) {
+			device::node_t node = nodes[nodeIndex];
+			// Skip nodes with children.
+			if (!node.has_children) {
+				device::index_t numFields =
+					nodeNumNodeInteractionsData[nodeIndex] +
+					nodeNumNodeParentInteractionsData[nodeIndex];
+				for (
+						device::index_t leafIndex = node.leaf_index;
+						leafIndex < node.leaf_index + node.leaf_count;
+						++leafIndex) {
+					nodeFieldIndicesData[leafIndex + 1] = numFields;
+				}
+			}
+		});
+	host::ThreadPool::global().parallelInclusiveScan(
+		nodeFieldIndicesData + 1,
+		_octree.leafs().size());
 	
 	// Return the total number of fields needed.
 	device::index_t numFields = nodeFieldIndicesData[_octree.leafs().size()];
@@ -483,23 +1470,25 @@ device::index_t OpenClSimulation::computeNodeFieldIndices(
 	return numFields;
 }
 
-OpenClSimulation::ForceBuffers OpenClSimulation::computeForceBuffers(
-		OctreeBuffers octreeBuffers,
-		InteractionBuffers interactionBuffers) {
+void OpenClSimulation::computeForceBuffers(
+		DeviceData& device,
+		OctreeBuffers& octreeBuffers,
+		InteractionBuffers& interactionBuffers,
+		ForceBuffers& forceBuffers) {
 	// First, get the leaf field indices so that every field can be assigned a
 	// location in the field array.
-	device::BufferWrapper<device::index_t> leafFieldIndices =
-		createBuffer<device::index_t>(
-			device::IOFlag::Read,
-			octreeBuffers.leafs.size() + 1);
-	device::BufferWrapper<device::index_t> nodeFieldIndices =
-		createBuffer<device::index_t>(
-			device::IOFlag::Read,
-			octreeBuffers.leafs.size() + 1);
-	device::BufferWrapper<device::index_t> nodeNumNodeParentInteractions =
-		createBuffer<device::index_t>(
-			device::IOFlag::ReadWrite,
-			octreeBuffers.nodes.size());
+	device::BufferWrapper<device::index_t>& leafFieldIndices =
+		forceBuffers.leafFieldIndices;
+	device::BufferWrapper<device::index_t>& nodeFieldIndices =
+		forceBuffers.nodeFieldIndices;
+	device::BufferWrapper<device::index_t>& nodeNumNodeParentInteractions =
+		forceBuffers.nodeNumNodeParentInteractions;
+	fitBuffer(device, leafFieldIndices, octreeBuffers.leafs.size() + 1);
+	fitBuffer(device, nodeFieldIndices, octreeBuffers.leafs.size() + 1);
+	fitBuffer(
+		device,
+		nodeNumNodeParentInteractions,
+		octreeBuffers.nodes.size());
 	
 	nodeNumNodeParentInteractions.zero();
 	
@@ -513,69 +1502,122 @@ OpenClSimulation::ForceBuffers OpenClSimulation::computeForceBuffers(
 		nodeFieldIndices);
 	
 	// Prepare the buffers to hold the fields.
-	device::BufferWrapper<device::leaf_field_t> leafFields =
-		createBuffer<device::leaf_field_t>(
-			device::IOFlag::ReadWrite, numLeafFields);
-	device::BufferWrapper<device::node_field_t> nodeFields =
-		createBuffer<device::node_field_t>(
-			device::IOFlag::ReadWrite, numNodeFields);
+	device::SegmentedBufferWrapper<device::leaf_field_t>& leafFields =
+		forceBuffers.leafFields;
+	device::SegmentedBufferWrapper<device::node_field_t>& nodeFields =
+		forceBuffers.nodeFields;
+	fitSegmentedBuffer(device, leafFields, numLeafFields);
+	fitSegmentedBuffer(device, nodeFields, numNodeFields);
 	
 	leafFields.zero();
 	nodeFields.zero();
 	
-	// Prepare the buffers to hold the forces.
-	device::BufferWrapper<device::force_t> leafForces =
-		createBuffer<device::force_t>(
-			device::IOFlag::ReadWrite,
-			octreeBuffers.leafs.size());
-	device::BufferWrapper<device::force_t> nodeForces =
-		createBuffer<device::force_t>(
-			device::IOFlag::ReadWrite,
-			octreeBuffers.leafs.size());
+	// Prepare the buffers to hold the forces. Reproducible forces are stored
+	// in fixed-point instead.
+	bool reproducible = _solverSettings.reproducibleForces;
+	std::size_t numForces = reproducible ? 0 : octreeBuffers.leafs.size();
+	std::size_t numFixedForces = reproducible ? octreeBuffers.leafs.size() : 0;
+	device::BufferWrapper<device::force_t>& leafForces =
+		forceBuffers.leafForces;
+	device::BufferWrapper<device::force_t>& nodeForces =
+		forceBuffers.nodeForces;
+	device::BufferWrapper<device::fixed_force_t>& leafFixedForces =
+		forceBuffers.leafFixedForces;
+	device::BufferWrapper<device::fixed_force_t>& nodeFixedForces =
+		forceBuffers.nodeFixedForces;
+	fitBuffer(device, leafForces, numForces);
+	fitBuffer(device, nodeForces, numForces);
+	fitBuffer(device, leafFixedForces, numFixedForces);
+	fitBuffer(device, nodeFixedForces, numFixedForces);
 	
 	leafForces.zero();
 	nodeForces.zero();
+	leafFixedForces.zero();
+	nodeFixedForces.zero();
+	
+	// With the operator cache, the field of every node interaction is computed
+	// before being applied to the leafs.
+	device::BufferWrapper<device::vector_t>& interactionFields =
+		forceBuffers.interactionFields;
+	fitBuffer(
+		device,
+		interactionFields,
+		_solverSettings.operatorCache ?
+			2 * interactionBuffers.nodeInteractions.size() :
+			0);
+	if (_solverSettings.operatorCache) {
+		kernelComputeNodeInteractionOperatorFields(
+			device,
+			octreeBuffers.nodes,
+			interactionBuffers.nodeInteractions,
+			interactionBuffers.nodeInteractionOperators,
+			interactionBuffers.operators,
+			interactionFields);
+	}
 	
 	// Calculate the fields.
 	kernelComputeLeafInteractionFields(
+		device,
 		octreeBuffers.leafs,
+		octreeBuffers.compactLeafs,
 		octreeBuffers.nodes,
 		interactionBuffers.leafInteractions,
+		interactionBuffers.leafInteractionRanks,
 		leafFieldIndices,
 		interactionBuffers.nodeMaxInteractionsLeafCount,
 		leafFields);
 	kernelComputeNodeInteractionFields(
+		device,
 		octreeBuffers.nodes,
 		interactionBuffers.nodeInteractions,
+		interactionBuffers.nodeInteractionRanks,
 		nodeFieldIndices,
 		nodeNumNodeParentInteractions,
-		nodeFields);
+		nodeFields,
+		interactionFields);
 	
 	// Calculate the forces.
 	kernelConvertLeafFieldsToForces(
+		device,
 		octreeBuffers.leafs,
 		leafFieldIndices,
 		leafFields,
-		leafForces);
+		leafForces,
+		leafFixedForces);
 	kernelConvertNodeFieldsToForces(
+		device,
 		octreeBuffers.leafs,
 		nodeFieldIndices,
 		nodeFields,
-		nodeForces);
-	
-	return {
-		leafForces,
-		nodeForces
-	};
+		nodeForces,
+		nodeFixedForces);
 }
 
-OpenClSimulation::IntegrationBuffers OpenClSimulation::computeIntegrationBuffers(
-		ForceBuffers forceBuffers,
-		IntegrationBuffers integrationBuffers) {
-	// Resize the integration buffers to make sure there will be enough space
-	// to hold the results.
-	integrationBuffers.newPositions.resize(_octree.leafs().size());
-	integrationBuffers.newVelocities.resize(_octree.leafs().size());
+void OpenClSimulation::accumulateForces(
+		ForceBuffers& forceBuffers,
+		HostVector<device::vector_t>& forces,
+		HostVector<device::fixed_force_t>& fixedForces) {
+	// Fixed-point forces are added as integers, so the order that the batches
+	// come in doesn't matter.
+	if (_solverSettings.reproducibleForces) {
+		device::fixed_force_t* leafFixedForcesData =
+			forceBuffers.leafFixedForces.map(device::IOFlag::Read);
+		device::fixed_force_t* nodeFixedForcesData =
+			forceBuffers.nodeFixedForces.map(device::IOFlag::Read);
+		host::ThreadPool::global().parallelFor(
+			0, fixedForces.size(),
+			[&](std::size_t leafIndex) {
+				device::fixed_force_t leafForce = leafFixedForcesData[leafIndex];
+				device::fixed_force_t nodeForce = nodeFixedForcesData[leafIndex];
+				for (unsigned int i = 0; i < 3; ++i) {
+					fixedForces[leafIndex].force[i] +=
+						leafForce.force[i] + nodeForce.force[i];
+				}
+			});
+		forceBuffers.leafFixedForces.unmap(leafFixedForcesData);
+		forceBuffers.nodeFixedForces.unmap(nodeFixedForcesData);
+		return;
+	}
 	
 	// Map both sets of forces for reading.
 	device::force_t* leafForcesData =
@@ -583,101 +1625,310 @@ OpenClSimulation::IntegrationBuffers OpenClSimulation::computeIntegrationBuffers
 	device::force_t* nodeForcesData =
 		forceBuffers.nodeForces.map(device::IOFlag::Read);
 	
-	// Loop through every leaf and calculate it's new position and velocity.
-	for (
-			Octree::LeafListSizeType leafIndex = 0;
-			leafIndex < _octree.leafs().size();
-			++leafIndex) {
-		// Get the calculated forces for updating leaf position.
-		device::force_t leafForce = leafForcesData[leafIndex];
-		device::force_t nodeForce = nodeForcesData[leafIndex];
-		// Get the current leaf position.
-		Octree::LeafIterator leafIt = _octree.leafs().begin() + leafIndex;
-		device::vector_t position = leafIt->position;
-		device::vector_t velocity = leafIt->value.velocity;
-		device::scalar_t mass = leafIt->value.mass;
-		
-		// Perform simple leapfrog integration to update velocities and find the
-		// new positions.
-		for (unsigned int i = 0; i < 3; ++i) {
-			device::scalar_t force = leafForce.force[i] + nodeForce.force[i];
-			device::scalar_t oldVelocity = velocity[i];
-			velocity[i] += force / mass * _timeStep;
-			position[i] += oldVelocity * _timeStep;
-		}
-		integrationBuffers.newPositions[leafIndex] = position;
-		integrationBuffers.newVelocities[leafIndex] = velocity;
-	}
+	// Add the forces from this batch onto the forces from previous batches.
+	host::ThreadPool::global().parallelFor(
+		0, forces.size(),
+		[&](std::size_t leafIndex) {
+			device::force_t leafForce = leafForcesData[leafIndex];
+			device::force_t nodeForce = nodeForcesData[leafIndex];
+			for (unsigned int i = 0; i < 3; ++i) {
+				forces[leafIndex][i] += leafForce.force[i] + nodeForce.force[i];
+			}
+		});
 	
 	forceBuffers.leafForces.unmap(leafForcesData);
 	forceBuffers.nodeForces.unmap(nodeForcesData);
+}
+
+void OpenClSimulation::computeIntegrationBuffers(
+		HostVector<device::vector_t> const& forces,
+		IntegrationBuffers& integrationBuffers) {
+	integrationBuffers.newPositions.resize(_octree.leafs().size());
+	integrationBuffers.newVelocities.resize(_octree.leafs().size());
 	
-	return integrationBuffers;
+	// Loop through every leaf and calculate it's new position and velocity.
+	host::ThreadPool::global().parallelFor(
+		0, _octree.leafs().size(),
+		[&](std::size_t leafIndex) {
+			// Get the current leaf position.
+			Octree::LeafIterator leafIt = _octree.leafs().begin() + leafIndex;
+			device::vector_t position = leafIt->position;
+			device::vector_t velocity = leafIt->value.velocity;
+			device::scalar_t mass = leafIt->value.mass;
+			
+			// Perform simple leapfrog integration to update velocities and find
+			// the new positions.
+			for (unsigned int i = 0; i < 3; ++i) {
+				device::scalar_t force = forces[leafIndex][i];
+				device::scalar_t oldVelocity = velocity[i];
+				velocity[i] += force / mass * _timeStep;
+				position[i] += oldVelocity * _timeStep;
+				// Wrap the particles back into a periodic box (rounding can
+				// leave a particle just below zero wrapped onto the far side).
+				if (_solverSettings.periodic) {
+					position[i] -= _bounds[i] * std::floor(position[i] / _bounds[i]);
+					if (position[i] >= _bounds[i]) {
+						position[i] = 0;
+					}
+				}
+			}
+			integrationBuffers.newPositions[leafIndex] = position;
+			integrationBuffers.newVelocities[leafIndex] = velocity;
+		});
 }
 
 void OpenClSimulation::initialize() {
 	// Initialize OpenCL.
 	_log << "Initializing OpenCL.\n";
 	
-	// Choose the default platform and device.
+	// Constants that depend on the solver settings are passed to the kernels
+	// as macros.
+	std::ostringstream buildOptions;
+	buildOptions << std::scientific <<
+		std::setprecision(std::numeric_limits<device::scalar_t>::max_digits10);
+	if (_particleMesh) {
+		buildOptions <<
+			" -D PM_SPLIT_RADIUS=" << _particleMesh->splitRadius() << "f";
+	}
+	if (_solverSettings.nodeErrorTolerance != 0) {
+		buildOptions <<
+			" -D NODE_ERROR_TOLERANCE=" <<
+			_solverSettings.nodeErrorTolerance << "f";
+	}
+	if (_solverSettings.periodic) {
+		buildOptions <<
+			" -D PERIODIC_BOX_X=" << _bounds[0] << "f" <<
+			" -D PERIODIC_BOX_Y=" << _bounds[1] << "f" <<
+			" -D PERIODIC_BOX_Z=" << _bounds[2] << "f";
+	}
+	if (_solverSettings.operatorCache) {
+		buildOptions << " -D NODE_OPERATOR_CACHE";
+	}
+	if (_solverSettings.reproducibleForces) {
+		buildOptions << " -D REPRODUCIBLE_FORCES";
+	}
+	if (_solverSettings.compactLeafs) {
+		buildOptions << " -D COMPACT_LEAFS";
+	}
+#ifdef NBODY_INDEX_64
+	buildOptions << " -D NBODY_INDEX_64";
+#endif
+#ifdef NBODY_MASS_CHANNEL
+	buildOptions << " -D NBODY_MASS_CHANNEL";
+#endif
+	_buildOptions = buildOptions.str();
+	
+	_devices = selectDevices();
+	if (_deviceSelection.numaFission) {
+		std::vector<DeviceData> subDevices;
+		for (DeviceData const& device : _devices) {
+			std::vector<DeviceData> split = splitNumaDevice(device);
+			subDevices.insert(subDevices.end(), split.begin(), split.end());
+		}
+		_devices = subDevices;
+		// Sub-devices of the same device are all equally capable, so it makes
+		// sense to give each of them their own region of space.
+		_spatialPartitioning = std::any_of(
+			_devices.begin(),
+			_devices.end(),
+			[](DeviceData const& device) {
+				return device.isNumaSubDevice;
+			});
+	}
+	for (DeviceData& device : _devices) {
+		initializeDevice(device);
+	}
+	
+	// Every device gets its own workspace, which starts out empty and grows
+	// over the first few steps.
+	_workspace.devices.resize(_devices.size());
+	_workspace.unprocessed.pending.resize(
+		_spatialPartitioning ? _devices.size() : 1);
+	_workspace.interactionArena.setHugePages(_solverSettings.hugePages);
+	resetInteractionLists();
+}
+
+std::vector<OpenClSimulation::DeviceData> OpenClSimulation::selectDevices() {
+	// Go through every device on every platform, and keep the ones that match
+	// the selection.
 	std::vector<cl::Platform> platforms;
 	cl::Platform::get(&platforms);
-	_platform = platforms[0];
 	
-	std::vector<cl::Device> devices;
-	_platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-	if (devices.size() == 0) {
-		throw std::runtime_error("OpenCL not supported");
+	std::vector<DeviceData> matches;
+	for (cl::Platform const& platform : platforms) {
+		std::string platformName = platform.getInfo<CL_PLATFORM_NAME>();
+		if (platformName.find(_deviceSelection.platformName) ==
+				std::string::npos) {
+			continue;
+		}
+		// Looking for devices of a type that a platform doesn't have throws an
+		// error, so no devices are found in that case.
+		std::vector<cl::Device> devices;
+		try {
+			platform.getDevices(_deviceSelection.deviceType, &devices);
+		}
+		catch (cl::Error const& error) {
+			if (error.err() != CL_DEVICE_NOT_FOUND) {
+				throw;
+			}
+		}
+		for (cl::Device const& device : devices) {
+			std::string deviceName = device.getInfo<CL_DEVICE_NAME>();
+			if (deviceName.find(_deviceSelection.deviceName) ==
+					std::string::npos) {
+				continue;
+			}
+			DeviceData deviceData;
+			deviceData.platform = platform;
+			deviceData.device = device;
+			matches.push_back(deviceData);
+		}
+	}
+	
+	if (_deviceSelection.deviceIndex >= matches.size()) {
+		throw std::runtime_error("No OpenCL device matches the selection");
 	}
-	_device = devices[0];
 	
+	std::size_t numDevices = matches.size() - _deviceSelection.deviceIndex;
+	if (_deviceSelection.maxDevices != 0) {
+		numDevices = std::min(numDevices, _deviceSelection.maxDevices);
+	}
+	return std::vector<DeviceData>(
+		matches.begin() + _deviceSelection.deviceIndex,
+		matches.begin() + _deviceSelection.deviceIndex + numDevices);
+}
+
+std::vector<OpenClSimulation::DeviceData> OpenClSimulation::splitNumaDevice(
+		DeviceData const& device) {
+	// Check whether the device can be partitioned by NUMA node at all. Most
+	// GPUs can't, in which case the device is used whole.
+	cl_device_affinity_domain affinityDomains = 0;
+	cl_uint maxSubDevices = 0;
+	device.device.getInfo(
+		CL_DEVICE_PARTITION_AFFINITY_DOMAIN,
+		&affinityDomains);
+	device.device.getInfo(
+		CL_DEVICE_PARTITION_MAX_SUB_DEVICES,
+		&maxSubDevices);
+	if (!(affinityDomains & CL_DEVICE_AFFINITY_DOMAIN_NUMA) ||
+			maxSubDevices <= 1) {
+		_log << "Device can't be split by NUMA node: " <<
+			device.device.getInfo<CL_DEVICE_NAME>() << "\n";
+		return { device };
+	}
+	
+	cl_device_partition_property properties[] = {
+		CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+		CL_DEVICE_AFFINITY_DOMAIN_NUMA,
+		0
+	};
+	std::vector<cl::Device> subDevices;
+	cl::Device parent = device.device;
+	parent.createSubDevices(properties, &subDevices);
+	// A machine with a single NUMA node gives back a single sub-device, which
+	// is no better than the original.
+	if (subDevices.size() <= 1) {
+		return { device };
+	}
+	
+	std::vector<DeviceData> result;
+	for (cl::Device const& subDevice : subDevices) {
+		DeviceData subDeviceData;
+		subDeviceData.platform = device.platform;
+		subDeviceData.device = subDevice;
+		subDeviceData.isNumaSubDevice = true;
+		result.push_back(subDeviceData);
+	}
+	_log << "Split device into " << result.size() << " NUMA sub-devices.\n";
+	return result;
+}
+
+void OpenClSimulation::initializeDevice(DeviceData& device) {
 	// Output what is being used.
-	std::string platformName = _platform.getInfo<CL_PLATFORM_NAME>();
-	std::string deviceName = _device.getInfo<CL_DEVICE_NAME>();
+	std::string platformName = device.platform.getInfo<CL_PLATFORM_NAME>();
+	std::string deviceName = device.device.getInfo<CL_DEVICE_NAME>();
 	_log << "Platorm: " << platformName << "\n";
 	_log << "Device:  " << deviceName << "\n";
 	
 	// Create the context and command queue.
-	_context = cl::Context(_device);
-	_queue = cl::CommandQueue(_context);
+	device.context = cl::Context(device.device);
+	device.queue = cl::CommandQueue(device.context, device.device);
 	
 	// Determine the maximum allowed buffer size. Make sure it's larger than
 	// some arbitrary small minimum.
-	_device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &_deviceMaxBufferSize);
-	if (_deviceMaxBufferSize < 1024 * 1024) {
+	device.device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &device.maxBufferSize);
+	if (device.maxBufferSize < 1024 * 1024) {
 		throw std::runtime_error("Device max buffer size is too small (<1 Mb)");
 	}
+	device.device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &device.maxComputeUnits);
+	
+#ifdef NBODY_INDEX_64
+	// The counters used to build the queues of interactions are indices, so
+	// 64-bit indices need 64-bit atomics.
+	std::string extensions = device.device.getInfo<CL_DEVICE_EXTENSIONS>();
+	if (
+			extensions.find("cl_khr_int64_base_atomics") == std::string::npos ||
+			extensions.find("cl_khr_int64_extended_atomics") ==
+				std::string::npos) {
+		throw std::runtime_error(
+			"Device doesn't support the 64-bit atomics needed for 64-bit "
+			"indices");
+	}
+#endif
+	
+	// The field kernels always take the Ewald table, even if it isn't used.
+	device.ewaldTable = createBuffer(
+		device,
+		device::IOFlag::Read,
+		_ewaldTable.size(),
+		_ewaldTable.empty() ? NULL : _ewaldTable.data());
 	
 	// Load all of the OpenCL sources.
-	cl::Program programVerify = buildSourceFile("verify.cl");
-	cl::Program programMoment = buildSourceFile("moment.cl");
-	cl::Program programInteraction = buildSourceFile("interaction.cl");
-	cl::Program programField = buildSourceFile("field.cl");
-	cl::Program programForce = buildSourceFile("force.cl");
+	cl::Program programVerify = buildSourceFile(device, "verify.cl");
+	cl::Program programMoment = buildSourceFile(device, "moment.cl");
+	cl::Program programInteraction = buildSourceFile(device, "interaction.cl");
+	cl::Program programField = buildSourceFile(device, "field.cl");
+	cl::Program programForce = buildSourceFile(device, "force.cl");
 	
 	// Get the kernels.
-	_kernelVerifyDeviceTypeSizes = getKernel(
-		programVerify, "verify_device_type_sizes");
-	_kernelComputeMomentsFromLeafs = getKernel(
-		programMoment, "compute_moments_from_leafs");
-	_kernelComputeMomentsFromNodes = getKernel(
-		programMoment, "compute_moments_from_nodes");
-	_kernelFindInteractions = getKernel(
-		programInteraction, "find_interactions");
-	_kernelComputeInteractionIndices = getKernel(
-		programInteraction, "compute_interaction_indices");
-	_kernelComputeNodeMaxInteractionsLeafCount = getKernel(
-		programInteraction, "compute_node_max_interactions_leaf_count");
-	_kernelComputeLeafInteractionFields = getKernel(
-		programField, "compute_leaf_interaction_fields");
-	_kernelComputeNodeInteractionFields = getKernel(
-		programField, "compute_node_interaction_fields");
-	_kernelConvertLeafFieldsToForces = getKernel(
-		programForce, "convert_leaf_fields_to_forces");
-	_kernelConvertNodeFieldsToForces = getKernel(
-		programForce, "convert_node_fields_to_forces");
-	
-	verifyDeviceTypeSizes();
+	device.kernelVerifyDeviceTypeSizes = getKernel(
+		device, programVerify, "verify_device_type_sizes");
+	device.kernelComputeMomentsFromLeafs = getKernel(
+		device, programMoment, "compute_moments_from_leafs");
+	device.kernelComputeMomentsFromNodes = getKernel(
+		device, programMoment, "compute_moments_from_nodes");
+	device.kernelFindInteractions = getKernel(
+		device, programInteraction, "find_interactions");
+	device.kernelTraverseInteractions = getKernel(
+		device, programInteraction, "traverse_interactions");
+	device.kernelComputeInteractionEndpoints = getKernel(
+		device, programInteraction, "compute_interaction_endpoints");
+	device.kernelSortInteractionEndpoints = getKernel(
+		device, programInteraction, "sort_interaction_endpoints");
+	device.kernelFindInteractionEndpointSegments = getKernel(
+		device, programInteraction, "find_interaction_endpoint_segments");
+	device.kernelRankInteractionEndpoints = getKernel(
+		device, programInteraction, "rank_interaction_endpoints");
+	device.kernelComputeNodeMaxInteractionsLeafCount = getKernel(
+		device, programInteraction, "compute_node_max_interactions_leaf_count");
+	if (_solverSettings.compactLeafs) {
+		device.kernelComputeCompactLeafs = getKernel(
+			device, programField, "compute_compact_leafs");
+	}
+	device.kernelComputeLeafInteractionFields = getKernel(
+		device, programField, "compute_leaf_interaction_fields");
+	if (_solverSettings.operatorCache) {
+		device.kernelComputeNodeInteractionOperatorFields = getKernel(
+			device, programField, "compute_node_interaction_operator_fields");
+	}
+	device.kernelComputeNodeInteractionFields = getKernel(
+		device, programField, "compute_node_interaction_fields");
+	device.kernelConvertLeafFieldsToForces = getKernel(
+		device, programForce, "convert_leaf_fields_to_forces");
+	device.kernelConvertNodeFieldsToForces = getKernel(
+		device, programForce, "convert_node_fields_to_forces");
+	
+	verifyDeviceTypeSizes(device);
 }
 
 void verifyDeviceTypeSize(
@@ -685,22 +1936,22 @@ void verifyDeviceTypeSize(
 		std::size_t deviceSize,
 		std::size_t hostSize);
 
-void OpenClSimulation::verifyDeviceTypeSizes() {
+void OpenClSimulation::verifyDeviceTypeSizes(DeviceData& device) {
 	// Read the sizes of the types on the device and verify that they are the
 	// same as the sizes on the host.
 	std::vector<cl_uint> sizes(VERIFY_NUM_TYPES);
 	cl::Buffer sizesBuffer(
-		_context,
+		device.context,
 		CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
 		sizeof(cl_uint) * sizes.size(),
 		NULL);
-	KernelData kernelData = _kernelVerifyDeviceTypeSizes;
+	KernelData kernelData = device.kernelVerifyDeviceTypeSizes;
 	kernelData.kernel.setArg<cl::Buffer>(0, sizesBuffer);
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(1));
-	_queue.enqueueReadBuffer(
+	device.queue.enqueueReadBuffer(
 		sizesBuffer,
 		CL_TRUE,
 		0,
@@ -750,10 +2001,26 @@ void OpenClSimulation::verifyDeviceTypeSizes() {
 		"interaction_t",
 		sizes[VERIFY_INTERACTION_T_INDEX],
 		sizeof(device::interaction_t));
+	verifyDeviceTypeSize(
+		"compact_leaf_t",
+		sizes[VERIFY_COMPACT_LEAF_T_INDEX],
+		sizeof(device::compact_leaf_t));
+	verifyDeviceTypeSize(
+		"fixed_force_t",
+		sizes[VERIFY_FIXED_FORCE_T_INDEX],
+		sizeof(device::fixed_force_t));
 	
 	_log << "Successfully verified all device types.\n";
 }
 
+void checkIndexRange(cl_ulong count, std::string name) {
+	if (count > std::numeric_limits<device::index_t>::max()) {
+		throw std::runtime_error(
+			"Number of " + name + " (" + std::to_string(count) + ") doesn't "
+			"fit in an index (build with NBODY_INDEX_64)");
+	}
+}
+
 void verifyDeviceTypeSize(
 		std::string name,
 		std::size_t deviceSize,
@@ -769,11 +2036,12 @@ void verifyDeviceTypeSize(
 }
 
 void OpenClSimulation::kernelComputeMomentsFromLeafs(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::index_t> processedNodes) {
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::index_t>& processedNodes) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelComputeMomentsFromLeafs;
+	KernelData kernelData = device.kernelComputeMomentsFromLeafs;
 	kernelData.kernel.setArg<device::index_t>(0, leafs.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, leafs.buffer());
 	kernelData.kernel.setArg<device::index_t>(2, nodes.size());
@@ -788,7 +2056,7 @@ void OpenClSimulation::kernelComputeMomentsFromLeafs(
 		(numItems % localSize != 0) +
 		(numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize),
@@ -796,12 +2064,13 @@ void OpenClSimulation::kernelComputeMomentsFromLeafs(
 }
 
 void OpenClSimulation::kernelComputeMomentsFromNodes(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::index_t> processedNodes,
-		device::BufferWrapper<device::index_t> newProcessedNodes) {
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::index_t>& processedNodes,
+		device::BufferWrapper<device::index_t>& newProcessedNodes) {
 	// Pass the arguments to the kernel.
 	std::size_t numNodesToScan = 8;
-	KernelData kernelData = _kernelComputeMomentsFromNodes;
+	KernelData kernelData = device.kernelComputeMomentsFromNodes;
 	kernelData.kernel.setArg<device::index_t>(0, nodes.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, nodes.buffer());
 	kernelData.kernel.setArg<device::index_t>(2, processedNodes.size());
@@ -819,7 +2088,7 @@ void OpenClSimulation::kernelComputeMomentsFromNodes(
 		(numItems % localSize != 0) +
 		(numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize),
@@ -827,61 +2096,185 @@ void OpenClSimulation::kernelComputeMomentsFromNodes(
 }
 
 void OpenClSimulation::kernelFindInteractions(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> interactions,
-		device::BufferWrapper<device::interaction_t> newInteractions) {
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<device::interaction_t>& reducibleInteractions,
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_t>& queueCounts) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelFindInteractions;
+	KernelData kernelData = device.kernelFindInteractions;
 	kernelData.kernel.setArg<device::index_t>(0, nodes.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, nodes.buffer());
 	kernelData.kernel.setArg<device::index_t>(2, interactions.size());
 	kernelData.kernel.setArg<cl::Buffer>(3, interactions.buffer());
-	kernelData.kernel.setArg<cl::Buffer>(4, newInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(4, reducibleInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(5, leafInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(6, nodeInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(7, queueCounts.buffer());
 	
 	// Invoke the kernel.
 	std::size_t numItems = interactions.size();
 	std::size_t localSize = 8;
 	std::size_t numWorkGroups = numItems + (numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize, localSize),
 		cl::NDRange(localSize, localSize));
 }
 
-void OpenClSimulation::kernelComputeInteractionIndices(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> interactions,
-		device::BufferWrapper<device::index_t> nodeNumInteractions) {
+void OpenClSimulation::kernelTraverseInteractions(
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& workQueue,
+		device::BufferWrapper<device::index_t>& workQueueReady,
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_t>& counters) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelComputeInteractionIndices;
+	KernelData kernelData = device.kernelTraverseInteractions;
 	kernelData.kernel.setArg<device::index_t>(0, nodes.size());
-	kernelData.kernel.setArg<cl::Buffer>(1, nodeNumInteractions.buffer());
-	kernelData.kernel.setArg<device::index_t>(2, interactions.size());
-	kernelData.kernel.setArg<cl::Buffer>(3, interactions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(1, nodes.buffer());
+	kernelData.kernel.setArg<device::index_t>(2, workQueue.size());
+	kernelData.kernel.setArg<cl::Buffer>(3, workQueue.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(4, workQueueReady.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(5, leafInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(6, nodeInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(7, counters.buffer());
+	
+	// Invoke the kernel. The work items keep going until the traversal is
+	// finished, so only enough of them to fill the device are needed.
+	std::size_t localSize = kernelData.workGroupSizeMultiple;
+	std::size_t numWorkGroups = 4 * device.maxComputeUnits;
+	std::size_t globalSize = numWorkGroups * localSize;
+	device.queue.enqueueNDRangeKernel(
+		kernelData.kernel,
+		cl::NullRange,
+		cl::NDRange(globalSize),
+		cl::NDRange(localSize));
+}
+
+void OpenClSimulation::kernelComputeInteractionEndpoints(
+		DeviceData& device,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<cl_ulong>& endpoints) {
+	// Pass the arguments to the kernel.
+	KernelData kernelData = device.kernelComputeInteractionEndpoints;
+	kernelData.kernel.setArg<device::index_t>(0, interactions.size());
+	kernelData.kernel.setArg<cl::Buffer>(1, interactions.buffer());
+	kernelData.kernel.setArg<device::index_t>(2, endpoints.size());
+	kernelData.kernel.setArg<cl::Buffer>(3, endpoints.buffer());
 	
 	// Invoke the kernel.
-	std::size_t numItems = interactions.size();
+	std::size_t numItems = endpoints.size();
 	std::size_t localSize = kernelData.workGroupSizeMultiple;
-	std::size_t numWorkGroups = 
+	std::size_t numWorkGroups =
 		numItems / localSize +
 		(numItems % localSize != 0) +
 		(numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize),
-		cl::NullRange);
+		cl::NDRange(localSize));
+}
+
+void OpenClSimulation::kernelSortInteractionEndpoints(
+		DeviceData& device,
+		device::BufferWrapper<cl_ulong>& endpoints,
+		std::size_t blockSize,
+		std::size_t stride) {
+	// Pass the arguments to the kernel.
+	KernelData kernelData = device.kernelSortInteractionEndpoints;
+	kernelData.kernel.setArg<device::index_t>(0, endpoints.size());
+	kernelData.kernel.setArg<cl::Buffer>(1, endpoints.buffer());
+	kernelData.kernel.setArg<device::index_t>(2, blockSize);
+	kernelData.kernel.setArg<device::index_t>(3, stride);
+	
+	// Invoke the kernel.
+	std::size_t numItems = endpoints.size() / 2;
+	std::size_t localSize = kernelData.workGroupSizeMultiple;
+	std::size_t numWorkGroups =
+		numItems / localSize +
+		(numItems % localSize != 0) +
+		(numItems == 0);
+	std::size_t globalSize = numWorkGroups * localSize;
+	device.queue.enqueueNDRangeKernel(
+		kernelData.kernel,
+		cl::NullRange,
+		cl::NDRange(globalSize),
+		cl::NDRange(localSize));
+}
+
+void OpenClSimulation::kernelFindInteractionEndpointSegments(
+		DeviceData& device,
+		device::BufferWrapper<cl_ulong>& endpoints,
+		device::BufferWrapper<device::index_t>& nodeSegmentStarts,
+		device::BufferWrapper<device::index_t>& nodeNumInteractions) {
+	// Pass the arguments to the kernel.
+	KernelData kernelData = device.kernelFindInteractionEndpointSegments;
+	kernelData.kernel.setArg<device::index_t>(0, endpoints.size());
+	kernelData.kernel.setArg<cl::Buffer>(1, endpoints.buffer());
+	kernelData.kernel.setArg<device::index_t>(2, nodeSegmentStarts.size());
+	kernelData.kernel.setArg<cl::Buffer>(3, nodeSegmentStarts.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(4, nodeNumInteractions.buffer());
+	
+	// Invoke the kernel.
+	std::size_t numItems = endpoints.size();
+	std::size_t localSize = kernelData.workGroupSizeMultiple;
+	std::size_t numWorkGroups =
+		numItems / localSize +
+		(numItems % localSize != 0) +
+		(numItems == 0);
+	std::size_t globalSize = numWorkGroups * localSize;
+	device.queue.enqueueNDRangeKernel(
+		kernelData.kernel,
+		cl::NullRange,
+		cl::NDRange(globalSize),
+		cl::NDRange(localSize));
+}
+
+void OpenClSimulation::kernelRankInteractionEndpoints(
+		DeviceData& device,
+		device::BufferWrapper<cl_ulong>& endpoints,
+		device::BufferWrapper<device::index_t>& nodeSegmentStarts,
+		device::BufferWrapper<device::index_t>& nodeNumInteractions,
+		device::BufferWrapper<device::index_t>& interactionRanks) {
+	// Pass the arguments to the kernel.
+	KernelData kernelData = device.kernelRankInteractionEndpoints;
+	kernelData.kernel.setArg<device::index_t>(0, endpoints.size());
+	kernelData.kernel.setArg<cl::Buffer>(1, endpoints.buffer());
+	kernelData.kernel.setArg<device::index_t>(2, nodeSegmentStarts.size());
+	kernelData.kernel.setArg<cl::Buffer>(3, nodeSegmentStarts.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(4, nodeNumInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(5, interactionRanks.buffer());
+	
+	// Invoke the kernel.
+	std::size_t numItems = endpoints.size();
+	std::size_t localSize = kernelData.workGroupSizeMultiple;
+	std::size_t numWorkGroups =
+		numItems / localSize +
+		(numItems % localSize != 0) +
+		(numItems == 0);
+	std::size_t globalSize = numWorkGroups * localSize;
+	device.queue.enqueueNDRangeKernel(
+		kernelData.kernel,
+		cl::NullRange,
+		cl::NDRange(globalSize),
+		cl::NDRange(localSize));
 }
 
 void OpenClSimulation::kernelComputeNodeMaxInteractionsLeafCount(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> interactions,
-		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount) {
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& interactions,
+		device::BufferWrapper<device::index_t>& nodeMaxInteractionsLeafCount) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelComputeNodeMaxInteractionsLeafCount;
+	KernelData kernelData = device.kernelComputeNodeMaxInteractionsLeafCount;
 	kernelData.kernel.setArg<device::index_t>(0, nodes.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, nodes.buffer());
 	kernelData.kernel.setArg<cl::Buffer>(2, nodeMaxInteractionsLeafCount.buffer());
@@ -896,53 +2289,123 @@ void OpenClSimulation::kernelComputeNodeMaxInteractionsLeafCount(
 		(numItems % localSize != 0) +
 		(numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize),
 		cl::NullRange);
 }
 
-void OpenClSimulation::kernelComputeLeafInteractionFields(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> leafInteractions,
-		device::BufferWrapper<device::index_t> leafFieldIndices,
-		device::BufferWrapper<device::index_t> nodeMaxInteractionsLeafCount,
-		device::BufferWrapper<device::leaf_field_t> leafFields) {
+void OpenClSimulation::kernelComputeCompactLeafs(
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::compact_leaf_t>& compactLeafs) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelComputeLeafInteractionFields;
+	KernelData kernelData = device.kernelComputeCompactLeafs;
 	kernelData.kernel.setArg<device::index_t>(0, leafs.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, leafs.buffer());
+	kernelData.kernel.setArg<device::index_t>(2, nodes.size());
+	kernelData.kernel.setArg<cl::Buffer>(3, nodes.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(4, compactLeafs.buffer());
+	
+	// Invoke the kernel.
+	std::size_t numItems = nodes.size();
+	std::size_t localSize = kernelData.workGroupSizeMultiple;
+	std::size_t numWorkGroups =
+		numItems / localSize +
+		(numItems % localSize != 0) +
+		(numItems == 0);
+	std::size_t globalSize = numWorkGroups * localSize;
+	device.queue.enqueueNDRangeKernel(
+		kernelData.kernel,
+		cl::NullRange,
+		cl::NDRange(globalSize),
+		cl::NullRange);
+}
+
+void OpenClSimulation::kernelComputeLeafInteractionFields(
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::compact_leaf_t>& compactLeafs,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& leafInteractions,
+		device::BufferWrapper<device::index_t>& leafInteractionRanks,
+		device::BufferWrapper<device::index_t>& leafFieldIndices,
+		device::BufferWrapper<device::index_t>& nodeMaxInteractionsLeafCount,
+		device::SegmentedBufferWrapper<device::leaf_field_t>& leafFields) {
+	// Pass the arguments to the kernel.
+	KernelData kernelData = device.kernelComputeLeafInteractionFields;
+	kernelData.kernel.setArg<device::index_t>(0, leafs.size());
+	kernelData.kernel.setArg<cl::Buffer>(
+		1,
+		_solverSettings.compactLeafs ? compactLeafs.buffer() : leafs.buffer());
 	kernelData.kernel.setArg<cl::Buffer>(2, leafFieldIndices.buffer());
 	kernelData.kernel.setArg<device::index_t>(3, nodes.size());
 	kernelData.kernel.setArg<cl::Buffer>(4, nodes.buffer());
 	kernelData.kernel.setArg<cl::Buffer>(5, nodeMaxInteractionsLeafCount.buffer());
 	kernelData.kernel.setArg<device::index_t>(6, leafInteractions.size());
 	kernelData.kernel.setArg<cl::Buffer>(7, leafInteractions.buffer());
-	kernelData.kernel.setArg<device::index_t>(8, leafFields.size());
-	kernelData.kernel.setArg<cl::Buffer>(9, leafFields.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(8, leafInteractionRanks.buffer());
+	kernelData.kernel.setArg<device::index_t>(9, leafFields.size());
+	cl_uint argIndex = leafFields.setArgs(kernelData.kernel, 10);
+	kernelData.kernel.setArg<cl::Buffer>(argIndex, device.ewaldTable.buffer());
 	
 	// Invoke the kernel.
 	std::size_t numItems = leafInteractions.size();
 	std::size_t localSize = 8;
 	std::size_t numWorkGroups = numItems + (numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize, localSize),
 		cl::NDRange(localSize, localSize));
 }
 
+void OpenClSimulation::kernelComputeNodeInteractionOperatorFields(
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_diff_t>& nodeInteractionOperators,
+		device::BufferWrapper<device::vector_t>& operators,
+		device::BufferWrapper<device::vector_t>& interactionFields) {
+	// Pass the arguments to the kernel.
+	KernelData kernelData = device.kernelComputeNodeInteractionOperatorFields;
+	kernelData.kernel.setArg<device::index_t>(0, nodes.size());
+	kernelData.kernel.setArg<cl::Buffer>(1, nodes.buffer());
+	kernelData.kernel.setArg<device::index_t>(2, nodeInteractions.size());
+	kernelData.kernel.setArg<cl::Buffer>(3, nodeInteractions.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(4, nodeInteractionOperators.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(5, operators.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(6, interactionFields.buffer());
+	
+	// Invoke the kernel.
+	std::size_t numItems = nodeInteractions.size();
+	std::size_t localSize = kernelData.workGroupSizeMultiple;
+	std::size_t numWorkGroups =
+		numItems / localSize +
+		(numItems % localSize != 0) +
+		(numItems == 0);
+	std::size_t globalSize = numWorkGroups * localSize;
+	device.queue.enqueueNDRangeKernel(
+		kernelData.kernel,
+		cl::NullRange,
+		cl::NDRange(globalSize),
+		cl::NDRange(localSize));
+}
+
 void OpenClSimulation::kernelComputeNodeInteractionFields(
-		device::BufferWrapper<device::node_t> nodes,
-		device::BufferWrapper<device::interaction_t> nodeInteractions,
-		device::BufferWrapper<device::index_t> nodeFieldIndices,
-		device::BufferWrapper<device::index_t> nodeNumNodeParentInteractions,
-		device::BufferWrapper<device::node_field_t> nodeFields) {
+		DeviceData& device,
+		device::BufferWrapper<device::node_t>& nodes,
+		device::BufferWrapper<device::interaction_t>& nodeInteractions,
+		device::BufferWrapper<device::index_t>& nodeInteractionRanks,
+		device::BufferWrapper<device::index_t>& nodeFieldIndices,
+		device::BufferWrapper<device::index_t>& nodeNumNodeParentInteractions,
+		device::SegmentedBufferWrapper<device::node_field_t>& nodeFields,
+		device::BufferWrapper<device::vector_t>& interactionFields) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelComputeNodeInteractionFields;
+	KernelData kernelData = device.kernelComputeNodeInteractionFields;
 	kernelData.kernel.setArg<device::index_t>(0, nodeFieldIndices.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, nodeFieldIndices.buffer());
 	kernelData.kernel.setArg<device::index_t>(2, nodes.size());
@@ -950,15 +2413,20 @@ void OpenClSimulation::kernelComputeNodeInteractionFields(
 	kernelData.kernel.setArg<cl::Buffer>(4, nodeNumNodeParentInteractions.buffer());
 	kernelData.kernel.setArg<device::index_t>(5, nodeInteractions.size());
 	kernelData.kernel.setArg<cl::Buffer>(6, nodeInteractions.buffer());
-	kernelData.kernel.setArg<device::index_t>(7, nodeFields.size());
-	kernelData.kernel.setArg<cl::Buffer>(8, nodeFields.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(7, nodeInteractionRanks.buffer());
+	kernelData.kernel.setArg<device::index_t>(8, nodeFields.size());
+	cl_uint argIndex = nodeFields.setArgs(kernelData.kernel, 9);
+	kernelData.kernel.setArg<cl::Buffer>(argIndex, device.ewaldTable.buffer());
+	kernelData.kernel.setArg<cl::Buffer>(
+		argIndex + 1,
+		interactionFields.buffer());
 	
 	// Invoke the kernel.
 	std::size_t numItems = nodeInteractions.size();
 	std::size_t localSize = kernelData.workGroupSizeMultiple;
 	std::size_t numWorkGroups = numItems + (numItems == 0);
 	std::size_t globalSize = 2 * numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize),
@@ -966,18 +2434,21 @@ void OpenClSimulation::kernelComputeNodeInteractionFields(
 }
 
 void OpenClSimulation::kernelConvertLeafFieldsToForces(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::index_t> leafFieldIndices,
-		device::BufferWrapper<device::leaf_field_t> leafFields,
-		device::BufferWrapper<device::force_t> leafForces) {
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::index_t>& leafFieldIndices,
+		device::SegmentedBufferWrapper<device::leaf_field_t>& leafFields,
+		device::BufferWrapper<device::force_t>& leafForces,
+		device::BufferWrapper<device::fixed_force_t>& leafFixedForces) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelConvertLeafFieldsToForces;
+	KernelData kernelData = device.kernelConvertLeafFieldsToForces;
 	kernelData.kernel.setArg<device::index_t>(0, leafs.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, leafs.buffer());
 	kernelData.kernel.setArg<cl::Buffer>(2, leafFieldIndices.buffer());
 	kernelData.kernel.setArg<cl::Buffer>(3, leafForces.buffer());
 	kernelData.kernel.setArg<device::index_t>(4, leafFields.size());
-	kernelData.kernel.setArg<cl::Buffer>(5, leafFields.buffer());
+	cl_uint argIndex = leafFields.setArgs(kernelData.kernel, 5);
+	kernelData.kernel.setArg<cl::Buffer>(argIndex, leafFixedForces.buffer());
 	
 	// Invoke the kernel.
 	std::size_t numItems = leafs.size();
@@ -987,7 +2458,7 @@ void OpenClSimulation::kernelConvertLeafFieldsToForces(
 		(numItems % localSize != 0) +
 		(numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize),
@@ -995,18 +2466,21 @@ void OpenClSimulation::kernelConvertLeafFieldsToForces(
 }
 
 void OpenClSimulation::kernelConvertNodeFieldsToForces(
-		device::BufferWrapper<device::leaf_t> leafs,
-		device::BufferWrapper<device::index_t> nodeFieldIndices,
-		device::BufferWrapper<device::node_field_t> nodeFields,
-		device::BufferWrapper<device::force_t> nodeForces) {
+		DeviceData& device,
+		device::BufferWrapper<device::leaf_t>& leafs,
+		device::BufferWrapper<device::index_t>& nodeFieldIndices,
+		device::SegmentedBufferWrapper<device::node_field_t>& nodeFields,
+		device::BufferWrapper<device::force_t>& nodeForces,
+		device::BufferWrapper<device::fixed_force_t>& nodeFixedForces) {
 	// Pass the arguments to the kernel.
-	KernelData kernelData = _kernelConvertNodeFieldsToForces;
+	KernelData kernelData = device.kernelConvertNodeFieldsToForces;
 	kernelData.kernel.setArg<device::index_t>(0, leafs.size());
 	kernelData.kernel.setArg<cl::Buffer>(1, leafs.buffer());
 	kernelData.kernel.setArg<cl::Buffer>(2, nodeFieldIndices.buffer());
 	kernelData.kernel.setArg<cl::Buffer>(3, nodeForces.buffer());
 	kernelData.kernel.setArg<device::index_t>(4, nodeFields.size());
-	kernelData.kernel.setArg<cl::Buffer>(5, nodeFields.buffer());
+	cl_uint argIndex = nodeFields.setArgs(kernelData.kernel, 5);
+	kernelData.kernel.setArg<cl::Buffer>(argIndex, nodeFixedForces.buffer());
 	
 	// Invoke the kernel.
 	std::size_t numItems = leafs.size();
@@ -1016,14 +2490,16 @@ void OpenClSimulation::kernelConvertNodeFieldsToForces(
 		(numItems % localSize != 0) +
 		(numItems == 0);
 	std::size_t globalSize = numWorkGroups * localSize;
-	_queue.enqueueNDRangeKernel(
+	device.queue.enqueueNDRangeKernel(
 		kernelData.kernel,
 		cl::NullRange,
 		cl::NDRange(globalSize),
 		cl::NullRange);
 }
 
-cl::Program OpenClSimulation::buildSourceFile(std::string fileName) {
+cl::Program OpenClSimulation::buildSourceFile(
+		DeviceData& device,
+		std::string fileName) {
 	// Load the OpenCL source from file into a string.
 	std::ifstream file(fileName);
 	std::stringstream stream;
@@ -1032,12 +2508,12 @@ cl::Program OpenClSimulation::buildSourceFile(std::string fileName) {
 	
 	// Compile the source code.
 	_log << "Build OpenCL source file " << fileName << ".\n";
-	cl::Program program(_context, source);
-	program.build();
+	cl::Program program(device.context, source);
+	program.build(_buildOptions.c_str());
 	
 	// Show the log in case there are warnings.
 	std::string buildLog;
-	program.getBuildInfo(_device, CL_PROGRAM_BUILD_LOG, &buildLog);
+	program.getBuildInfo(device.device, CL_PROGRAM_BUILD_LOG, &buildLog);
 	if (!std::all_of(
 			buildLog.begin(),
 			buildLog.end(),
@@ -1050,20 +2526,21 @@ cl::Program OpenClSimulation::buildSourceFile(std::string fileName) {
 }
 
 OpenClSimulation::KernelData OpenClSimulation::getKernel(
+		DeviceData& device,
 		cl::Program const& program,
 		std::string kernelName) {
 	KernelData result;
 	result.kernel = cl::Kernel(program, kernelName.c_str());
 	result.kernel.getWorkGroupInfo(
-		_device,
+		device.device,
 		CL_KERNEL_WORK_GROUP_SIZE,
 		&result.maxWorkGroupSize);
 	result.kernel.getWorkGroupInfo(
-		_device,
+		device.device,
 		CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
 		&result.compileWorkGroupSize);
 	result.kernel.getWorkGroupInfo(
-		_device,
+		device.device,
 		CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
 		&result.workGroupSizeMultiple);
 	return result;
@@ -0,0 +1,92 @@
+#include "nbody/host/operator_cache.h"
+
+#include <cmath>
+
+#include "nbody/device/constants.h"
+#include "nbody/host/multipole.h"
+
+using namespace nbody;
+using namespace nbody::host;
+
+device::index_diff_t OperatorCache::find(
+		device::node_t const& source,
+		device::node_t const& target) {
+	if (source.depth != target.depth) {
+		return 0;
+	}
+	
+	// Find the offset between the centers in units of the node size. Nodes at
+	// the same depth are all the same size.
+	Key key = { static_cast<int>(source.depth), 0, 0, 0 };
+	device::vector_t displacement;
+	for (unsigned int i = 0; i < 3; ++i) {
+		displacement[i] =
+			(target.position[i] + target.dimensions[i] / 2) -
+			(source.position[i] + source.dimensions[i] / 2);
+		key[i + 1] = static_cast<int>(
+			std::round(displacement[i] / target.dimensions[i]));
+	}
+	
+	// The operators expand both nodes about their geometric centers, and give
+	// the field at the center of the target, so the cells themselves have to
+	// pass the approximation test (which the interaction only passed for the
+	// spheres around the centers of charge). Otherwise the field is computed
+	// directly.
+	device::scalar_t offsetSq = 0;
+	for (unsigned int i = 1; i < 4; ++i) {
+		offsetSq += static_cast<device::scalar_t>(key[i] * key[i]);
+	}
+	// The half-diagonals of the two cells add up to sqrt(3) node sizes.
+	device::scalar_t radiusSumSq = 3;
+	if (!(radiusSumSq < NODE_APPROX_RATIO * NODE_APPROX_RATIO * offsetSq)) {
+		return 0;
+	}
+	
+	// Only store the operator for the offset that comes first.
+	device::index_diff_t sign = 1;
+	Key reverseKey = { key[0], -key[1], -key[2], -key[3] };
+	if (reverseKey < key) {
+		key = reverseKey;
+		sign = -1;
+		for (unsigned int i = 0; i < 3; ++i) {
+			displacement[i] = -displacement[i];
+		}
+	}
+	
+	auto it = _indices.find(key);
+	if (it != _indices.end()) {
+		return sign * it->second;
+	}
+	
+	// Compute the field of each moment component on its own.
+	device::index_diff_t index =
+		static_cast<device::index_diff_t>(
+			_operators.size() / OPERATOR_NUM_MOMENTS) + 1;
+	for (unsigned int component = 0; component < OPERATOR_NUM_MOMENTS; ++component) {
+		device::node_moment_t moment = device::node_moment_t();
+		if (component == 0) {
+			moment.charge = 1;
+		}
+		else if (component < 4) {
+			moment.dipole_moment[component - 1] = 1;
+		}
+		else if (component < 7) {
+			moment.quadrupole_cross_terms[component - 4] = 1;
+		}
+		else {
+			moment.quadrupole_trace_terms[component - 7] = 1;
+		}
+		_operators.push_back(momentField(
+			moment,
+			device::vector_t(),
+			displacement));
+	}
+	_indices[key] = index;
+	return sign * index;
+}
+
+void OperatorCache::clear() {
+	_indices.clear();
+	_operators.clear();
+}
+
@@ -0,0 +1,403 @@
+#include "nbody/out_of_core_simulation.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+
+#include "nbody/host/multipole.h"
+
+using namespace nbody;
+
+OutOfCoreSimulation::OutOfCoreSimulation(
+		std::string path,
+		device::vector_t bounds,
+		Scalar timeStep,
+		std::ostream& log,
+		DeviceSelection deviceSelection,
+		SolverSettings solverSettings,
+		std::size_t chunkSize,
+		std::size_t resortInterval) :
+		_particles(path),
+		_nextParticles(path + ".next", _particles.size()),
+		_numParticles(_particles.size() / sizeof(Particle)),
+		_chunkSize(std::max<std::size_t>(chunkSize, 1)),
+		_curveBox(),
+		_time(0.0),
+		_timeStep(timeStep),
+		_log(log),
+		_resortInterval(std::max<std::size_t>(resortInterval, 1)),
+		_stepIndex(0),
+		_local(
+			bounds,
+			_particles.data<Particle>() + chunkBegin(0),
+			_particles.data<Particle>() + chunkEnd(0),
+			timeStep,
+			log,
+			deviceSelection,
+			solverSettings) {
+	if (_particles.size() % sizeof(Particle) != 0) {
+		throw std::runtime_error(
+			"Particle file '" + path + "' doesn't hold a whole number of "
+			"particles");
+	}
+	// Both of these depend on every particle at once.
+	if (solverSettings.meshSize != 0 || solverSettings.periodic) {
+		throw std::runtime_error(
+			"Out-of-core simulations can't use a particle-mesh or a periodic "
+			"box");
+	}
+	_local.setExternalForces(std::bind(
+		&OutOfCoreSimulation::addRemoteForces,
+		this,
+		std::placeholders::_1,
+		std::placeholders::_2,
+		std::placeholders::_3));
+	
+	_log << "Simulating " << _numParticles << " particles from '" << path <<
+		"' in " << numChunks() << " chunks.\n";
+	Particle const* data = _particles.data<Particle>();
+	_curveBox = host::fitCurveBox(host::computeDomainBounds(
+		_numParticles,
+		[&](std::size_t index) {
+			return data[index].position;
+		}));
+	sortFile();
+}
+
+std::vector<OutOfCoreSimulation::Particle>
+OutOfCoreSimulation::particles() const {
+	Particle const* data = _particles.data<Particle>();
+	return std::vector<Particle>(data, data + _numParticles);
+}
+
+OutOfCoreSimulation::Scalar OutOfCoreSimulation::step() {
+	_log << "Starting a new out-of-core step (t=" << _time << ").\n";
+	summarize();
+	
+	// Simulate each chunk in turn, reading the next one ahead of time. The new
+	// particles are written to the next file, and the pages of both files are
+	// dropped once the chunk is done with.
+	std::vector<host::DomainBounds> chunkBounds;
+	chunkBounds.reserve(numChunks());
+	for (std::size_t chunk = 0; chunk < numChunks(); ++chunk) {
+		_log << "Simulating chunk " << chunk << ".\n";
+		prefetchChunk(chunk + 1);
+		buildRemoteTree(chunk);
+		_local.setParticles(
+			_particles.data<Particle>() + chunkBegin(chunk),
+			_particles.data<Particle>() + chunkEnd(chunk));
+		_local.step();
+		
+		std::vector<Particle> particles = _local.particles();
+		Particle* next = _nextParticles.data<Particle>() + chunkBegin(chunk);
+		for (std::size_t index = 0; index < particles.size(); ++index) {
+			new (next + index) Particle(particles[index]);
+		}
+		chunkBounds.push_back(host::computeDomainBounds(
+			particles.size(),
+			[&](std::size_t index) {
+				return particles[index].position;
+			}));
+		releaseChunk(_particles, chunk);
+		releaseChunk(_nextParticles, chunk);
+	}
+	swapFiles();
+	
+	// The summaries of the next step are built over the curve box, so it has
+	// to contain the new particles.
+	host::DomainBounds bounds = host::mergeDomainBounds(chunkBounds);
+	if (host::shouldFitCurveBox(_curveBox, bounds)) {
+		_curveBox = host::fitCurveBox(bounds);
+		_log << "Moved the Morton curve to a box of size " <<
+			_curveBox.dimensions[0] << ".\n";
+	}
+	
+	++_stepIndex;
+	if (_stepIndex % _resortInterval == 0) {
+		sortFile();
+	}
+	
+	_time += _timeStep;
+	return _time;
+}
+
+host::morton_t OutOfCoreSimulation::key(Particle const& particle) const {
+	return host::mortonKey(
+		particle.position,
+		_curveBox.position,
+		_curveBox.dimensions);
+}
+
+std::size_t OutOfCoreSimulation::numChunks() const {
+	return _numParticles / _chunkSize + (_numParticles % _chunkSize != 0);
+}
+
+std::size_t OutOfCoreSimulation::chunkBegin(std::size_t chunk) const {
+	return std::min(chunk * _chunkSize, _numParticles);
+}
+
+std::size_t OutOfCoreSimulation::chunkEnd(std::size_t chunk) const {
+	return std::min((chunk + 1) * _chunkSize, _numParticles);
+}
+
+std::vector<OutOfCoreSimulation::Particle> OutOfCoreSimulation::readChunk(
+		std::size_t chunk) const {
+	Particle const* data = _particles.data<Particle>();
+	return std::vector<Particle>(
+		data + chunkBegin(chunk),
+		data + chunkEnd(chunk));
+}
+
+void OutOfCoreSimulation::prefetchChunk(std::size_t chunk) {
+	if (chunk < numChunks()) {
+		_particles.prefetch(
+			chunkBegin(chunk) * sizeof(Particle),
+			(chunkEnd(chunk) - chunkBegin(chunk)) * sizeof(Particle));
+	}
+}
+
+void OutOfCoreSimulation::releaseChunk(
+		host::MappedFile& file,
+		std::size_t chunk) {
+	file.release(
+		chunkBegin(chunk) * sizeof(Particle),
+		(chunkEnd(chunk) - chunkBegin(chunk)) * sizeof(Particle));
+}
+
+std::vector<host::morton_t> OutOfCoreSimulation::sortChunk(
+		std::size_t chunk) {
+	std::vector<Particle> particles = readChunk(chunk);
+	std::vector<std::pair<host::morton_t, std::size_t> > order;
+	order.reserve(particles.size());
+	for (std::size_t index = 0; index < particles.size(); ++index) {
+		order.push_back({ key(particles[index]), index });
+	}
+	
+	// Chunks are usually still sorted from the last time, in which case they
+	// don't have to be written back.
+	std::vector<host::morton_t> keys;
+	keys.reserve(order.size());
+	if (!std::is_sorted(order.begin(), order.end())) {
+		std::sort(order.begin(), order.end());
+		Particle* data = _particles.data<Particle>() + chunkBegin(chunk);
+		for (std::size_t index = 0; index < order.size(); ++index) {
+			data[index] = particles[order[index].second];
+		}
+	}
+	for (std::pair<host::morton_t, std::size_t> const& next : order) {
+		keys.push_back(next.first);
+	}
+	return keys;
+}
+
+void OutOfCoreSimulation::sortFile() {
+	_log << "Sorting particle file.\n";
+	
+	// Sort every chunk by itself, and then merge the chunks into the next file.
+	for (std::size_t chunk = 0; chunk < numChunks(); ++chunk) {
+		prefetchChunk(chunk + 1);
+		sortChunk(chunk);
+		releaseChunk(_particles, chunk);
+	}
+	_particles.adviseSequential();
+	_nextParticles.adviseSequential();
+	
+	// The smallest key at the front of each chunk is taken next. Ties are
+	// broken by the chunk, so that the order doesn't depend on the queue.
+	using Head = std::pair<host::morton_t, std::size_t>;
+	std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+	std::vector<std::size_t> positions(numChunks());
+	Particle const* data = _particles.data<Particle>();
+	for (std::size_t chunk = 0; chunk < numChunks(); ++chunk) {
+		positions[chunk] = chunkBegin(chunk);
+		heads.push({ key(data[positions[chunk]]), chunk });
+	}
+	Particle* next = _nextParticles.data<Particle>();
+	for (std::size_t index = 0; !heads.empty(); ++index) {
+		std::size_t chunk = heads.top().second;
+		heads.pop();
+		new (next + index) Particle(data[positions[chunk]]);
+		++positions[chunk];
+		if (positions[chunk] < chunkEnd(chunk)) {
+			heads.push({ key(data[positions[chunk]]), chunk });
+		}
+		// Drop every chunk of the output once it has been written.
+		if ((index + 1) % _chunkSize == 0 || index + 1 == _numParticles) {
+			releaseChunk(_nextParticles, index / _chunkSize);
+		}
+	}
+	swapFiles();
+}
+
+void OutOfCoreSimulation::swapFiles() {
+	// The files are renamed so that the particles are always found at the
+	// original path.
+	std::string path = _particles.path();
+	std::string nextPath = _nextParticles.path();
+	_particles.rename(path + ".old");
+	_nextParticles.rename(path);
+	_particles.rename(nextPath);
+	std::swap(_particles, _nextParticles);
+}
+
+void OutOfCoreSimulation::summarize() {
+	_log << "Summarizing chunks.\n";
+	_summaries.assign(numChunks(), ChunkSummary());
+	for (std::size_t chunk = 0; chunk < numChunks(); ++chunk) {
+		prefetchChunk(chunk + 1);
+		std::vector<host::morton_t> keys = sortChunk(chunk);
+		
+		Particle const* particles =
+			_particles.data<Particle>() + chunkBegin(chunk);
+		ChunkSummary& summary = _summaries[chunk];
+		summary.bounds = host::computeDomainBounds(
+			keys.size(),
+			[&](std::size_t index) {
+				return particles[index].position;
+			});
+		buildSummary(
+			particles, keys,
+			chunkBegin(chunk),
+			0, keys.size(),
+			0,
+			_curveBox.position, _curveBox.dimensions,
+			summary.cells);
+		releaseChunk(_particles, chunk);
+	}
+}
+
+void OutOfCoreSimulation::buildSummary(
+		Particle const* particles,
+		std::vector<host::morton_t> const& keys,
+		std::size_t offset,
+		std::size_t begin,
+		std::size_t end,
+		unsigned int depth,
+		device::vector_t cellPosition,
+		device::vector_t cellDimensions,
+		std::vector<SummaryCell>& cells) const {
+	if (begin == end) {
+		return;
+	}
+	
+	// Find the moments of the cell about its center.
+	std::size_t cellIndex = cells.size();
+	SummaryCell cell = {
+		cellPosition,
+		cellDimensions,
+		device::node_moment_t(),
+		offset + begin,
+		offset + end,
+		0
+	};
+	device::vector_t center;
+	for (unsigned int i = 0; i < 3; ++i) {
+		center[i] = cellPosition[i] + cellDimensions[i] / 2;
+	}
+	for (std::size_t index = begin; index < end; ++index) {
+		host::addMoment(
+			cell.moment,
+			center,
+			particles[index].position,
+			particles[index].charge,
+			particles[index].mass);
+	}
+	cells.push_back(cell);
+	
+	// Refine the cell until it is small enough. The keys are sorted, so the
+	// particles in each octant are contiguous.
+	if (end - begin > OUT_OF_CORE_CELL_CAPACITY && depth < MORTON_BITS) {
+		device::vector_t childDimensions;
+		for (unsigned int i = 0; i < 3; ++i) {
+			childDimensions[i] = cellDimensions[i] / 2;
+		}
+		std::size_t childBegin = begin;
+		for (unsigned int octant = 0; octant < 8; ++octant) {
+			std::size_t childEnd = static_cast<std::size_t>(std::upper_bound(
+				keys.begin() + childBegin,
+				keys.begin() + end,
+				octant,
+				[depth](unsigned int octant, host::morton_t key) {
+					return octant < host::mortonOctant(key, depth);
+				}) - keys.begin());
+			device::vector_t childPosition = cellPosition;
+			for (unsigned int i = 0; i < 3; ++i) {
+				if (octant & (4 >> i)) {
+					childPosition[i] += childDimensions[i];
+				}
+			}
+			buildSummary(
+				particles, keys,
+				offset,
+				childBegin, childEnd,
+				depth + 1,
+				childPosition, childDimensions,
+				cells);
+			childBegin = childEnd;
+		}
+	}
+	cells[cellIndex].next = cells.size();
+}
+
+void OutOfCoreSimulation::buildRemoteTree(std::size_t chunk) {
+	_remoteNodes.clear();
+	_remoteLeafs.clear();
+	
+	// Walk the summary of every other chunk. Cells that are far enough from
+	// this chunk are used as moments, and the particles of the smallest cells
+	// that aren't are read from the file.
+	host::DomainBounds const& target = _summaries[chunk].bounds;
+	Particle const* data = _particles.data<Particle>();
+	for (std::size_t other = 0; other < numChunks(); ++other) {
+		if (other == chunk) {
+			continue;
+		}
+		std::vector<SummaryCell> const& cells = _summaries[other].cells;
+		std::size_t cellIndex = 0;
+		while (cellIndex < cells.size()) {
+			SummaryCell const& cell = cells[cellIndex];
+			device::vector_t center;
+			if (host::isWellSeparated(
+					cell.position,
+					cell.dimensions,
+					target,
+					center)) {
+				_remoteNodes.push_back({ center, cell.moment });
+				cellIndex = cell.next;
+			}
+			else if (cell.next == cellIndex + 1) {
+				for (
+						std::size_t index = cell.begin;
+						index < cell.end;
+						++index) {
+					_remoteLeafs.push_back({
+						data[index].position,
+						data[index].charge,
+						data[index].mass
+					});
+				}
+				cellIndex = cell.next;
+			}
+			else {
+				++cellIndex;
+			}
+		}
+	}
+	_log << "Using " << _remoteNodes.size() << " remote nodes and " <<
+		_remoteLeafs.size() << " remote leafs.\n";
+}
+
+void OutOfCoreSimulation::addRemoteForces(
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces) const {
+	host::addEssentialForces(
+		_remoteNodes,
+		_remoteLeafs,
+		leafs,
+		numLeafs,
+		forces);
+}
+
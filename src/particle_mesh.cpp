@@ -0,0 +1,240 @@
+#include "nbody/host/particle_mesh.h"
+
+#include <cmath>
+#include <utility>
+
+#include "nbody/device/constants.h"
+#include "nbody/host/thread_pool.h"
+
+using namespace nbody::host;
+
+namespace {
+
+// In-place iterative radix-2 FFT of a sequence whose length is a power of two.
+void fft(std::complex<double>* data, std::size_t size, bool inverse) {
+	// Put the elements in bit-reversed order.
+	for (std::size_t i = 1, j = 0; i < size; ++i) {
+		std::size_t bit = size >> 1;
+		for (; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j) {
+			std::swap(data[i], data[j]);
+		}
+	}
+	// Combine the transforms of increasing length.
+	for (std::size_t length = 2; length <= size; length <<= 1) {
+		double angle = 2 * M_PI / length * (inverse ? 1 : -1);
+		std::complex<double> root(std::cos(angle), std::sin(angle));
+		for (std::size_t start = 0; start < size; start += length) {
+			std::complex<double> factor(1);
+			for (std::size_t offset = 0; offset < length / 2; ++offset) {
+				std::complex<double> even = data[start + offset];
+				std::complex<double> odd =
+					data[start + offset + length / 2] * factor;
+				data[start + offset] = even + odd;
+				data[start + offset + length / 2] = even - odd;
+				factor *= root;
+			}
+		}
+	}
+}
+
+}
+
+ParticleMesh::ParticleMesh(
+		std::size_t size,
+		device::vector_t position,
+		device::vector_t dimensions,
+		device::scalar_t splitRadius) :
+		_size(1),
+		_position(position),
+		_dimensions(dimensions),
+		_splitRadius(splitRadius) {
+	while (_size < size) {
+		_size *= 2;
+	}
+	for (unsigned int i = 0; i < 3; ++i) {
+		_spacing[i] = dimensions[i] / _size;
+	}
+	std::size_t paddedSize = 2 * _size;
+	_potential.resize(paddedSize * paddedSize * paddedSize);
+	for (unsigned int i = 0; i < 3; ++i) {
+		_field[i].resize(_size * _size * _size);
+	}
+	_lines.resize(ThreadPool::global().size() * paddedSize);
+	computeGreenTransform();
+}
+
+void ParticleMesh::computeGreenTransform() {
+	// The long range part of the potential of a unit charge is
+	// erf(r / 2r_s) / r. The padded mesh is periodic, so distances wrap around
+	// halfway along each side.
+	std::size_t paddedSize = 2 * _size;
+	_greenTransform.resize(paddedSize * paddedSize * paddedSize);
+	double splitRadius = _splitRadius;
+	ThreadPool::global().parallelFor(
+		0, paddedSize,
+		[&](std::size_t i) {
+			double dx = (i <= _size ? i : paddedSize - i) * _spacing[0];
+			for (std::size_t j = 0; j < paddedSize; ++j) {
+				double dy = (j <= _size ? j : paddedSize - j) * _spacing[1];
+				for (std::size_t k = 0; k < paddedSize; ++k) {
+					double dz = (k <= _size ? k : paddedSize - k) * _spacing[2];
+					double r = std::sqrt(dx * dx + dy * dy + dz * dz);
+					double green = (r == 0) ?
+						1 / (std::sqrt(M_PI) * splitRadius) :
+						std::erf(r / (2 * splitRadius)) / r;
+					_greenTransform[paddedIndex(i, j, k)] = green;
+				}
+			}
+		});
+	transform(_greenTransform, false);
+}
+
+void ParticleMesh::transform(std::vector<Complex>& data, bool inverse) {
+	// Transform along each axis in turn, one line at a time.
+	std::size_t paddedSize = 2 * _size;
+	std::size_t strides[3] = { paddedSize * paddedSize, paddedSize, 1 };
+	for (unsigned int axis = 0; axis < 3; ++axis) {
+		std::size_t stride = strides[axis];
+		ThreadPool::global().run([&](std::size_t threadIndex) {
+			std::pair<std::size_t, std::size_t> range = ThreadPool::global().chunk(
+				threadIndex, 0, paddedSize * paddedSize);
+			Complex* line = _lines.data() + threadIndex * paddedSize;
+			for (std::size_t lineIndex = range.first; lineIndex < range.second; ++lineIndex) {
+				// Find the start of the line from the indices along the other
+				// two axes.
+				std::size_t a = lineIndex / paddedSize;
+				std::size_t b = lineIndex % paddedSize;
+				std::size_t start =
+					axis == 0 ? paddedIndex(0, a, b) :
+					axis == 1 ? paddedIndex(a, 0, b) :
+					paddedIndex(a, b, 0);
+				for (std::size_t index = 0; index < paddedSize; ++index) {
+					line[index] = data[start + index * stride];
+				}
+				fft(line, paddedSize, inverse);
+				for (std::size_t index = 0; index < paddedSize; ++index) {
+					data[start + index * stride] = line[index];
+				}
+			}
+		});
+	}
+}
+
+void ParticleMesh::cloudInCell(
+		device::vector_t position,
+		std::size_t (&cell)[3],
+		double (&weight)[3]) const {
+	for (unsigned int i = 0; i < 3; ++i) {
+		// Mesh points are at the centers of the cells. Particles outside of
+		// the mesh are clamped to its edges.
+		double x = (position[i] - _position[i]) / _spacing[i] - 0.5;
+		double maxX = static_cast<double>(_size - 1);
+		x = std::min(std::max(x, 0.0), maxX);
+		double lower = std::min(std::floor(x), maxX - 1);
+		cell[i] = static_cast<std::size_t>(std::max(lower, 0.0));
+		weight[i] = _size > 1 ? x - cell[i] : 0.0;
+	}
+}
+
+void ParticleMesh::addForces(
+		device::leaf_t const* leafs,
+		std::size_t numLeafs,
+		device::vector_t* forces) {
+	std::size_t paddedSize = 2 * _size;
+	std::size_t upper = _size > 1 ? 1 : 0;
+	
+	// Deposit the charges onto the mesh.
+	std::fill(_potential.begin(), _potential.end(), Complex(0));
+	for (std::size_t leafIndex = 0; leafIndex < numLeafs; ++leafIndex) {
+		std::size_t cell[3];
+		double weight[3];
+		cloudInCell(leafs[leafIndex].position, cell, weight);
+		double charge = leafs[leafIndex].value.moment.charge;
+		for (std::size_t di = 0; di <= upper; ++di) {
+			double wx = di ? weight[0] : 1 - weight[0];
+			for (std::size_t dj = 0; dj <= upper; ++dj) {
+				double wy = dj ? weight[1] : 1 - weight[1];
+				for (std::size_t dk = 0; dk <= upper; ++dk) {
+					double wz = dk ? weight[2] : 1 - weight[2];
+					_potential[paddedIndex(
+						cell[0] + di,
+						cell[1] + dj,
+						cell[2] + dk)] += charge * wx * wy * wz;
+				}
+			}
+		}
+	}
+	
+	// Convolve with the Green's function to get the potential.
+	transform(_potential, false);
+	for (std::size_t index = 0; index < _potential.size(); ++index) {
+		_potential[index] *= _greenTransform[index];
+	}
+	transform(_potential, true);
+	double normalization = 1.0 / (paddedSize * paddedSize * paddedSize);
+	
+	// The field is minus the gradient of the potential, found with central
+	// differences (one-sided at the edges of the mesh).
+	ThreadPool::global().parallelFor(
+		0, _size,
+		[&](std::size_t i) {
+			for (std::size_t j = 0; j < _size; ++j) {
+				for (std::size_t k = 0; k < _size; ++k) {
+					std::size_t index[3] = { i, j, k };
+					for (unsigned int axis = 0; axis < 3; ++axis) {
+						std::size_t below[3] = { i, j, k };
+						std::size_t above[3] = { i, j, k };
+						if (index[axis] > 0) {
+							--below[axis];
+						}
+						if (index[axis] + 1 < _size) {
+							++above[axis];
+						}
+						double distance =
+							(above[axis] - below[axis]) * _spacing[axis];
+						double difference = distance == 0 ? 0.0 : (
+							_potential[paddedIndex(above[0], above[1], above[2])].real() -
+							_potential[paddedIndex(below[0], below[1], below[2])].real());
+						_field[axis][meshIndex(i, j, k)] = distance == 0 ?
+							0.0 :
+							-FORCE_CONSTANT * normalization * difference / distance;
+					}
+				}
+			}
+		});
+	
+	// Interpolate the field back to the particles.
+	ThreadPool::global().parallelFor(
+		0, numLeafs,
+		[&](std::size_t leafIndex) {
+			std::size_t cell[3];
+			double weight[3];
+			cloudInCell(leafs[leafIndex].position, cell, weight);
+			double field[3] = { 0, 0, 0 };
+			for (std::size_t di = 0; di <= upper; ++di) {
+				double wx = di ? weight[0] : 1 - weight[0];
+				for (std::size_t dj = 0; dj <= upper; ++dj) {
+					double wy = dj ? weight[1] : 1 - weight[1];
+					for (std::size_t dk = 0; dk <= upper; ++dk) {
+						double wz = dk ? weight[2] : 1 - weight[2];
+						std::size_t index = meshIndex(
+							cell[0] + di,
+							cell[1] + dj,
+							cell[2] + dk);
+						for (unsigned int axis = 0; axis < 3; ++axis) {
+							field[axis] += wx * wy * wz * _field[axis][index];
+						}
+					}
+				}
+			}
+			double charge = leafs[leafIndex].value.moment.charge;
+			for (unsigned int axis = 0; axis < 3; ++axis) {
+				forces[leafIndex][axis] += charge * field[axis];
+			}
+		});
+}
+
@@ -0,0 +1,118 @@
+#include "nbody/host/thread_pool.h"
+
+#include <algorithm>
+#include <memory>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace nbody::host;
+
+namespace {
+
+std::unique_ptr<ThreadPool> globalThreadPool;
+std::mutex globalThreadPoolMutex;
+
+}
+
+ThreadPool::ThreadPool(std::size_t numThreads, std::vector<int> cores) :
+		_taskData(nullptr),
+		_taskFunction(nullptr),
+		_generation(0),
+		_numRemaining(0),
+		_stop(false) {
+	if (numThreads == 0) {
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	_threads.reserve(numThreads);
+	for (std::size_t index = 0; index < numThreads; ++index) {
+		int core = cores.empty() ? -1 : cores[index % cores.size()];
+		_threads.emplace_back(&ThreadPool::work, this, index, core);
+	}
+	_scratch.resize(
+		numThreads * THREAD_POOL_SCRATCH_SIZE / sizeof(std::max_align_t));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_startCondition.notify_all();
+	for (std::thread& thread : _threads) {
+		thread.join();
+	}
+}
+
+ThreadPool& ThreadPool::global() {
+	std::lock_guard<std::mutex> lock(globalThreadPoolMutex);
+	if (!globalThreadPool) {
+		globalThreadPool.reset(new ThreadPool());
+	}
+	return *globalThreadPool;
+}
+
+void ThreadPool::configureGlobal(
+		std::size_t numThreads,
+		std::vector<int> cores) {
+	std::lock_guard<std::mutex> lock(globalThreadPoolMutex);
+	globalThreadPool.reset(new ThreadPool(numThreads, cores));
+}
+
+void ThreadPool::runTask(
+		void const* taskData,
+		void (*taskFunction)(void const*, std::size_t)) {
+	std::lock_guard<std::mutex> runLock(_runMutex);
+	std::unique_lock<std::mutex> lock(_mutex);
+	_taskData = taskData;
+	_taskFunction = taskFunction;
+	_numRemaining = _threads.size();
+	++_generation;
+	_startCondition.notify_all();
+	_doneCondition.wait(lock, [this]() { return _numRemaining == 0; });
+	_taskData = nullptr;
+	_taskFunction = nullptr;
+}
+
+void ThreadPool::work(std::size_t threadIndex, int core) {
+#ifdef __linux__
+	// Pin the thread to its core, so that the memory it first touches stays
+	// local to it.
+	if (core >= 0) {
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(core, &cpuSet);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet);
+	}
+#else
+	static_cast<void>(core);
+#endif
+	std::size_t generation = 0;
+	while (true) {
+		void const* taskData;
+		void (*taskFunction)(void const*, std::size_t);
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_startCondition.wait(lock, [&]() {
+				return _stop || _generation != generation;
+			});
+			if (_stop) {
+				return;
+			}
+			generation = _generation;
+			taskData = _taskData;
+			taskFunction = _taskFunction;
+		}
+		taskFunction(taskData, threadIndex);
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			--_numRemaining;
+			if (_numRemaining == 0) {
+				_doneCondition.notify_one();
+			}
+		}
+	}
+}
+
@@ -0,0 +1,202 @@
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "nbody/device/constants.h"
+#include "nbody/host/multipole.h"
+#include "nbody/open_cl_simulation.h"
+
+// Checks the forces of the octree against direct summation on a small system.
+// The particles start at rest with unit mass, so after a single step of unit
+// length their velocities are the forces on them. A particle far away from the
+// others also checks that their total charge reaches the top of the octree.
+
+using Simulation = nbody::OpenClSimulation;
+
+// Largest relative RMS error in the forces that is accepted.
+#define ACCURACY_TOLERANCE (1e-2)
+// Distance of the far particle from the others, in units of the box.
+#define ACCURACY_PROBE_DISTANCE (50.0)
+
+std::vector<Simulation::Particle> makeParticles(std::size_t numParticles);
+std::vector<Simulation::Particle> stepParticles(
+	std::vector<Simulation::Particle> const& particles,
+	nbody::SolverSettings solverSettings);
+std::array<double, 3> directForce(
+	std::vector<Simulation::Particle> const& sources,
+	Simulation::Particle const& target);
+double forceError(
+	std::vector<Simulation::Particle> const& particles,
+	nbody::SolverSettings solverSettings);
+double probeError(std::vector<Simulation::Particle> particles);
+
+int main() {
+	try {
+		std::vector<Simulation::Particle> particles = makeParticles(4096);
+		
+		struct Case {
+			std::string name;
+			nbody::SolverSettings solverSettings;
+		};
+		std::vector<Case> cases;
+		cases.push_back({ "approximation ratio", nbody::SolverSettings() });
+		nbody::SolverSettings tolerance;
+		tolerance.nodeErrorTolerance = 1e-3;
+		cases.push_back({ "error tolerance", tolerance });
+		nbody::SolverSettings operatorCache;
+		operatorCache.operatorCache = true;
+		cases.push_back({ "operator cache", operatorCache });
+		
+		bool passed = true;
+		for (Case const& next : cases) {
+			double error = forceError(particles, next.solverSettings);
+			std::cout << next.name << ": relative error " << error << "\n";
+			if (!(error < ACCURACY_TOLERANCE)) {
+				std::cout << next.name << ": FAILED\n";
+				passed = false;
+			}
+		}
+		
+		double error = probeError(particles);
+		std::cout << "far particle: relative error " << error << "\n";
+		if (!(error < ACCURACY_TOLERANCE)) {
+			std::cout << "far particle: FAILED\n";
+			passed = false;
+		}
+		return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	catch (std::exception const& exception) {
+		std::cout << "Error: " << exception.what() << "\n";
+		return EXIT_FAILURE;
+	}
+}
+
+std::vector<Simulation::Particle> makeParticles(std::size_t numParticles) {
+	// The particles are clustered towards the middle of the box, so that the
+	// octree has nodes at many different depths.
+	std::mt19937 generator(1);
+	std::normal_distribution<Simulation::Scalar> positionDistribution(
+		0.5,
+		0.15);
+	std::uniform_real_distribution<Simulation::Scalar> chargeDistribution(
+		0.1,
+		1.0);
+	std::vector<Simulation::Particle> particles;
+	particles.reserve(numParticles);
+	while (particles.size() < numParticles) {
+		Simulation::Vector position = {
+			positionDistribution(generator),
+			positionDistribution(generator),
+			positionDistribution(generator),
+			0.0
+		};
+		bool inside = true;
+		for (unsigned int i = 0; i < 3; ++i) {
+			inside = inside && position[i] >= 0 && position[i] < 1;
+		}
+		if (inside) {
+			particles.push_back({
+				position,
+				Simulation::Vector(),
+				1.0,
+				chargeDistribution(generator)
+			});
+		}
+	}
+	return particles;
+}
+
+std::vector<Simulation::Particle> stepParticles(
+		std::vector<Simulation::Particle> const& particles,
+		nbody::SolverSettings solverSettings) {
+	std::ostringstream log;
+	Simulation simulation(
+		{ 1.0, 1.0, 1.0, 0.0 },
+		particles,
+		1.0,
+		log,
+		nbody::DeviceSelection(),
+		solverSettings);
+	simulation.step();
+	// The particles come back in the order of the octree, but haven't moved.
+	return simulation.particles();
+}
+
+std::array<double, 3> directForce(
+		std::vector<Simulation::Particle> const& sources,
+		Simulation::Particle const& target) {
+	std::array<double, 3> force = {{ 0, 0, 0 }};
+	for (Simulation::Particle const& source : sources) {
+		Simulation::Vector field = nbody::host::chargeField(
+			source.charge,
+			source.position,
+			target.position);
+		for (unsigned int i = 0; i < 3; ++i) {
+			force[i] += target.charge * field[i];
+		}
+#ifdef NBODY_MASS_CHANNEL
+		Simulation::Vector massField = nbody::host::chargeField(
+			source.mass,
+			source.position,
+			target.position,
+			MASS_FORCE_CONSTANT);
+		for (unsigned int i = 0; i < 3; ++i) {
+			force[i] += target.mass * massField[i];
+		}
+#endif
+	}
+	return force;
+}
+
+double forceError(
+		std::vector<Simulation::Particle> const& particles,
+		nbody::SolverSettings solverSettings) {
+	std::vector<Simulation::Particle> result =
+		stepParticles(particles, solverSettings);
+	double errorSq = 0;
+	double forceSq = 0;
+	for (Simulation::Particle const& target : result) {
+		std::array<double, 3> force = directForce(result, target);
+		for (unsigned int i = 0; i < 3; ++i) {
+			double difference = target.velocity[i] - force[i];
+			errorSq += difference * difference;
+			forceSq += force[i] * force[i];
+		}
+	}
+	return std::sqrt(errorSq / forceSq);
+}
+
+double probeError(std::vector<Simulation::Particle> particles) {
+	// The other particles are approximated by the node that holds all of them,
+	// so the force on the far particle only comes out right if the upward pass
+	// has summed up every leaf.
+	particles.push_back({
+		{ ACCURACY_PROBE_DISTANCE, 0.5, 0.5, 0.0 },
+		Simulation::Vector(),
+		1.0,
+		1.0
+	});
+	std::vector<Simulation::Particle> result =
+		stepParticles(particles, nbody::SolverSettings());
+	for (Simulation::Particle const& target : result) {
+		if (target.position[0] < ACCURACY_PROBE_DISTANCE / 2) {
+			continue;
+		}
+		std::array<double, 3> force = directForce(result, target);
+		double errorSq = 0;
+		double forceSq = 0;
+		for (unsigned int i = 0; i < 3; ++i) {
+			double difference = target.velocity[i] - force[i];
+			errorSq += difference * difference;
+			forceSq += force[i] * force[i];
+		}
+		return std::sqrt(errorSq / forceSq);
+	}
+	throw std::runtime_error("Far particle was lost");
+}
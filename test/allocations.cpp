@@ -0,0 +1,73 @@
+#include <cstdlib>
+#include <iostream>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "nbody/host/allocation_counter.h"
+#include "nbody/open_cl_simulation.h"
+
+// Checks that a step doesn't allocate on the host once the workspace has grown
+// to fit the simulation. Must be built with NBODY_COUNT_ALLOCATIONS, and runs
+// a single simulation, so that every allocation in the process belongs to it.
+
+using Simulation = nbody::OpenClSimulation;
+
+// Number of steps taken for the workspace to reach its final size.
+#define ALLOCATIONS_WARM_UP_STEPS (4)
+// Number of steps afterwards that must not allocate.
+#define ALLOCATIONS_STEADY_STEPS (8)
+
+int main() {
+	if (!nbody::host::countsAllocations) {
+		std::cout << "Allocations aren't counted in this build.\n";
+		return EXIT_FAILURE;
+	}
+	try {
+		std::mt19937 generator(1);
+		std::uniform_real_distribution<Simulation::Scalar> distribution(0, 1);
+		std::vector<Simulation::Particle> particles;
+		for (std::size_t index = 0; index < 16384; ++index) {
+			Simulation::Vector position = {
+				distribution(generator),
+				distribution(generator),
+				distribution(generator),
+				0.0
+			};
+			particles.push_back({
+				position,
+				Simulation::Vector(),
+				1.0,
+				distribution(generator)
+			});
+		}
+		
+		// The log is thrown away without allocating. The particles hardly move,
+		// so the interactions are the same from one step to the next.
+		std::ostream log(nullptr);
+		Simulation simulation(
+			{ 1.0, 1.0, 1.0, 0.0 },
+			particles,
+			1e-6,
+			log);
+		for (std::size_t step = 0; step < ALLOCATIONS_WARM_UP_STEPS; ++step) {
+			simulation.step();
+		}
+		
+		bool passed = true;
+		for (std::size_t step = 0; step < ALLOCATIONS_STEADY_STEPS; ++step) {
+			simulation.step();
+			std::size_t numAllocations = simulation.stepAllocations();
+			std::cout <<
+				"Steady step " << step << " made " << numAllocations <<
+				" host allocations.\n";
+			passed = passed && numAllocations == 0;
+		}
+		return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	catch (std::exception const& exception) {
+		std::cout << "Error: " << exception.what() << "\n";
+		return EXIT_FAILURE;
+	}
+}